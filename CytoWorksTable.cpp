@@ -33,21 +33,124 @@
 #include "../../../MMDevice/ModuleInterface.h"
 #include "../../../MMDevice/DeviceUtils.h"
 #include "../../../MMDevice/DeviceBase.h"
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
 #include <math.h>
 #include <string>
 #include <sstream>
 #include <iostream>
+#include <iomanip>
 
 //constants
 const char* g_Hub = "CytoTableHub";
 const char* g_XYStageDeviceName = "CytoTableXYStage";
 const char* g_ZStageDeviceName = "ZStage";
 const char* g_Axis_Id = "SingleAxisName";
-//const char* g_LEDName = "LED";
+const char* g_AxisInUseText = "The controller axis is used by another device, pick another SingleAxisName";
+const char* g_JogMode = "JogMode";
+const char* g_JogUpdateRate = "JogUpdateRate-Hz";
+const char* g_JogTimeout = "JogTimeout-ms";
+const char* g_On = "On";
+const char* g_Off = "Off";
+const char* g_AdaptiveDelay = "AdaptiveDelay";
+const char* g_SettleLearning = "SettleLearning";
+const char* g_RecommendedDelay = "RecommendedDelay-ms";
+const char* g_SettleTableFile = "SettleTableFile";
+const char* g_RecordFile = "RecordFile";
+const char* g_ProgramCache = "ProgramCache";
+const char* g_ProgramCacheFile = "ProgramCacheFile";
+const char* g_ProgramCacheHits = "ProgramCacheHits";
+const char* g_ProgramCacheUploads = "ProgramCacheUploads";
+const char* g_LinkReconnects = "LinkReconnects";
+const char* g_LinkRecovery = "LinkRecovery-ms";
+const char* g_AdaptiveProfile = "AdaptiveProfile";
+const char* g_LongMoveSpeed = "LongMoveSpeed";
+const char* g_FineMoveLimit = "FineMoveLimit-um";
+const char* g_LongMoveLimit = "LongMoveLimit-um";
+const char* g_CoordinatedMoves = "CoordinatedMoves";
+const char* g_Calibration = "Calibration";
+const char* g_CalibrationPoint = "CalibrationPoint";
+const char* g_CalibrationPoints = "CalibrationPoints";
+const char* g_CalibrationRms = "CalibrationRMS-steps";
+const char* g_CalibrationRotation = "CalibrationRotation-deg";
+const char* g_CalibrationSkew = "CalibrationSkew";
+const char* g_Sweep = "Sweep";
+const char* g_SweepStart = "SweepStart-um";
+const char* g_SweepEnd = "SweepEnd-um";
+const char* g_SweepSpeed = "SweepSpeed-um/s";
+const char* g_SweepSamples = "SweepSamples";
+const char* g_SweepData = "SweepData";
+const char* g_SweepDropped = "SweepDropped";
+const char* g_Next = "Next";
+const char* g_Idle = "Idle";
+const char* g_Run = "Run";
+const char* g_None = "None";
+const char* g_Clear = "Clear";
+const char* g_PositionUpdates = "PositionUpdates";
+const char* g_PositionUpdateRate = "PositionUpdateRate-Hz";
+const char* g_MotionState = "MotionState";
+const char* g_Moving = "Moving";
+const char* g_MoveQueue = "MoveQueue";
+const char* g_MoveQueueLength = "MoveQueueLength";
+const char* g_LookAheadDepth = "LookAheadDepth";
+
+// info selectors for CytoTableXYStage::OnCalibrationInfo
+enum { CalPoints, CalRms, CalRotation, CalSkew };
+
+// info selectors for Hub::OnProgramCacheInfo
+enum { ProgramHits, ProgramUploads };
+
+// info selectors for Hub::OnLinkInfo
+enum { LinkReconnects, LinkRecovery };
+
+// A controller that misses this many answers in a row is treated like an
+// unplugged port. A running move queue waits this long for the link.
+const int g_TimeoutsBeforeReconnect = 2;
+const double g_LinkWaitMs = 10000.0;
+const double g_ReconnectIntervalMs = 50.0;
+
+// After a failed exchange the line must stay quiet for a command and an
+// answer of this length before the next command goes out
+const unsigned long g_MaxFrameBytes = 64;
+const double g_MinQuietMs = 10.0;
+
+// Motion profiles (j and L values as in the controller manual)
+const long g_FullResolution = 256;
+const long g_CoarseResolution = 16;
+const long g_AccelHigh = 1000;
+const long g_AccelLong = 333;
+const double g_FineSpeedFraction = 0.25;
+// upper bound of FineMoveLimit-um and LongMoveLimit-um
+const double g_MaxMoveLimitUm = 100000.0;
+
+// Room for a full minute of sweep samples at one per exchange
+const size_t g_SweepRingSize = 8192;
+
+// Settled once two encoder reads this close follow each other, giving up after
+// g_SettleTimeoutMs so a hunting servo loop can not hang Busy()
+const long g_SettleToleranceSteps = 2;
+const double g_SettleTimeoutMs = 2000.0;
+
+// Move queue: targets waiting on the host, and the command string length
+// after which no further target is added to a look-ahead program (the
+// controller buffer holds 255 characters)
+const size_t g_MoveQueueCapacity = 256;
+const std::streamoff g_MaxProgramLength = 200;
+const long g_ArrivalToleranceSteps = 2;
+const char* g_LEDName = "LED";
+const char* g_Output = "Output";
+const char* g_TriggerInput = "TriggerInput";
+
+// "H11J1H01J0" per LED sequence step
+const long g_LEDStepLength = 10;
+const long g_LEDMaxSequence = (long) g_MaxProgramLength / g_LEDStepLength;
 
 using namespace std;
 
+// MMCore name of serial port
+std::string port_ = "";
+
 ///////////////////////////////////////////////////////////////////////////////
 // Exported MMDevice API
 ///////////////////////////////////////////////////////////////////////////////
@@ -56,7 +159,7 @@ MODULE_API void InitializeModuleData()
 	RegisterDevice(g_Hub, MM::HubDevice, "CytoTableHub (required)");
 	RegisterDevice(g_XYStageDeviceName, MM::XYStageDevice, "CytoTableXYStage");
 	RegisterDevice(g_ZStageDeviceName, MM::StageDevice, "ZStage");
-	//RegisterDevice(g_LEDName, MM::ShutterDevice, "LED");
+	RegisterDevice(g_LEDName, MM::ShutterDevice, "LED");
 }
 
 MODULE_API MM::Device* CreateDevice(const char* deviceName)
@@ -77,6 +180,11 @@ MODULE_API MM::Device* CreateDevice(const char* deviceName)
 		ZStage* pZStage = new ZStage();
 		return pZStage;
 	}
+	if (strcmp(deviceName, g_LEDName) == 0)
+	{
+		LEDShutter* pLEDShutter = new LEDShutter();
+		return pLEDShutter;
+	}
 	return 0;
 }
 
@@ -102,12 +210,35 @@ int clearPort(MM::Device& device, MM::Core& core, const char* port)
 }
 
 
+// Controller address of a named axis
+int GetAxisAddress(const std::string& id)
+{
+   if (id == "X")
+      return 1;
+   if (id == "Y")
+      return 2;
+   return 3;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 //Hub
 ///////////////////////////////////////////////////////////////////////////////
 Hub::Hub() :
 	transmissionDelay_(10),
-	initialized_(false)
+	initialized_(false),
+	monitorThread_(0),
+	positionUpdates_(false),
+	positionUpdateRateHz_(10.0),
+	programCacheEnabled_(false),
+	programCacheHits_(0),
+	programCacheUploads_(0),
+	linkLost_(false),
+	reconnecting_(false),
+	purgeBeforeNext_(false),
+	consecutiveTimeouts_(0),
+	linkReconnects_(0),
+	linkRecoveryMs_(0.0)
 {
    InitializeDefaultErrorMessages();
 
@@ -115,6 +246,19 @@ Hub::Hub() :
    SetErrorText(ERR_NO_PORT_SET, "Hub device not found. Connect to Hub first.");
    SetErrorText(ERR_SERIAL_COMMAND_FAILED, "Unable to connect to the port. Is the device		connected?");
    SetErrorText(ERR_NO_ANSWER, "No answer from the controller.  Is it connected?");
+   SetErrorText(ERR_SETTLE_TABLE_IO, "Unable to read or write the settle table file");
+   SetErrorText(ERR_RECORD_FILE, "Unable to create the serial recording file");
+   SetErrorText(ERR_INVALID_UPDATE_RATE, "Position update rate must be between 1 and 100 Hz");
+   SetErrorText(ERR_PROGRAM_CACHE_IO, "Unable to write the program cache file");
+   SetErrorText(ERR_LINK_LOST, "Serial link to the controller lost, reconnecting");
+   SetErrorText(ERR_AXIS_IN_USE, g_AxisInUseText);
+
+   for (int axis = 0; axis <= MaxAxis; axis++)
+   {
+      axisAnswered_[axis] = false;
+      axisOwners_[axis] = 0;
+      sequenceRunning_[axis] = false;
+   }
    
    // Port:
    CPropertyAction* pAct = new CPropertyAction(this, &Hub::OnPort);
@@ -124,6 +268,7 @@ Hub::Hub() :
 Hub::~Hub()
 {
    Shutdown();
+   delete monitorThread_;
 }
 
 void Hub::GetName(char* name) const
@@ -188,6 +333,70 @@ int Hub::Initialize()
 	if (DEVICE_OK != ret)
 		return ret;
 
+	// Learned settle times, shared by all axes and kept across sessions
+	CPropertyAction* pAct = new CPropertyAction(this, &Hub::OnSettleTableFile);
+	ret = CreateProperty(g_SettleTableFile, "", MM::String, false, pAct);
+	if (DEVICE_OK != ret)
+		return ret;
+
+	// Binary recording of all controller traffic, off while empty
+	pAct = new CPropertyAction(this, &Hub::OnRecordFile);
+	ret = CreateProperty(g_RecordFile, "", MM::String, false, pAct);
+	if (DEVICE_OK != ret)
+		return ret;
+
+	// Push position and motion state changes to the stages' listeners
+	// instead of waiting to be polled
+	pAct = new CPropertyAction(this, &Hub::OnPositionUpdates);
+	ret = CreateProperty(g_PositionUpdates, g_Off, MM::String, false, pAct);
+	if (DEVICE_OK != ret)
+		return ret;
+	AddAllowedValue(g_PositionUpdates, g_Off);
+	AddAllowedValue(g_PositionUpdates, g_On);
+
+	pAct = new CPropertyAction(this, &Hub::OnPositionUpdateRate);
+	ret = CreateProperty(g_PositionUpdateRate, "10.0", MM::Float, false, pAct);
+	if (DEVICE_OK != ret)
+		return ret;
+	SetPropertyLimits(g_PositionUpdateRate, 1.0, 100.0);
+
+	// Keep sequence programs in the controller's program storage and run
+	// them from there when they come again
+	pAct = new CPropertyAction(this, &Hub::OnProgramCache);
+	ret = CreateProperty(g_ProgramCache, g_Off, MM::String, false, pAct);
+	if (DEVICE_OK != ret)
+		return ret;
+	AddAllowedValue(g_ProgramCache, g_Off);
+	AddAllowedValue(g_ProgramCache, g_On);
+
+	// Which slot holds which program, so the next session can reuse them
+	pAct = new CPropertyAction(this, &Hub::OnProgramCacheFile);
+	ret = CreateProperty(g_ProgramCacheFile, "", MM::String, false, pAct);
+	if (DEVICE_OK != ret)
+		return ret;
+
+	CPropertyActionEx* pActEx = new CPropertyActionEx(this, &Hub::OnProgramCacheInfo, ProgramHits);
+	ret = CreateProperty(g_ProgramCacheHits, "0", MM::Integer, true, pActEx);
+	if (DEVICE_OK != ret)
+		return ret;
+
+	pActEx = new CPropertyActionEx(this, &Hub::OnProgramCacheInfo, ProgramUploads);
+	ret = CreateProperty(g_ProgramCacheUploads, "0", MM::Integer, true, pActEx);
+	if (DEVICE_OK != ret)
+		return ret;
+
+	// How often the port was reopened after a dropout, and how long the
+	// last reopen and state read-back took
+	pActEx = new CPropertyActionEx(this, &Hub::OnLinkInfo, LinkReconnects);
+	ret = CreateProperty(g_LinkReconnects, "0", MM::Integer, true, pActEx);
+	if (DEVICE_OK != ret)
+		return ret;
+
+	pActEx = new CPropertyActionEx(this, &Hub::OnLinkInfo, LinkRecovery);
+	ret = CreateProperty(g_LinkRecovery, "0.0", MM::Float, true, pActEx);
+	if (DEVICE_OK != ret)
+		return ret;
+
 	ret = UpdateStatus();
 	if (ret != DEVICE_OK)
 		return ret;
@@ -200,7 +409,16 @@ int Hub::Initialize()
 int Hub::Shutdown()
 {
    if (initialized_)
+   {
+      StopPositionUpdates();
+      if (!settleTableFile_.empty())
+         settleTable_.Save(settleTableFile_);
+      if (!programCacheFile_.empty())
+         programCache_.Save(programCacheFile_);
+      MMThreadGuard guard(executeLock_);
+      recorder_.Close();
       initialized_ = false;
+   }
 
    return DEVICE_OK;
 }
@@ -213,7 +431,7 @@ int Hub::DetectInstalledDevices()
       peripherals.clear();
       peripherals.push_back(g_XYStageDeviceName);
 	  peripherals.push_back(g_ZStageDeviceName);
-	  //peripherals.push_back(g_LEDName);
+	  peripherals.push_back(g_LEDName);
       for (size_t i=0; i < peripherals.size(); i++) 
       {
          MM::Device* pDev = ::CreateDevice(peripherals[i].c_str());
@@ -246,554 +464,4007 @@ int Hub::OnPort(MM::PropertyBase* pProp, MM::ActionType pAct)
    return DEVICE_OK;
 }
 
-//////////////////////////////////////////////////////////////////////////////
-// XYStage
-// * XYStage - two axis stage device
-//////////////////////////////////////////////////////////////////////////////
-CytoTableXYStage::CytoTableXYStage() :
-	initialized_(false), 
-	stepSizeXUm_(0.1), //Trying this out and seeing what happens
-	stepSizeYUm_(0.1), //Trying this out and seeing what happens
-	speed_(2500.0), //Trying this out and seeing what happens
-	//maxSpeed_ (7.5),- This is from ASI - do we need it?
-	originX_(0),
-	originY_(0)
+int Hub::OnSettleTableFile(MM::PropertyBase* pProp, MM::ActionType pAct)
 {
-	InitializeDefaultErrorMessages();
-	// create pre-initialization properties
-	SetErrorText(ERR_NO_HUB, "Please add the Hub device first!");
-
-	CreateProperty(MM::g_Keyword_Name, g_XYStageDeviceName, MM::String, true);
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(settleTableFile_.c_str());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      string file;
+      pProp->Get(file);
+      if (file == settleTableFile_)
+         return DEVICE_OK;
 
-	//Description
-	CreateProperty(MM::g_Keyword_Description, "CytoWorksTable XY stage driver adapter", MM::String, true);
+      // keep what was learned so far, then continue from the new file if it exists
+      if (!settleTableFile_.empty() && !settleTable_.Save(settleTableFile_))
+         return ERR_SETTLE_TABLE_IO;
+      settleTableFile_ = file;
+      if (!settleTableFile_.empty() && !settleTable_.Load(settleTableFile_))
+         LogMessage("Starting a new settle table: " + settleTableFile_, true);
+   }
+   return DEVICE_OK;
 }
 
-CytoTableXYStage::~CytoTableXYStage()
+int Hub::OnProgramCache(MM::PropertyBase* pProp, MM::ActionType pAct)
 {
-   Shutdown();
+   if (pAct == MM::BeforeGet)
+   {
+      MMThreadGuard guard(stateLock_);
+      pProp->Set(programCacheEnabled_ ? g_On : g_Off);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      string value;
+      pProp->Get(value);
+      MMThreadGuard guard(stateLock_);
+      programCacheEnabled_ = (value == g_On);
+   }
+   return DEVICE_OK;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// XYStage methods required by the API
-///////////////////////////////////////////////////////////////////////////////
-void CytoTableXYStage::GetName(char* Name) const
+int Hub::OnProgramCacheFile(MM::PropertyBase* pProp, MM::ActionType pAct)
 {
-   CDeviceUtils::CopyLimitedString(Name, g_XYStageDeviceName);
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(programCacheFile_.c_str());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      string file;
+      pProp->Get(file);
+      if (file == programCacheFile_)
+         return DEVICE_OK;
+
+      // the slots are the same controller's, so the index carries over
+      // unless the new file has one
+      if (!programCacheFile_.empty() && !programCache_.Save(programCacheFile_))
+         return ERR_PROGRAM_CACHE_IO;
+      programCacheFile_ = file;
+      if (!programCacheFile_.empty() && !programCache_.Load(programCacheFile_))
+         LogMessage("Starting a new program cache: " + programCacheFile_, true);
+   }
+   return DEVICE_OK;
 }
 
-int CytoTableXYStage::Initialize()
+int Hub::OnProgramCacheInfo(MM::PropertyBase* pProp, MM::ActionType pAct, long info)
 {
-	//const char* cmd = "/1?9R";
-	//int response = SendSerialCommand(port_.c_str(), cmd, "\r");
-	/*//Clear the x port, set x current, set x resolution, set top speed, set hold current, set	   acceleration factor, reverse x positive to negative
-	This is what jason did - I've included Ludl's code too
-	int ret = SetCommand("/1?9R");//this one isn't right - need to set a separate method for this!!
-	int ret = SetCommand("/1m40R");
-	int ret = SetCommand("/1j256R");
-	int ret = SetCommand("/1V64000R");
-	int ret = SetCommand("/1h50R");
-	int ret = SetCommand("/1L1000R");
-	int ret = SetCommand("/1F1R");*/
-
-	/*string command;
-	command = "/1?R";
-	command = "/1m40R";
-	command = "/1j256R";
-	command = "/1V20320R";
-	command = "/1h50R";
-	command = "/1L333R";
-	command = "/1F1R";
-	command = "/2?9R";
-	command = "/2m40R";
-	command = "/2j256R";
-	command = "/2V20320R";
-	command = "/2h50R";
-	command = "/2L333R";
-	command = "/2F1R";
-	command = "/1z2500000R";
-	command = "/1A0R";*/
-
-	
-	// Step size - need to set actual step size #
-	CPropertyAction* pAct = new CPropertyAction (this, &CytoTableXYStage::OnStepSizeX);
-	int ret = CreateProperty("StepSize-X", "0.1", MM::Float, false, pAct);
-	if (ret != DEVICE_OK)
-		return ret;
+   if (pAct == MM::BeforeGet)
+   {
+      MMThreadGuard guard(stateLock_);
+      pProp->Set(info == ProgramHits ? programCacheHits_ : programCacheUploads_);
+   }
+   return DEVICE_OK;
+}
 
-	// Step size - need to set actual step size #
-	pAct = new CPropertyAction (this, &CytoTableXYStage::OnStepSizeY);
-	ret = CreateProperty("StepSize-Y", "0.1", MM::Float, false, pAct);
-	if (ret != DEVICE_OK)
-		return ret;
+int Hub::OnLinkInfo(MM::PropertyBase* pProp, MM::ActionType pAct, long info)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      MMThreadGuard guard(stateLock_);
+      if (info == LinkReconnects)
+         pProp->Set(linkReconnects_);
+      else
+         pProp->Set(linkRecoveryMs_);
+   }
+   return DEVICE_OK;
+}
 
-	// Speed (in um/sec) - need to set actual speed
-	pAct = new CPropertyAction (this, &CytoTableXYStage::OnSpeed);
-	ret = CreateProperty("Speed", "2500.0", MM::Float, false, pAct);
-	if (ret != DEVICE_OK)
-		 return ret;
+int Hub::OnRecordFile(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(recordFile_.c_str());
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      string file;
+      pProp->Get(file);
 
-	ret = UpdateStatus();
-	if (ret != DEVICE_OK)
-		 return ret;
+      MMThreadGuard guard(executeLock_);
+      recorder_.Close();
+      recordFile_ = "";
+      if (!file.empty())
+      {
+         if (!recorder_.Open(file))
+         {
+            pProp->Set("");
+            return ERR_RECORD_FILE;
+         }
+         recordFile_ = file;
+      }
+   }
+   return DEVICE_OK;
+}
 
-	initialized_ = true;
-	return DEVICE_OK;
+int Hub::OnPositionUpdates(MM::PropertyBase* pProp, MM::ActionType pAct)
+{
+   if (pAct == MM::BeforeGet)
+   {
+      pProp->Set(positionUpdates_ ? g_On : g_Off);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      string value;
+      pProp->Get(value);
+      if (value == g_On)
+         return StartPositionUpdates();
+      StopPositionUpdates();
+   }
+   return DEVICE_OK;
 }
 
-int CytoTableXYStage::Shutdown()
+int Hub::OnPositionUpdateRate(MM::PropertyBase* pProp, MM::ActionType pAct)
 {
-   if (initialized_)
+   if (pAct == MM::BeforeGet)
    {
-      initialized_ = false;
+      pProp->Set(positionUpdateRateHz_);
+   }
+   else if (pAct == MM::AfterSet)
+   {
+      double rate;
+      pProp->Get(rate);
+      if (rate < 1.0 || rate > 100.0)
+      {
+         pProp->Set(positionUpdateRateHz_);
+         return ERR_INVALID_UPDATE_RATE;
+      }
+      MMThreadGuard guard(stateLock_);
+      positionUpdateRateHz_ = rate;
    }
    return DEVICE_OK;
 }
 
-bool CytoTableXYStage::Busy() 
-{//this does not work at all :(
-	//Need to check if either X or Y is busy - If yes, return true, if no, return false
-   //if (AxisBusy("1") || AxisBusy("2"))
-     // return true;
-   return false;
+//////////////// Controller communication (Hub) /////////////////
+int Hub::ExecuteCommand(const std::string& cmd, std::string& data)
+{
+	bool ready;
+	return ExecuteCommand(cmd, data, ready);
 }
 
-int CytoTableXYStage::SetPositionSteps(long x, long y)
+// A port error, e.g. from an unplugged USB adapter, or a run of timeouts
+// reopens the port. The command is sent again only when it never left the
+// port or is a query: a move that may have started must not run twice.
+int Hub::ExecuteCommand(const std::string& cmd, std::string& data, bool& ready)
 {
-	ostringstream cmdX, cmdY;
-	cmdX << "/1P" << x << "R";//will need to change to A eventually
-	cmdY << "/2P" << y << "R";
-	
-	//check if we are busy - X first
-	int retX = SendSerialCommand(port_.c_str(), cmdX.str().c_str(), "\r");
-	if (retX != DEVICE_OK)
-      return retX;
-
-	string responseX;
-	retX = GetSerialAnswer(port_.c_str(), "\r", responseX);
-	if (retX != DEVICE_OK) 
-      return retX;
-	if (responseX.length() < 1)
-      return ERR_NO_ANSWER;
-
-	istringstream is(responseX);
-	string outcomeX;
-	is >> outcomeX;
-
-	//now, check if Y is busy
-	int retY = SendSerialCommand(port_.c_str(), cmdY.str().c_str(), "\r");
-	if (retY != DEVICE_OK)
-      return retY;
-  
-	string responseY;
-	retY = GetSerialAnswer(port_.c_str(), "\n", responseY);
-	if (retY != DEVICE_OK) 
-      return retY;
-	if (responseY.length() < 1)
-      return ERR_NO_ANSWER;
-
-	istringstream isY(responseY);
-	string outcomeY;
-	isY >> outcomeY;
-
-	if (outcomeX.compare("/0@`") == 0) 
-	{
-		if (outcomeY.compare("/1@`")==0)
-		{
-			return DEVICE_OK; // success!
-		}
+	MMThreadGuard guard(executeLock_);
+
+	if (linkLost_ && !reconnecting_)
+	{
+		int ret = Reconnect();
+		if (ret != DEVICE_OK)
+			return ret;
 	}
-      //Should device ok be out here?
 
-   // figure out the error code
-	int code;
-	is >> code;
-	return code;
+	bool sent, portError;
+	int ret = Exchange(cmd, data, ready, sent, portError);
+	if (reconnecting_)
+		return ret;
+	if (ret == DEVICE_SERIAL_TIMEOUT)
+		consecutiveTimeouts_++;
+	else if (!portError)
+		consecutiveTimeouts_ = 0;
+	if (!portError && consecutiveTimeouts_ < g_TimeoutsBeforeReconnect)
+		return ret;
 
-	int codeY;
-	isY >> codeY;
-	return codeY;
+	int reconnected = Reconnect();
+	if (reconnected != DEVICE_OK)
+		return reconnected;
+	bool query = cmd.length() > 2 && (cmd[2] == '?' || cmd.compare(2, string::npos, "QR") == 0);
+	if (sent && !query)
+		return ret;
+	return Exchange(cmd, data, ready, sent, portError);
 }
 
-int CytoTableXYStage::SetRelativePositionSteps(long x, long y)
+int Hub::Exchange(const std::string& cmd, std::string& data, bool& ready, bool& sent, bool& portError)
 {
-	ostringstream cmdX, cmdY;
-	cmdX << "/1P" << x << "R";
-	cmdY << "/2P" << y << "R";
-
-	//check if we are busy - X first
-	int retX = SendSerialCommand(port_.c_str(), cmdX.str().c_str(), "\r");
-	if (retX != DEVICE_OK)
-      return retX;
-
-	string responseX;
-	retX = GetSerialAnswer(port_.c_str(), "\r", responseX);
-	if (retX != DEVICE_OK) 
-      return retX;
-	if (responseX.length() < 1)
-      return ERR_NO_ANSWER;
-
-	istringstream is(responseX);
-	string outcomeX;
-	is >> outcomeX;
-
-	//now, check if Y is busy
-	int retY = SendSerialCommand(port_.c_str(), cmdY.str().c_str(), "\r");
-	if (retY != DEVICE_OK)
-      return retY;
-  
-	string responseY;
-	retY = GetSerialAnswer(port_.c_str(), "\n", responseY);
-	if (retY != DEVICE_OK) 
-      return retY;
-	if (responseY.length() < 1)
-      return ERR_NO_ANSWER;
-
-	istringstream isY(responseY);
-	string outcomeY;
-	isY >> outcomeY;
-
-	if (outcomeX.compare("/0@`") == 0) 
-	{
-		if (outcomeY.compare("/1@`")==0)
+	// an answer that came after its timeout would be taken for the next one
+	if (purgeBeforeNext_)
+	{
+		int ret = DrainPort();
+		if (ret != DEVICE_OK)
 		{
-			return DEVICE_OK; // success!
+			sent = false;
+			portError = true;
+			return ret;
 		}
+		purgeBeforeNext_ = false;
 	}
-      //Should device ok be out here?
 
-   // figure out the error code
-	int code;
-	is >> code;
-	return code;
+	uint32_t exchange = 0;
+	if (recorder_.IsOpen())
+	{
+		exchange = recorder_.NextExchange();
+		recorder_.Record(exchange, RecordSent, cmd, DEVICE_OK);
+	}
+
+	int ret = SendSerialCommand(port_.c_str(), cmd.c_str(), "\r");
+	sent = ret == DEVICE_OK;
+	string answer;
+	if (sent)
+		ret = GetSerialAnswer(port_.c_str(), "\n", answer);
+	portError = !sent || (ret != DEVICE_OK && ret != DEVICE_SERIAL_TIMEOUT && ret != DEVICE_BUFFER_OVERFLOW);
+	if (ret == DEVICE_OK && answer.length() < 1)
+		ret = ERR_NO_ANSWER;
+	// a late answer that slipped past the drain comes before our own
+	if (ret == DEVICE_OK && !AnswerFits(cmd, answer))
+	{
+		if (recorder_.IsOpen())
+			recorder_.Record(exchange, RecordReceived, answer, ERR_UNRECOGNIZED_ANSWER);
+		LogMessage("Discarded stale answer " + answer, true);
+		answer.clear();
+		ret = GetSerialAnswer(port_.c_str(), "\n", answer);
+		portError = ret != DEVICE_OK && ret != DEVICE_SERIAL_TIMEOUT && ret != DEVICE_BUFFER_OVERFLOW;
+		if (ret == DEVICE_OK && !AnswerFits(cmd, answer))
+			ret = ERR_UNRECOGNIZED_ANSWER;
+	}
+	if (ret != DEVICE_OK)
+		purgeBeforeNext_ = true;
 
-	int codeY;
-	isY >> codeY;
-	return codeY;
+	if (recorder_.IsOpen())
+		recorder_.Record(exchange, RecordReceived, answer, ret);
+	if (ret == DEVICE_OK)
+		ret = ParseAnswer(answer, data, ready);
+
+	TrackCommand(cmd, ret == DEVICE_OK, data, ready);
+	return ret;
 }
 
-int CytoTableXYStage::GetPositionSteps(long& x, long& y)
+// Drops input until the line has been quiet for a whole command and answer
+// at the port's baud rate, so that an answer still on its way is not read
+// as the answer to the next command
+int Hub::DrainPort()
 {
-	PurgeComPort(port_.c_str());
-	
-	//NEED TO COMPLETELY REDO THIS!!
-
-	const char* cmdX = "/1?0R";
-	//const char* cmdY = "/2?0";
-
-	//check if we are busy - X first
-	int retX = SendSerialCommand(port_.c_str(), cmdX, "\r");//or is term "R"?
-	if (retX != DEVICE_OK)
-		return retX;
-  
-	//string responseX;
-	//retX = GetSerialAnswer(port_.c_str(), "\r", responseX);
-	//if (retX != DEVICE_OK) 
- //     return retX;
-	//if (responseX.length() < 1)
- //     return ERR_NO_ANSWER;
-
-	//istringstream is(responseX);
-	//string outcomeX;
-	//is >> outcomeX;
-
-	//if (outcomeX.compare("/0@`") == 0) 
-	//{
-	//	//if (outcomeY.compare("/1@`")==0)
-	//	//{
-	//		is >> x;
-			return DEVICE_OK; // success!
-	//	//}
-	//}
- //     //Should device ok be out here?
-	//y;
-
- //  // figure out the error code
-	//int code;
-	//is >> code;
-	//return code;
+	double baud = 9600.0;
+	char value[MM::MaxStrLength] = "";
+	if (GetCoreCallback()->GetDeviceProperty(port_.c_str(), MM::g_Keyword_BaudRate, value) == DEVICE_OK && atof(value) > 0)
+		baud = atof(value);
+	// ten bits per byte with start and stop bit
+	double quietMs = 2 * g_MaxFrameBytes * 10 * 1000.0 / baud;
+	if (quietMs < g_MinQuietMs)
+		quietMs = g_MinQuietMs;
 
+	const unsigned int bufSize = 255;
+	unsigned char buf[bufSize];
+	MM::MMTime quietSince = GetCurrentMMTime();
+	while ((GetCurrentMMTime() - quietSince).getMsec() < quietMs)
+	{
+		unsigned long read = 0;
+		int ret = GetCoreCallback()->ReadFromSerial(this, port_.c_str(), buf, bufSize, read);
+		if (ret != DEVICE_OK)
+			return ret;
+		if (read > 0)
+			quietSince = GetCurrentMMTime();
+		else
+			CDeviceUtils::SleepMs(1);
+	}
+	return DEVICE_OK;
 }
 
-int CytoTableXYStage::SetOrigin()
+// Answers carry no axis or command, so a late one can only be told apart by
+// its form. Position and status queries are checked: a status byte with
+// only the ready bit and an error code in it, then the position for ?0 and
+// nothing for QR. Other commands take what comes.
+bool Hub::AnswerFits(const std::string& cmd, const std::string& answer)
 {
-	PurgeComPort(port_.c_str());
-	//Defines current position as origin (0,0) coordinate of the controller
-	const char* cmdX = "/1z0R";
-	const char* cmdY = "/2z0R";
-	//check if we are busy - X first
-	int retX = SendSerialCommand(port_.c_str(), cmdX, "\r");//or is term "R"?
-	if (retX != DEVICE_OK)
-		return retX;
-  
-	string responseX;
-	retX = GetSerialAnswer(port_.c_str(), "\r", responseX);
-
-	//check if we are busy - now Y
-	int retY = SendSerialCommand(port_.c_str(), cmdY, "\r");//maybe wrong term?
-	if (retY != DEVICE_OK)
-		return retY;
-
-	string responseY;
-	retY = GetSerialAnswer(port_.c_str(), "\r", responseY);
+	if (cmd.length() < 3)
+		return true;
+	string body = cmd.substr(2);
+	if (body != "?0R" && body != "QR")
+		return true;
 
-	//return the answer
-	long xStep, yStep;
-	int answer = GetPositionSteps(xStep, yStep);
-	if (answer != DEVICE_OK)
-		return answer;
-	originX_ = xStep * stepSizeXUm_;
-	originY_ = yStep * stepSizeYUm_;
-	
-	return DEVICE_OK;
-	
+	string::size_type start = answer.find("/0");
+	if (start == string::npos || answer.length() < start + 3)
+		return false;
+	unsigned char status = (unsigned char) answer[start + 2];
+	if ((status & 0xD0) != 0x40)
+		return false;
+	string::size_type end = answer.find('\x03', start + 3);
+	if (end == string::npos)
+		return false;
+	string data = answer.substr(start + 3, end - (start + 3));
+	if (body == "QR")
+		return data.empty();
+
+	string::size_type digits = data.length() > 0 && data[0] == '-' ? 1 : 0;
+	return data.length() > digits && data.find_first_not_of("0123456789", digits) == string::npos;
 }
 
-int CytoTableXYStage::Home()
+// Nothing comes back, so only a failed write tells of a dead port; the
+// frame did not leave and is sent again after the reconnect
+int Hub::BroadcastCommand(const std::string& cmd)
 {
-	PurgeComPort(port_.c_str());
+	MMThreadGuard guard(executeLock_);
 
-	
-//some other stuff goes in here
-return DEVICE_OK;
+	int ret = linkLost_ ? Reconnect() : DEVICE_OK;
+	for (int attempt = 0; attempt < 2 && ret == DEVICE_OK; attempt++)
+	{
+		if (recorder_.IsOpen())
+			recorder_.Record(recorder_.NextExchange(), RecordSent, cmd, DEVICE_OK);
+		ret = SendSerialCommand(port_.c_str(), cmd.c_str(), "\r");
+		if (ret == DEVICE_OK)
+		{
+			TrackCommand(cmd, false, "", false);
+			break;
+		}
+		if (reconnecting_ || attempt > 0)
+			break;
+		ret = Reconnect();
+	}
+	return ret;
 }
 
-int CytoTableXYStage::Stop()
+int Hub::WaitForLink(double timeoutMs)
 {
-	PurgeComPort(port_.c_str());
+	MM::MMTime start = GetCurrentMMTime();
+	while (true)
+	{
+		{
+			MMThreadGuard guard(executeLock_);
+			if (!linkLost_ || Reconnect() == DEVICE_OK)
+				return DEVICE_OK;
+		}
+		if ((GetCurrentMMTime() - start).getMsec() > timeoutMs)
+			return ERR_LINK_LOST;
+		CDeviceUtils::SleepMs((long) g_ReconnectIntervalMs);
+	}
+}
 
-	//give the command
-	const char* cmdX = "/1TR";
-	const char* cmdY = "/2TR";
-	
-	//check to make sure it worked - check that X stopped first
-	int retX = SendSerialCommand(port_.c_str(), cmdX, "\r"); //is R the correct terminating character? or is it \r?
-	if (retX != DEVICE_OK)
-		return retX;
+// Reopens the port the way DetectDevice opens it, which keeps the settings
+// of the port device, then reads back what the controller did meanwhile.
+// Called with executeLock_ held.
+int Hub::Reconnect()
+{
+	MM::MMTime start = GetCurrentMMTime();
+	if (!linkLost_)
+	{
+		linkLost_ = true;
+		LogMessage("Serial link to the controller lost, reconnecting", false);
+	}
 
-	string responseX;
-	retX = GetSerialAnswer(port_.c_str(), "\r", responseX); //correct terminating char?
+	MM::Device* port = GetCoreCallback()->GetDevice(this, port_.c_str());
+	if (!port)
+		return ERR_LINK_LOST;
+	port->Shutdown();
+	// a run of timeouts may leave an answer still on its way
+	if (port->Initialize() != DEVICE_OK || DrainPort() != DEVICE_OK)
+		return ERR_LINK_LOST;
+	purgeBeforeNext_ = false;
+	consecutiveTimeouts_ = 0;
 
-   //check that Y stopped
-	int retY = SendSerialCommand(port_.c_str(), cmdY, "\r"); //correct terminating character? 
-	if (retY != DEVICE_OK)
-		return retY;
+	reconnecting_ = true;
+	int ret = ResyncState();
+	reconnecting_ = false;
+	if (ret != DEVICE_OK)
+		return ERR_LINK_LOST;
+	linkLost_ = false;
 
-	string responseY;
-	retY = GetSerialAnswer(port_.c_str(), "\r", responseY); //correct terminating char?
-	
+	double ms = (GetCurrentMMTime() - start).getMsec();
+	{
+		MMThreadGuard stateGuard(stateLock_);
+		linkReconnects_++;
+		linkRecoveryMs_ = ms;
+	}
+	ostringstream os;
+	os << "Reconnected to the controller in " << ms << " ms";
+	LogMessage(os.str().c_str(), false);
+	return DEVICE_OK;
+}
+
+// Nothing cached from before the dropout is trusted. One position query per
+// axis that answered before brings back where it is and whether a move or a
+// program is still running on it; programs in the controller's storage are
+// read back before their next use, in case the controller was reset too.
+int Hub::ResyncState()
+{
+	vector<int> axes;
+	{
+		MMThreadGuard guard(stateLock_);
+		for (int axis = 1; axis <= MaxAxis; axis++)
+		{
+			axisStates_[axis].valid = false;
+			axisStates_[axis].ready = false;
+			if (axisAnswered_[axis])
+				axes.push_back(axis);
+		}
+	}
+	programCache_.Unverify();
+
+	for (size_t i = 0; i < axes.size(); i++)
+	{
+		long steps;
+		bool ready;
+		int ret = GetAxisPosition(axes[i], steps, ready);
+		if (ret != DEVICE_OK)
+			return ret;
+		if (!ready)
+		{
+			ostringstream os;
+			os << "Axis " << axes[i] << " is still running after the reconnect";
+			LogMessage(os.str().c_str(), true);
+		}
+	}
+	return DEVICE_OK;
+}
+
+int Hub::RunProgram(int axis, const std::string& program, bool start)
+{
+	// no other frame may get between the upload and the start
+	MMThreadGuard guard(executeLock_);
+
+	ostringstream cmd;
+	cmd << "/" << axis;
+	bool cached;
+	{
+		MMThreadGuard stateGuard(stateLock_);
+		cached = programCacheEnabled_;
+	}
+	if (cached)
+	{
+		int slot;
+		int ret = SelectStoredProgram(axis, program, slot);
+		if (ret != DEVICE_OK)
+			return ret;
+		cmd << "e" << slot;
+	}
+	else
+		cmd << program;
+	if (start)
+		cmd << "R";
+
+	string answer;
+	return ExecuteCommand(cmd.str(), answer);
+}
+
+// A slot from an earlier session is read back once before it is trusted;
+// an empty or different slot on the controller counts as a miss
+int Hub::SelectStoredProgram(int axis, const std::string& program, int& slot)
+{
+	unsigned long long hash = ProgramCache::Hash(program);
+	bool verified = false;
+	slot = programCache_.Find(axis, hash, verified);
+	if (slot >= 0 && !verified)
+	{
+		ostringstream query;
+		query << "/" << axis << "?s" << slot << "R";
+		string stored;
+		if (ExecuteCommand(query.str(), stored) == DEVICE_OK && ProgramCache::Hash(stored) == hash)
+			programCache_.MarkVerified(axis, slot);
+		else
+		{
+			programCache_.Forget(axis, slot);
+			slot = -1;
+		}
+	}
+
+	if (slot >= 0)
+	{
+		programCache_.Touch(axis, slot);
+		MMThreadGuard stateGuard(stateLock_);
+		programCacheHits_++;
+		return DEVICE_OK;
+	}
+
+	slot = programCache_.SelectSlot(axis);
+	if (slot < 0)
+		return ERR_INVALID_DEVICE_NUMBER;
+	ostringstream store;
+	store << "/" << axis << "s" << slot << program << "R";
+	string answer;
+	int ret = ExecuteCommand(store.str(), answer);
+	if (ret != DEVICE_OK)
+	{
+		programCache_.Forget(axis, slot);
+		return ret;
+	}
+	programCache_.Store(axis, slot, hash);
+	MMThreadGuard stateGuard(stateLock_);
+	programCacheUploads_++;
+	return DEVICE_OK;
+}
+
+// Answers look like "/0<status><data><ETX>\r\n". Bit 5 of the status byte is
+// set when the addressed axis is ready, the low nibble holds the error code.
+int Hub::ParseAnswer(const std::string& answer, std::string& data, bool& ready)
+{
+	string::size_type start = answer.find("/0");
+	if (start == string::npos || answer.length() < start + 3)
+		return ERR_UNRECOGNIZED_ANSWER;
+
+	unsigned char status = (unsigned char) answer[start + 2];
+	ready = (status & 0x20) != 0;
+
+	string::size_type end = answer.find('\x03', start + 3);
+	if (end == string::npos)
+		end = answer.find_last_not_of("\r\n") + 1;
+	data = answer.substr(start + 3, end - (start + 3));
+
+	int code = status & 0x0F;
+	if (code != 0)
+	{
+		ostringstream os;
+		os << "Controller error " << code << " in answer " << answer;
+		LogMessage(os.str().c_str(), false);
+		return ERR_COMMAND_FAILED;
+	}
+	return DEVICE_OK;
+}
+
+int Hub::QueryAxisReady(int axis, bool& ready)
+{
+	// an axis stays ready until the next command, which clears the flag
+	if (axis >= 1 && axis <= MaxAxis)
+	{
+		MMThreadGuard guard(stateLock_);
+		if (positionUpdates_ && axisStates_[axis].ready)
+		{
+			ready = true;
+			return DEVICE_OK;
+		}
+	}
+
+	ostringstream cmd;
+	cmd << "/" << axis << "QR";
+	string data;
+	return ExecuteCommand(cmd.str(), data, ready);
+}
+
+int Hub::GetAxisPosition(int axis, long& steps)
+{
+	// The monitor keeps moving axes at most one period old; a position
+	// read after the axis became ready stays exact until the next command.
+	if (axis >= 1 && axis <= MaxAxis)
+	{
+		MMThreadGuard guard(stateLock_);
+		const AxisState& state = axisStates_[axis];
+		if (positionUpdates_ && state.valid && (state.ready ||
+			(GetCurrentMMTime() - state.polled).getMsec() < 1000.0 / positionUpdateRateHz_))
+		{
+			steps = state.steps;
+			return DEVICE_OK;
+		}
+	}
+
+	bool ready;
+	return GetAxisPosition(axis, steps, ready);
+}
+
+int Hub::GetAxisPosition(int axis, long& steps, bool& ready)
+{
+	ostringstream cmd;
+	cmd << "/" << axis << "?0R";
+	string data;
+	int ret = ExecuteCommand(cmd.str(), data, ready);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	istringstream is(data);
+	if (!(is >> steps))
+		return ERR_UNRECOGNIZED_ANSWER;
+	return DEVICE_OK;
+}
+
+int Hub::GetAxisEncoder(int axis, long& steps)
+{
+	ostringstream cmd;
+	cmd << "/" << axis << "?8R";
+	string data;
+	int ret = ExecuteCommand(cmd.str(), data);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	istringstream is(data);
+	if (!(is >> steps))
+		return ERR_UNRECOGNIZED_ANSWER;
+	return DEVICE_OK;
+}
+
+//////////////// Position updates (Hub) /////////////////
+Hub::AxisState::AxisState() :
+	steps(0),
+	ready(false),
+	valid(false),
+	publishedSteps(0),
+	publishedReady(false),
+	published(false)
+{
+}
+
+// Every exchange passes through here with the executeLock_ held. Position
+// and status queries refresh the axis state, anything else may move the
+// axis, so its state is unknown until the next position query.
+void Hub::TrackCommand(const std::string& cmd, bool answered, const std::string& data, bool ready)
+{
+	if (cmd.length() < 3 || cmd[0] != '/')
+		return;
+	string body = cmd.substr(2);
+
+	MMThreadGuard guard(stateLock_);
+	if (cmd[1] == 'A' || cmd[1] == '_')
+	{
+		// broadcasts are never queries
+		int last = cmd[1] == 'A' ? 2 : MaxAxis;
+		for (int axis = 1; axis <= last; axis++)
+		{
+			axisStates_[axis].ready = false;
+			axisStates_[axis].valid = false;
+		}
+		return;
+	}
+
+	int axis = cmd[1] - '0';
+	if (axis < 1 || axis > MaxAxis)
+		return;
+	if (answered)
+		axisAnswered_[axis] = true;
+	AxisState& state = axisStates_[axis];
+	if (body == "?0R")
+	{
+		long steps;
+		istringstream is(data);
+		if (!answered || !(is >> steps))
+			return;
+		state.steps = steps;
+		state.ready = ready;
+		state.valid = true;
+		state.polled = GetCurrentMMTime();
+	}
+	else if (body == "QR")
+	{
+		if (!answered)
+			return;
+		// a position read while moving is stale once the axis has stopped
+		if (ready && !state.ready)
+			state.valid = false;
+		state.ready = ready;
+	}
+	else if (body[0] != '?')
+	{
+		state.ready = false;
+		state.valid = false;
+	}
+}
+
+void Hub::AddAxisListener(AxisListener* listener, int axis)
+{
+	if (axis < 1 || axis > MaxAxis)
+		return;
+	MMThreadGuard guard(listenerLock_);
+	listeners_.push_back(make_pair(listener, axis));
+}
+
+// Returns once no update for listener is running
+void Hub::RemoveAxisListener(AxisListener* listener)
+{
+	MMThreadGuard guard(listenerLock_);
+	for (size_t i = listeners_.size(); i > 0; i--)
+	{
+		if (listeners_[i - 1].first == listener)
+			listeners_.erase(listeners_.begin() + (i - 1));
+	}
+}
+
+int Hub::ClaimAxis(int axis, const MM::Device* owner)
+{
+	if (axis < 1 || axis > MaxAxis)
+		return ERR_INVALID_ID;
+	MMThreadGuard guard(stateLock_);
+	if (axisOwners_[axis] != 0 && axisOwners_[axis] != owner)
+		return ERR_AXIS_IN_USE;
+	axisOwners_[axis] = owner;
+	return DEVICE_OK;
+}
+
+void Hub::ReleaseAxes(const MM::Device* owner)
+{
+	MMThreadGuard guard(stateLock_);
+	for (int axis = 1; axis <= MaxAxis; axis++)
+	{
+		if (axisOwners_[axis] == owner)
+			axisOwners_[axis] = 0;
+	}
+}
+
+void Hub::SetSequenceRunning(int axis, bool running)
+{
+	if (axis < 1 || axis > MaxAxis)
+		return;
+	MMThreadGuard guard(stateLock_);
+	sequenceRunning_[axis] = running;
+}
+
+bool Hub::IsSequenceRunning(int axis)
+{
+	if (axis < 1 || axis > MaxAxis)
+		return false;
+	MMThreadGuard guard(stateLock_);
+	return sequenceRunning_[axis];
+}
+
+bool Hub::GetTrackedPosition(int axis, long& steps, bool& ready)
+{
+	if (axis < 1 || axis > MaxAxis)
+		return false;
+	MMThreadGuard guard(stateLock_);
+	const AxisState& state = axisStates_[axis];
+	steps = state.steps;
+	ready = state.ready;
+	return state.valid;
+}
+
+int Hub::StartPositionUpdates()
+{
+	if (positionUpdates_)
+		return DEVICE_OK;
+
+	// nothing read before now can be trusted to still hold
+	{
+		MMThreadGuard guard(stateLock_);
+		for (int axis = 1; axis <= MaxAxis; axis++)
+			axisStates_[axis] = AxisState();
+		positionUpdates_ = true;
+	}
+	if (!monitorThread_)
+		monitorThread_ = new PositionMonitorThread(this);
+	monitorThread_->Start();
+	return DEVICE_OK;
+}
+
+void Hub::StopPositionUpdates()
+{
+	{
+		MMThreadGuard guard(stateLock_);
+		if (!positionUpdates_)
+			return;
+		positionUpdates_ = false;
+	}
+	monitorThread_->Stop();
+	monitorThread_->Join();
+}
+
+long Hub::GetMonitorPeriodMs()
+{
+	MMThreadGuard guard(stateLock_);
+	return (long) (1000.0 / positionUpdateRateHz_ + 0.5);
+}
+
+// One monitor period: read the position of every axis somebody listens to
+// that is moving or unknown, then tell the listeners whose axes changed.
+// Axes at rest cost nothing; Busy() and position reads from the stages in
+// between are answered from the same state.
+void Hub::MonitorPositions()
+{
+	vector<int> axes;
+	{
+		MMThreadGuard guard(listenerLock_);
+		for (size_t i = 0; i < listeners_.size(); i++)
+		{
+			if (find(axes.begin(), axes.end(), listeners_[i].second) == axes.end())
+				axes.push_back(listeners_[i].second);
+		}
+	}
+
+	double periodMs = GetMonitorPeriodMs();
+	for (size_t i = 0; i < axes.size(); i++)
+	{
+		bool poll;
+		{
+			MMThreadGuard guard(stateLock_);
+			const AxisState& state = axisStates_[axes[i]];
+			poll = !state.valid ||
+				(!state.ready && (GetCurrentMMTime() - state.polled).getMsec() >= 0.5 * periodMs);
+		}
+		if (poll)
+		{
+			long steps;
+			bool ready;
+			if (GetAxisPosition(axes[i], steps, ready) != DEVICE_OK)
+				LogMessage("Position update failed", true);
+		}
+	}
+
+	bool changed[MaxAxis + 1] = {false};
+	{
+		MMThreadGuard guard(stateLock_);
+		for (int axis = 1; axis <= MaxAxis; axis++)
+		{
+			AxisState& state = axisStates_[axis];
+			if (!state.valid)
+				continue;
+			if (state.published && state.steps == state.publishedSteps && state.ready == state.publishedReady)
+				continue;
+			state.publishedSteps = state.steps;
+			state.publishedReady = state.ready;
+			state.published = true;
+			changed[axis] = true;
+		}
+	}
+
+	MMThreadGuard guard(listenerLock_);
+	vector<AxisListener*> notified;
+	for (size_t i = 0; i < listeners_.size(); i++)
+	{
+		AxisListener* listener = listeners_[i].first;
+		if (!changed[listeners_[i].second] ||
+			find(notified.begin(), notified.end(), listener) != notified.end())
+			continue;
+		notified.push_back(listener);
+		listener->OnAxisUpdate();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Motion profiles
+///////////////////////////////////////////////////////////////////////////////
+ProfileSettings::ProfileSettings(double speed, double longSpeed) :
+	enabled(false),
+	fineLimitUm(10.0),
+	longLimitUm(2000.0),
+	speedUm(speed),
+	longSpeedUm(longSpeed)
+{
+}
+
+MotionProfile ProfileSettings::Select(long distanceSteps, double stepSizeUm) const
+{
+	double distanceUm = labs(distanceSteps) * stepSizeUm;
+	MotionProfile p;
+	if (distanceUm <= fineLimitUm)
+	{
+		p.resolution = g_FullResolution;
+		p.speed = (long) (g_FineSpeedFraction * speedUm / stepSizeUm);
+		p.accel = g_AccelHigh;
+	}
+	else if (distanceUm <= longLimitUm)
+	{
+		p.resolution = g_FullResolution;
+		p.speed = (long) (speedUm / stepSizeUm);
+		p.accel = g_AccelHigh;
+	}
+	else
+	{
+		p.resolution = g_CoarseResolution;
+		p.speed = (long) (longSpeedUm / stepSizeUm);
+		p.accel = g_AccelLong;
+	}
+	if (p.speed < 1)
+		p.speed = 1;
+	return p;
+}
+
+// The controller's power-on acceleration, as before the profiles existed
+MotionProfile ProfileSettings::Fixed(double stepSizeUm) const
+{
+	MotionProfile p;
+	p.resolution = g_FullResolution;
+	p.speed = max(1L, (long) (speedUm / stepSizeUm));
+	p.accel = g_AccelLong;
+	return p;
+}
+
+// Both axes run the same normalized move: the common speed and acceleration
+// per step of distance are the lowest either axis allows.
+void CoordinateProfiles(long dx, long dy, MotionProfile& x, MotionProfile& y)
+{
+	if (dx == 0 || dy == 0)
+		return;
+
+	double distX = (double) labs(dx);
+	double distY = (double) labs(dy);
+	double speed = min(x.speed / distX, y.speed / distY);
+	double accel = min(x.accel / distX, y.accel / distY);
+	x.speed = max(1L, (long) floor(speed * distX + 0.5));
+	y.speed = max(1L, (long) floor(speed * distY + 0.5));
+	x.accel = max(1L, (long) floor(accel * distX + 0.5));
+	y.accel = max(1L, (long) floor(accel * distY + 0.5));
+}
+
+AxisProfile::AxisProfile()
+{
+	Invalidate();
+}
+
+void AxisProfile::Invalidate()
+{
+	speed_ = -1;
+	accel_ = -1;
+}
+
+// Everything goes into one command string, which the controller executes in
+// order. A coarse traverse is followed by j256 and a final A to the exact
+// target; the controller rescales its position counter when j changes.
+void AxisProfile::AppendMove(std::ostringstream& frame, const MotionProfile& profile, long target)
+{
+	if (profile.resolution < g_FullResolution)
+	{
+		long divisor = g_FullResolution / profile.resolution;
+		frame << "j" << profile.resolution << "V" << max(1L, profile.speed / divisor);
+		if (profile.accel != accel_)
+			frame << "L" << profile.accel;
+		frame << "A" << target / divisor << "j" << g_FullResolution;
+		accel_ = profile.accel;
+		speed_ = -1;
+	}
+
+	AppendSpeed(frame, profile);
+	frame << "A" << target;
+}
+
+void AxisProfile::AppendSpeed(std::ostringstream& frame, const MotionProfile& profile)
+{
+	if (profile.speed != speed_)
+	{
+		frame << "V" << profile.speed;
+		speed_ = profile.speed;
+	}
+	if (profile.accel != accel_)
+	{
+		frame << "L" << profile.accel;
+		accel_ = profile.accel;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AxisMotion
+///////////////////////////////////////////////////////////////////////////////
+AxisMotion::AxisMotion(int axis) :
+	axis_(axis),
+	state_(Idle),
+	distance_(0),
+	lastEncoder_(0)
+{
+}
+
+void AxisMotion::Start(long distanceSteps, MM::MMTime now)
+{
+	if (distanceSteps == 0)
+		return;
+	MMThreadGuard guard(lock_);
+	state_ = Moving;
+	distance_ = distanceSteps;
+	start_ = now;
+}
+
+int AxisMotion::Update(Hub* hub, bool learnSettle, MM::MMTime now, bool& busy)
+{
+	MMThreadGuard guard(lock_);
+
+	if (state_ == Idle)
+	{
+		// not our move (homing, jogging) - just report the controller state
+		bool ready;
+		int ret = hub->QueryAxisReady(axis_, ready);
+		busy = !ready;
+		return ret;
+	}
+
+	if (state_ == Moving)
+	{
+		bool ready;
+		int ret = hub->QueryAxisReady(axis_, ready);
+		if (ret != DEVICE_OK)
+			return ret;
+		if (!ready)
+		{
+			busy = true;
+			return DEVICE_OK;
+		}
+
+		readyAt_ = now;
+		hub->GetSettleTable().RecordReady(axis_, distance_, (now - start_).getMsec());
+		if (!learnSettle)
+		{
+			state_ = Idle;
+			busy = false;
+			return DEVICE_OK;
+		}
+
+		// keep reporting busy until the encoder stops moving
+		state_ = Settling;
+		busy = true;
+		return hub->GetAxisEncoder(axis_, lastEncoder_);
+	}
+
+	long encoder;
+	int ret = hub->GetAxisEncoder(axis_, encoder);
+	if (ret != DEVICE_OK)
+	{
+		state_ = Idle;
+		return ret;
+	}
+
+	double settleMs = (now - readyAt_).getMsec();
+	if (labs(encoder - lastEncoder_) <= g_SettleToleranceSteps || settleMs > g_SettleTimeoutMs)
+	{
+		hub->GetSettleTable().RecordSettle(axis_, distance_, settleMs);
+		state_ = Idle;
+		busy = false;
+		return DEVICE_OK;
+	}
+
+	lastEncoder_ = encoder;
+	busy = true;
+	return DEVICE_OK;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// XYStage
+// * XYStage - two axis stage device
+//////////////////////////////////////////////////////////////////////////////
+CytoTableXYStage::CytoTableXYStage() :
+	hub_(0),
+	initialized_(false), 
+	stepSizeXUm_(0.1), //Trying this out and seeing what happens
+	stepSizeYUm_(0.1), //Trying this out and seeing what happens
+	speed_(2500.0), //Trying this out and seeing what happens
+	//maxSpeed_ (7.5),- This is from ASI - do we need it?
+	originX_(0),
+	originY_(0),
+	targetX_(0),
+	targetY_(0),
+	motionX_(1),
+	motionY_(2),
+	adaptiveDelay_(false),
+	settleLearning_(false),
+	recommendedDelayMs_(0.0),
+	profile_(2500.0, 7500.0),
+	coordinated_(false),
+	adapterOriginX_(0),
+	adapterOriginY_(0),
+	calibrated_(false),
+	calibrationRms_(0.0),
+	jogThread_(0),
+	jogEnabled_(false),
+	jogPending_(false),
+	jogVX_(0),
+	jogVY_(0),
+	sentVX_(0),
+	sentVY_(0),
+	jogRateHz_(20.0),
+	jogTimeoutMs_(250.0),
+	moving_(false),
+	moveQueueThread_(0),
+	moveQueueRunning_(false),
+	lookAheadDepth_(8)
+{
+	InitializeDefaultErrorMessages();
+	// create pre-initialization properties
+	SetErrorText(ERR_NO_HUB, "Please add the Hub device first!");
+	SetErrorText(ERR_INVALID_JOG_RATE, "Jog update rate must be between 1 and 100 Hz");
+	SetErrorText(ERR_INVALID_SPEED, "Speed must be greater than zero");
+	SetErrorText(ERR_INVALID_MOVE_LIMITS, "FineMoveLimit-um must not be greater than LongMoveLimit-um");
+	SetErrorText(ERR_CALIBRATION_FAILED, "Calibration needs at least three points that are not on or close to one line");
+	SetErrorText(ERR_MOVE_QUEUE_RUNNING, "Not possible while queued moves are running");
+	SetErrorText(ERR_MOVE_QUEUE_FULL, "Move queue is full");
+	SetErrorText(ERR_MOVE_ABORTED, "Queued move was aborted");
+	SetErrorText(ERR_LINK_LOST, "Serial link to the controller lost, reconnecting");
+	SetErrorText(ERR_AXIS_IN_USE, g_AxisInUseText);
+	SetErrorText(ERR_INVALID_MODE, "Queued moves are not possible in jog mode");
+	EnableDelay();
+	UpdateTransform();
+
+	CreateProperty(MM::g_Keyword_Name, g_XYStageDeviceName, MM::String, true);
+
+	//Description
+	CreateProperty(MM::g_Keyword_Description, "CytoWorksTable XY stage driver adapter", MM::String, true);
+}
+
+CytoTableXYStage::~CytoTableXYStage()
+{
+   Shutdown();
+   delete jogThread_;
+   delete moveQueueThread_;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// XYStage methods required by the API
+///////////////////////////////////////////////////////////////////////////////
+void CytoTableXYStage::GetName(char* Name) const
+{
+   CDeviceUtils::CopyLimitedString(Name, g_XYStageDeviceName);
+}
+
+int CytoTableXYStage::Initialize()
+{
+	//const char* cmd = "/1?9R";
+	//int response = SendSerialCommand(port_.c_str(), cmd, "\r");
+	/*//Clear the x port, set x current, set x resolution, set top speed, set hold current, set	   acceleration factor, reverse x positive to negative
+	This is what jason did - I've included Ludl's code too
+	int ret = SetCommand("/1?9R");//this one isn't right - need to set a separate method for this!!
+	int ret = SetCommand("/1m40R");
+	int ret = SetCommand("/1j256R");
+	int ret = SetCommand("/1V64000R");
+	int ret = SetCommand("/1h50R");
+	int ret = SetCommand("/1L1000R");
+	int ret = SetCommand("/1F1R");*/
+
+	/*string command;
+	command = "/1?R";
+	command = "/1m40R";
+	command = "/1j256R";
+	command = "/1V20320R";
+	command = "/1h50R";
+	command = "/1L333R";
+	command = "/1F1R";
+	command = "/2?9R";
+	command = "/2m40R";
+	command = "/2j256R";
+	command = "/2V20320R";
+	command = "/2h50R";
+	command = "/2L333R";
+	command = "/2F1R";
+	command = "/1z2500000R";
+	command = "/1A0R";*/
+
+	hub_ = static_cast<Hub*>(GetParentHub());
+	if (!hub_)
+		return ERR_NO_HUB;
+	
+	// Step size - need to set actual step size #
+	CPropertyAction* pAct = new CPropertyAction (this, &CytoTableXYStage::OnStepSizeX);
+	int ret = CreateProperty("StepSize-X", "0.1", MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	// Step size - need to set actual step size #
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnStepSizeY);
+	ret = CreateProperty("StepSize-Y", "0.1", MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	// Speed (in um/sec) - need to set actual speed
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnSpeed);
+	ret = CreateProperty("Speed", "2500.0", MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+
+	// Adaptive profile - speed, acceleration and resolution chosen from each move's length
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnAdaptiveProfile);
+	ret = CreateProperty(g_AdaptiveProfile, g_Off, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+	AddAllowedValue(g_AdaptiveProfile, g_Off);
+	AddAllowedValue(g_AdaptiveProfile, g_On);
+
+	// Top speed (in um/sec) for moves longer than LongMoveLimit
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnLongMoveSpeed);
+	ret = CreateProperty(g_LongMoveSpeed, "7500.0", MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnFineMoveLimit);
+	ret = CreateProperty(g_FineMoveLimit, "10.0", MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+	SetPropertyLimits(g_FineMoveLimit, 0.0, g_MaxMoveLimitUm);
+
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnLongMoveLimit);
+	ret = CreateProperty(g_LongMoveLimit, "2000.0", MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+	SetPropertyLimits(g_LongMoveLimit, 0.0, g_MaxMoveLimitUm);
+
+	// Straight line XY moves - the axis with the shorter distance runs slower
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnCoordinatedMoves);
+	ret = CreateProperty(g_CoordinatedMoves, g_Off, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+	AddAllowedValue(g_CoordinatedMoves, g_Off);
+	AddAllowedValue(g_CoordinatedMoves, g_On);
+
+	// Affine calibration "a11 a12 a21 a22 tx ty" (steps = A * um + t), or None
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnCalibration);
+	ret = CreateProperty(g_Calibration, g_None, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+
+	// Set to "x y" (um) to pair that position with where the stage is now,
+	// or to Clear to start over
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnCalibrationPoint);
+	ret = CreateProperty(g_CalibrationPoint, "", MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+
+	CPropertyActionEx* pActEx = new CPropertyActionEx (this, &CytoTableXYStage::OnCalibrationInfo, CalPoints);
+	ret = CreateProperty(g_CalibrationPoints, "0", MM::Integer, true, pActEx);
+	if (ret != DEVICE_OK)
+		 return ret;
+
+	pActEx = new CPropertyActionEx (this, &CytoTableXYStage::OnCalibrationInfo, CalRms);
+	ret = CreateProperty(g_CalibrationRms, "0.0", MM::Float, true, pActEx);
+	if (ret != DEVICE_OK)
+		 return ret;
+
+	pActEx = new CPropertyActionEx (this, &CytoTableXYStage::OnCalibrationInfo, CalRotation);
+	ret = CreateProperty(g_CalibrationRotation, "0.0", MM::Float, true, pActEx);
+	if (ret != DEVICE_OK)
+		 return ret;
+
+	pActEx = new CPropertyActionEx (this, &CytoTableXYStage::OnCalibrationInfo, CalSkew);
+	ret = CreateProperty(g_CalibrationSkew, "0.0", MM::Float, true, pActEx);
+	if (ret != DEVICE_OK)
+		 return ret;
+
+	// Jog mode - relative moves become velocity updates (joystick/GUI arrows)
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnJogMode);
+	ret = CreateProperty(g_JogMode, g_Off, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+	AddAllowedValue(g_JogMode, g_Off);
+	AddAllowedValue(g_JogMode, g_On);
+
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnJogUpdateRate);
+	ret = CreateProperty(g_JogUpdateRate, "20.0", MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+	SetPropertyLimits(g_JogUpdateRate, 1.0, 100.0);
+
+	// Stop if no jog update arrives within this time (released joystick)
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnJogTimeout);
+	ret = CreateProperty(g_JogTimeout, "250.0", MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+	SetPropertyLimits(g_JogTimeout, 10.0, 5000.0);
+
+	// Adaptive delay - replaces Delay with the settle time learned for the move's length
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnAdaptiveDelay);
+	ret = CreateProperty(g_AdaptiveDelay, g_Off, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+	AddAllowedValue(g_AdaptiveDelay, g_Off);
+	AddAllowedValue(g_AdaptiveDelay, g_On);
+
+	// While learning, Busy() also waits for the encoder to settle and records how long it took
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnSettleLearning);
+	ret = CreateProperty(g_SettleLearning, g_Off, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+	AddAllowedValue(g_SettleLearning, g_Off);
+	AddAllowedValue(g_SettleLearning, g_On);
+
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnRecommendedDelay);
+	ret = CreateProperty(g_RecommendedDelay, "0.0", MM::Float, true, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+
+	// Set to "x y" or "x y dwell-ms" (um) to queue a move, to a list of
+	// those separated by ';' to queue all of them, or to Clear to drop the
+	// moves not yet sent
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnMoveQueue);
+	ret = CreateProperty(g_MoveQueue, "", MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnMoveQueueLength);
+	ret = CreateProperty(g_MoveQueueLength, "0", MM::Integer, true, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+
+	// Targets sent to the controller ahead of time as one program
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnLookAheadDepth);
+	ret = CreateProperty(g_LookAheadDepth, "8", MM::Integer, false, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+	SetPropertyLimits(g_LookAheadDepth, 1, 16);
+
+	// Moving/Idle, pushed with the positions while the hub's PositionUpdates is on
+	pAct = new CPropertyAction (this, &CytoTableXYStage::OnMotionState);
+	ret = CreateProperty(g_MotionState, g_Idle, MM::String, true, pAct);
+	if (ret != DEVICE_OK)
+		 return ret;
+
+	long x, y;
+	ret = GetPositionSteps(x, y);
+	if (ret != DEVICE_OK)
+		 return ret;
+	SetTarget(x, y);
+
+	ret = UpdateStatus();
+	if (ret != DEVICE_OK)
+		 return ret;
+
+	ret = hub_->ClaimAxis(1, this);
+	if (ret == DEVICE_OK)
+		ret = hub_->ClaimAxis(2, this);
+	if (ret != DEVICE_OK)
+	{
+		hub_->ReleaseAxes(this);
+		return ret;
+	}
+
+	hub_->AddAxisListener(this, 1);
+	hub_->AddAxisListener(this, 2);
+	initialized_ = true;
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::Shutdown()
+{
+   if (initialized_)
+   {
+      hub_->RemoveAxisListener(this);
+      hub_->ReleaseAxes(this);
+      AbortMoveQueue(ERR_MOVE_ABORTED);
+      if (jogThread_)
+      {
+         jogThread_->Stop();
+         jogThread_->Join();
+      }
+      if (jogEnabled_)
+      {
+         jogEnabled_ = false;
+         StopJog();
+         RestoreSpeed();
+      }
+      initialized_ = false;
+   }
+   return DEVICE_OK;
+}
+
+bool CytoTableXYStage::Busy() 
+{
+	if (IsMoveQueueRunning())
+		return true;
+
+	// velocity moves never finish on their own, so jogging is not reported as busy
+	if (jogEnabled_)
+		return false;
+
+	// the axes may still be moving while the link is down
+	MM::MMTime now = GetCurrentMMTime();
+	bool busyX = false, busyY = false;
+	int ret = motionX_.Update(hub_, settleLearning_, now, busyX);
+	if (ret != DEVICE_OK)
+		return ret == ERR_LINK_LOST;
+	ret = motionY_.Update(hub_, settleLearning_, now, busyY);
+	if (ret != DEVICE_OK)
+		return ret == ERR_LINK_LOST;
+	return busyX || busyY;
+}
+
+// Called by the hub's position monitor after X or Y changed. Both axes are
+// read from the state the monitor just refreshed, not from the controller.
+void CytoTableXYStage::OnAxisUpdate()
+{
+	long x, y;
+	bool readyX, readyY;
+	if (!hub_->GetTrackedPosition(1, x, readyX) || !hub_->GetTrackedPosition(2, y, readyY))
+		return;
+
+	double xUm, yUm;
+	{
+		MMThreadGuard guard(transformLock_);
+		transform_.StepsToUm(x, y, xUm, yUm);
+	}
+	OnXYStagePositionChanged(xUm, yUm);
+
+	bool moving = !readyX || !readyY;
+	if (moving != moving_)
+	{
+		moving_ = moving;
+		OnPropertyChanged(g_MotionState, moving_ ? g_Moving : g_Idle);
+	}
+}
+
+double CytoTableXYStage::GetDelayMs() const
+{
+	if (adaptiveDelay_)
+		return recommendedDelayMs_;
+	return CXYStageBase<CytoTableXYStage>::GetDelayMs();
+}
+
+// The queue thread moves the target along with its programs
+void CytoTableXYStage::SetTarget(long x, long y)
+{
+	MMThreadGuard guard(moveQueueLock_);
+	targetX_ = x;
+	targetY_ = y;
+}
+
+void CytoTableXYStage::GetTarget(long& x, long& y)
+{
+	MMThreadGuard guard(moveQueueLock_);
+	x = targetX_;
+	y = targetY_;
+}
+
+void CytoTableXYStage::StartMotion(long dx, long dy)
+{
+	MM::MMTime now = GetCurrentMMTime();
+	motionX_.Start(dx, now);
+	motionY_.Start(dy, now);
+
+	// the slower axis to settle decides the delay
+	SettleTable& table = hub_->GetSettleTable();
+	double fallback = CXYStageBase<CytoTableXYStage>::GetDelayMs();
+	double delayX = dx != 0 ? table.GetRecommendedDelayMs(1, dx, fallback) : 0.0;
+	double delayY = dy != 0 ? table.GetRecommendedDelayMs(2, dy, fallback) : 0.0;
+	recommendedDelayMs_ = delayX > delayY ? delayX : delayY;
+}
+
+int CytoTableXYStage::SetPositionSteps(long x, long y)
+{
+	if (IsMoveQueueRunning())
+		return ERR_MOVE_QUEUE_RUNNING;
+
+	if (jogEnabled_)
+	{
+		int ret = StopJog();
+		if (ret != DEVICE_OK)
+			return ret;
+		long jogX, jogY;
+		ret = GetPositionSteps(jogX, jogY);
+		if (ret != DEVICE_OK)
+			return ret;
+		SetTarget(jogX, jogY);
+		// jogging changed V behind the profiles' back
+		profileX_.Invalidate();
+		profileY_.Invalidate();
+	}
+
+	ostringstream cmdX, cmdY;
+	cmdX << "/1";
+	cmdY << "/2";
+	{
+		MMThreadGuard guard(moveQueueLock_);
+		AppendXYMove(cmdX, cmdY, targetX_, targetY_, x, y, coordinated_);
+	}
+	// coordinated moves are loaded and then started on both axes at once
+	if (!coordinated_)
+	{
+		cmdX << "R";
+		cmdY << "R";
+	}
+
+	// the profiles already count V and L as sent
+	string answer;
+	int ret = hub_->ExecuteCommand(cmdX.str(), answer);
+	if (ret == DEVICE_OK)
+		ret = hub_->ExecuteCommand(cmdY.str(), answer);
+	if (ret != DEVICE_OK)
+	{
+		profileX_.Invalidate();
+		profileY_.Invalidate();
+		return ret;
+	}
+
+	if (coordinated_)
+	{
+		ret = hub_->BroadcastCommand("/AR");
+		if (ret != DEVICE_OK)
+			return ret;
+	}
+
+	long fromX, fromY;
+	GetTarget(fromX, fromY);
+	StartMotion(x - fromX, y - fromY);
+	SetTarget(x, y);
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::SetRelativePositionSteps(long x, long y)
+{
+	if (IsMoveQueueRunning())
+		return ERR_MOVE_QUEUE_RUNNING;
+
+	if (jogEnabled_)
+		return Jog(x, y);
+
+	long fromX, fromY;
+	GetTarget(fromX, fromY);
+
+	// profiles land with an absolute move
+	if (profile_.enabled || coordinated_)
+		return SetPositionSteps(fromX + x, fromY + y);
+
+	// P moves in the positive direction, D in the negative one
+	string answer;
+	int ret;
+	if (x != 0)
+	{
+		ostringstream cmdX;
+		cmdX << "/1";
+		{
+			MMThreadGuard guard(moveQueueLock_);
+			profileX_.AppendSpeed(cmdX, profile_.Fixed(stepSizeXUm_));
+		}
+		cmdX << (x < 0 ? "D" : "P") << labs(x) << "R";
+		ret = hub_->ExecuteCommand(cmdX.str(), answer);
+		if (ret != DEVICE_OK)
+		{
+			profileX_.Invalidate();
+			return ret;
+		}
+	}
+	if (y != 0)
+	{
+		ostringstream cmdY;
+		cmdY << "/2";
+		{
+			MMThreadGuard guard(moveQueueLock_);
+			profileY_.AppendSpeed(cmdY, profile_.Fixed(stepSizeYUm_));
+		}
+		cmdY << (y < 0 ? "D" : "P") << labs(y) << "R";
+		ret = hub_->ExecuteCommand(cmdY.str(), answer);
+		if (ret != DEVICE_OK)
+		{
+			profileY_.Invalidate();
+			return ret;
+		}
+	}
+
+	StartMotion(x, y);
+	SetTarget(fromX + x, fromY + y);
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::GetPositionSteps(long& x, long& y)
+{
+	int ret = hub_->GetAxisPosition(1, x);
+	if (ret != DEVICE_OK)
+		return ret;
+	return hub_->GetAxisPosition(2, y);
+}
+
+int CytoTableXYStage::SetOrigin()
+{
+	//Defines current position as origin (0,0) coordinate of the controller
+	string answer;
+	int ret = hub_->ExecuteCommand("/1z0R", answer);
+	if (ret != DEVICE_OK)
+		return ret;
+	ret = hub_->ExecuteCommand("/2z0R", answer);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	//return the answer
+	long xStep, yStep;
+	ret = GetPositionSteps(xStep, yStep);
+	if (ret != DEVICE_OK)
+		return ret;
+	originX_ = xStep * stepSizeXUm_;
+	originY_ = yStep * stepSizeYUm_;
+	SetTarget(xStep, yStep);
+	
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::Home()
+{
+	PurgeComPort(port_.c_str());
+
+	
+//some other stuff goes in here
+return DEVICE_OK;
+}
+
+int CytoTableXYStage::Stop()
+{
+	if (jogEnabled_)
+		return StopJog();
+
+	bool queued = IsMoveQueueRunning();
+	if (queued)
+		AbortMoveQueue(ERR_MOVE_ABORTED);
+
+	string answer;
+	int ret = hub_->ExecuteCommand("/1TR", answer);
+	if (ret != DEVICE_OK)
+		return ret;
+	ret = hub_->ExecuteCommand("/2TR", answer);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	// a coarse profile segment may have been cut short at j16
+	if (profile_.enabled)
+	{
+		ret = hub_->ExecuteCommand("/1j256R", answer);
+		if (ret != DEVICE_OK)
+			return ret;
+		ret = hub_->ExecuteCommand("/2j256R", answer);
+		if (ret != DEVICE_OK)
+			return ret;
+		profileX_.Invalidate();
+		profileY_.Invalidate();
+	}
+
+	// the queue's last target was never reached
+	if (queued)
+	{
+		long x, y;
+		ret = GetPositionSteps(x, y);
+		if (ret != DEVICE_OK)
+			return ret;
+		SetTarget(x, y);
+	}
+	return DEVICE_OK;
+}
+
+// V goes along whenever it differs from what the axis was last set to, so
+// a change of Speed takes effect with the next move
+void CytoTableXYStage::AppendAxisMove(std::ostringstream& cmd, AxisProfile& axisProfile, long from, long to, double stepSizeUm)
+{
+	axisProfile.AppendMove(cmd, SelectProfile(labs(to - from) * stepSizeUm, stepSizeUm), to);
+}
+
+// Coordinated moves pick one profile class from the length of the XY
+// vector, so that a coarse traverse runs on both axes or on neither, and
+// then scale it per axis. Every move carries V and L while coordinating,
+// otherwise a scaled down speed would be left on an axis.
+void CytoTableXYStage::AppendXYMove(std::ostringstream& cmdX, std::ostringstream& cmdY, long fromX, long fromY, long x, long y, bool coordinate)
+{
+	if (!coordinate)
+	{
+		AppendAxisMove(cmdX, profileX_, fromX, x, stepSizeXUm_);
+		AppendAxisMove(cmdY, profileY_, fromY, y, stepSizeYUm_);
+		return;
+	}
+
+	double dxUm = (x - fromX) * stepSizeXUm_;
+	double dyUm = (y - fromY) * stepSizeYUm_;
+	double distanceUm = sqrt(dxUm * dxUm + dyUm * dyUm);
+	MotionProfile px = SelectProfile(distanceUm, stepSizeXUm_);
+	MotionProfile py = SelectProfile(distanceUm, stepSizeYUm_);
+	CoordinateProfiles(x - fromX, y - fromY, px, py);
+	profileX_.AppendMove(cmdX, px, x);
+	profileY_.AppendMove(cmdY, py, y);
+}
+
+// Without the adaptive profile every move runs at Speed with the
+// controller's power-on acceleration
+MotionProfile CytoTableXYStage::SelectProfile(double distanceUm, double stepSizeUm) const
+{
+	if (profile_.enabled)
+		return profile_.Select((long) (distanceUm / stepSizeUm), stepSizeUm);
+	return profile_.Fixed(stepSizeUm);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Move look-ahead queue
+// Up to LookAheadDepth targets go to each axis as one program, e.g.
+// "/1A1000M50A2000M50A3000M50", loaded without R on both axes and then
+// started together with a single broadcast "/AR". The controller runs the
+// program's moves back to back, so there is no host round trip between
+// them. Targets queued while a program runs go into the next program.
+// Queued segments are always coordinated, whatever CoordinatedMoves says,
+// as nothing else keeps the two programs together between targets.
+// With the hub's ProgramCache on, a program that ran before, e.g. in the
+// previous pass of a plate scan, only costs an "e<slot>".
+///////////////////////////////////////////////////////////////////////////////
+int CytoTableXYStage::QueueMove(long x, long y, long dwellMs, MoveHandlePtr* handle)
+{
+	return QueueMoves(&x, &y, &dwellMs, 1, handle);
+}
+
+// All n moves go in under one lock, so the queue thread never starts a
+// program with only the head of a list
+int CytoTableXYStage::QueueMoves(const long* x, const long* y, const long* dwellMs, size_t n, MoveHandlePtr* handles)
+{
+	if (jogEnabled_)
+		return ERR_INVALID_MODE;
+
+	{
+		MMThreadGuard guard(moveQueueLock_);
+		if (moveQueue_.size() + n > g_MoveQueueCapacity)
+			return ERR_MOVE_QUEUE_FULL;
+		for (size_t i = 0; i < n; i++)
+		{
+			QueuedMove move;
+			move.x = x[i];
+			move.y = y[i];
+			move.dwellMs = dwellMs[i] > 0 ? dwellMs[i] : 0;
+			move.handle = std::make_shared<MoveHandle>(x[i], y[i]);
+			moveQueue_.push_back(move);
+			if (handles)
+				handles[i] = move.handle;
+		}
+		if (moveQueueRunning_ || n == 0)
+			return DEVICE_OK;
+		moveQueueRunning_ = true;
+	}
+
+	// the previous thread ran out of moves, collect it before reuse
+	if (moveQueueThread_)
+		moveQueueThread_->Join();
+	else
+		moveQueueThread_ = new MoveQueueThread(this);
+	moveQueueThread_->Start();
+	return DEVICE_OK;
+}
+
+// Same um as SetPositionUm: the calibration if there is one, otherwise the
+// step sizes, adapter origin and mirroring
+int CytoTableXYStage::QueueMoveUm(double x, double y, double dwellMs, MoveHandlePtr* handle)
+{
+	UpdateTransform();
+	long xSteps, ySteps;
+	transform_.UmToSteps(x, y, xSteps, ySteps);
+	return QueueMove(xSteps, ySteps, (long) (dwellMs + 0.5), handle);
+}
+
+int CytoTableXYStage::QueueMovesUm(const std::vector<double>& x, const std::vector<double>& y, const std::vector<double>& dwellMs)
+{
+	size_t n = x.size();
+	if (n == 0)
+		return DEVICE_OK;
+
+	UpdateTransform();
+	vector<long> xSteps(n), ySteps(n), dwell(n);
+	transform_.UmToSteps(&x[0], &y[0], &xSteps[0], &ySteps[0], n);
+	for (size_t i = 0; i < n; i++)
+		dwell[i] = (long) (dwellMs[i] + 0.5);
+	return QueueMoves(&xSteps[0], &ySteps[0], &dwell[0], n, 0);
+}
+
+void CytoTableXYStage::ClearMoveQueue()
+{
+	MMThreadGuard guard(moveQueueLock_);
+	for (size_t i = 0; i < moveQueue_.size(); i++)
+		moveQueue_[i].handle->Finish(ERR_MOVE_ABORTED);
+	moveQueue_.clear();
+}
+
+long CytoTableXYStage::GetMoveQueueLength()
+{
+	MMThreadGuard guard(moveQueueLock_);
+	return (long) (moveQueue_.size() + runningMoves_.size());
+}
+
+bool CytoTableXYStage::IsMoveQueueRunning()
+{
+	MMThreadGuard guard(moveQueueLock_);
+	return moveQueueRunning_;
+}
+
+// Fails everything that has not completed; the axes keep moving until the
+// caller terminates them
+void CytoTableXYStage::AbortMoveQueue(int result)
+{
+	if (moveQueueThread_)
+	{
+		moveQueueThread_->Stop();
+		moveQueueThread_->Join();
+	}
+
+	MMThreadGuard guard(moveQueueLock_);
+	for (size_t i = 0; i < runningMoves_.size(); i++)
+		runningMoves_[i].handle->Finish(result);
+	for (size_t i = 0; i < moveQueue_.size(); i++)
+		moveQueue_[i].handle->Finish(result);
+	runningMoves_.clear();
+	moveQueue_.clear();
+	moveQueueRunning_ = false;
+}
+
+int CytoTableXYStage::RunMoveQueue(MoveQueueThread* thread)
+{
+	int ret = DEVICE_OK;
+	while (ret == DEVICE_OK && !thread->IsStopped())
+	{
+		vector<QueuedMove> program;
+		ostringstream cmdX, cmdY;
+		{
+			MMThreadGuard guard(moveQueueLock_);
+			long fromX = targetX_;
+			long fromY = targetY_;
+			while (!moveQueue_.empty() && (long) program.size() < lookAheadDepth_ &&
+				cmdX.tellp() < g_MaxProgramLength && cmdY.tellp() < g_MaxProgramLength)
+			{
+				const QueuedMove& move = moveQueue_.front();
+				// each axis runs its own program, so only equal segment times
+				// keep them together at every target
+				AppendXYMove(cmdX, cmdY, fromX, fromY, move.x, move.y, true);
+				if (move.dwellMs > 0)
+				{
+					cmdX << "M" << move.dwellMs;
+					cmdY << "M" << move.dwellMs;
+				}
+				fromX = move.x;
+				fromY = move.y;
+				program.push_back(move);
+				moveQueue_.pop_front();
+			}
+			if (program.empty())
+			{
+				moveQueueRunning_ = false;
+				return DEVICE_OK;
+			}
+			runningMoves_ = program;
+		}
+
+		for (size_t i = 0; i < program.size(); i++)
+			program[i].handle->SetRunning();
+
+		// Nothing runs before the broadcast R, so after a dropout both
+		// programs are loaded again
+		for (int attempt = 0; attempt < 2; attempt++)
+		{
+			ret = hub_->RunProgram(1, cmdX.str(), false);
+			if (ret == DEVICE_OK)
+				ret = hub_->RunProgram(2, cmdY.str(), false);
+			if (ret == DEVICE_OK)
+				ret = hub_->BroadcastCommand("/AR");
+			if (ret != ERR_LINK_LOST || hub_->WaitForLink(g_LinkWaitMs) != DEVICE_OK)
+				break;
+		}
+		if (ret != DEVICE_OK)
+		{
+			// the programs' V and L may not have arrived
+			MMThreadGuard guard(moveQueueLock_);
+			profileX_.Invalidate();
+			profileY_.Invalidate();
+			break;
+		}
+		long fromX, fromY;
+		GetTarget(fromX, fromY);
+		StartMotion(program.back().x - fromX, program.back().y - fromY);
+		SetTarget(program.back().x, program.back().y);
+
+		// A target is complete once both axes are on it, or once a later one
+		// is reached. Without a dwell a target may be passed between two
+		// reads; the axes turning ready completes the whole program. Both
+		// rules hold only because every segment is coordinated: the axes
+		// start and end each one together, so passing a target on one axis
+		// means standing on it on both.
+		size_t next = 0;
+		while (next < program.size() && !thread->IsStopped())
+		{
+			long x, y;
+			bool readyX, readyY;
+			ret = hub_->GetAxisPosition(1, x, readyX);
+			if (ret == DEVICE_OK)
+				ret = hub_->GetAxisPosition(2, y, readyY);
+			// the controller runs the program on while the link is down
+			if (ret == ERR_LINK_LOST)
+			{
+				ret = hub_->WaitForLink(g_LinkWaitMs);
+				if (ret == DEVICE_OK)
+					continue;
+			}
+			if (ret != DEVICE_OK)
+				break;
+
+			size_t reached = next;
+			if (readyX && readyY)
+				reached = program.size();
+			else
+			{
+				for (size_t i = next; i < program.size(); i++)
+				{
+					if (labs(x - program[i].x) <= g_ArrivalToleranceSteps &&
+						labs(y - program[i].y) <= g_ArrivalToleranceSteps)
+					{
+						reached = i + 1;
+						break;
+					}
+				}
+			}
+			for (; next < reached; next++)
+				program[next].handle->Finish(DEVICE_OK);
+		}
+		if (ret != DEVICE_OK || next < program.size())
+			break;
+
+		MMThreadGuard guard(moveQueueLock_);
+		runningMoves_.clear();
+	}
+
+	// on Stop() AbortMoveQueue fails what is left
+	if (ret == DEVICE_OK)
+		return DEVICE_OK;
+
+	LogMessage("Move queue stopped on an error", false);
+	MMThreadGuard guard(moveQueueLock_);
+	for (size_t i = 0; i < runningMoves_.size(); i++)
+		runningMoves_[i].handle->Finish(ret);
+	for (size_t i = 0; i < moveQueue_.size(); i++)
+		moveQueue_[i].handle->Finish(ret);
+	runningMoves_.clear();
+	moveQueue_.clear();
+	moveQueueRunning_ = false;
+	return ret;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Jog mode
+// Every relative move is turned into a velocity request of (steps / period),
+// where period is one jog update. Requests only overwrite the pending one, so
+// a burst of joystick events never queues up; the jog thread sends the newest
+// velocity at most JogUpdateRate times per second. A zero move or a gap longer
+// than JogTimeout stops the stage.
+///////////////////////////////////////////////////////////////////////////////
+int CytoTableXYStage::Jog(long x, long y)
+{
+	if (x == 0 && y == 0)
+		return StopJog();
+
+	long maxX = (long) (speed_ / stepSizeXUm_);
+	long maxY = (long) (speed_ / stepSizeYUm_);
+	long vx = (long) (x * jogRateHz_);
+	long vy = (long) (y * jogRateHz_);
+	vx = vx > maxX ? maxX : (vx < -maxX ? -maxX : vx);
+	vy = vy > maxY ? maxY : (vy < -maxY ? -maxY : vy);
+
+	MMThreadGuard guard(jogLock_);
+	jogVX_ = vx;
+	jogVY_ = vy;
+	jogPending_ = true;
+	lastJogRequest_ = GetCurrentMMTime();
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::StopJog()
+{
+	MMThreadGuard sendGuard(jogSendLock_);
+	return TerminateJog();
+}
+
+int CytoTableXYStage::TerminateJog()
+{
+	{
+		MMThreadGuard guard(jogLock_);
+		jogPending_ = false;
+		jogVX_ = 0;
+		jogVY_ = 0;
+		sentVX_ = 0;
+		sentVY_ = 0;
+	}
+
+	// Released: terminate both axes right away instead of waiting for the thread
+	string answer;
+	int ret = hub_->ExecuteCommand("/1TR", answer);
+	if (ret != DEVICE_OK)
+		return ret;
+	return hub_->ExecuteCommand("/2TR", answer);
+}
+
+int CytoTableXYStage::ProcessJog()
+{
+	// held while sending so that a release can not be overtaken by a stale velocity
+	MMThreadGuard sendGuard(jogSendLock_);
+
+	long vx, vy, curX, curY;
+	bool pending;
+	MM::MMTime last;
+	{
+		MMThreadGuard guard(jogLock_);
+		pending = jogPending_;
+		jogPending_ = false;
+		vx = jogVX_;
+		vy = jogVY_;
+		curX = sentVX_;
+		curY = sentVY_;
+		last = lastJogRequest_;
+	}
+
+	if (!pending)
+	{
+		if ((curX != 0 || curY != 0) &&
+			(GetCurrentMMTime() - last).getMsec() > jogTimeoutMs_)
+			return TerminateJog();
+		return DEVICE_OK;
+	}
+
+	int ret = SetAxisVelocity(1, curX, vx);
+	if (ret == DEVICE_OK)
+		ret = SetAxisVelocity(2, curY, vy);
+
+	MMThreadGuard guard(jogLock_);
+	sentVX_ = curX;
+	sentVY_ = curY;
+	return ret;
+}
+
+long CytoTableXYStage::GetJogPeriodMs()
+{
+	return (long) (1000.0 / jogRateHz_);
+}
+
+// Changes speed on the fly when the direction is unchanged, otherwise
+// terminates the current move and restarts in velocity mode (P0/D0).
+int CytoTableXYStage::SetAxisVelocity(int axis, long& current, long target)
+{
+	if (target == current)
+		return DEVICE_OK;
+
+	string answer;
+	int ret;
+	ostringstream cmd;
+	cmd << "/" << axis;
+	if (target == 0)
+	{
+		cmd << "TR";
+	}
+	else if ((current > 0 && target > 0) || (current < 0 && target < 0))
+	{
+		cmd << "V" << labs(target) << "R";
+	}
+	else
+	{
+		if (current != 0)
+		{
+			ostringstream stop;
+			stop << "/" << axis << "TR";
+			ret = hub_->ExecuteCommand(stop.str(), answer);
+			if (ret != DEVICE_OK)
+				return ret;
+			current = 0;
+		}
+		cmd << "V" << labs(target) << (target > 0 ? "P0" : "D0") << "R";
+	}
+
+	ret = hub_->ExecuteCommand(cmd.str(), answer);
+	if (ret != DEVICE_OK)
+		return ret;
+	current = target;
+	return DEVICE_OK;
+}
+
+// Jogging leaves V at the last jog velocity on both axes. Moves that do
+// not carry V run at the controller's current setting, so put Speed back.
+int CytoTableXYStage::RestoreSpeed()
+{
+	profileX_.Invalidate();
+	profileY_.Invalidate();
+
+	ostringstream cmdX, cmdY;
+	cmdX << "/1V" << max(1L, (long) (speed_ / stepSizeXUm_)) << "R";
+	cmdY << "/2V" << max(1L, (long) (speed_ / stepSizeYUm_)) << "R";
+	string answer;
+	int ret = hub_->ExecuteCommand(cmdX.str(), answer);
+	if (ret != DEVICE_OK)
+		return ret;
+	return hub_->ExecuteCommand(cmdY.str(), answer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Calibration
+// Without a calibration the um conversions work like CXYStageBase's: um =
+// (steps - origin) * step size, negated on an axis the core mirrors. That
+// is an affine map as well, so transform_ holds it and every conversion,
+// including the position monitor's, goes through transform_. A calibration
+// maps um directly to controller steps, so the origin and mirroring are not
+// applied on top.
+///////////////////////////////////////////////////////////////////////////////
+int CytoTableXYStage::SetPositionUm(double x, double y)
+{
+	UpdateTransform();
+	long xSteps, ySteps;
+	transform_.UmToSteps(x, y, xSteps, ySteps);
+	int ret = SetPositionSteps(xSteps, ySteps);
+	if (ret != DEVICE_OK)
+		return ret;
+	return OnXYStagePositionChanged(x, y);
+}
+
+int CytoTableXYStage::GetPositionUm(double& x, double& y)
+{
+	UpdateTransform();
+	long xSteps, ySteps;
+	int ret = GetPositionSteps(xSteps, ySteps);
+	if (ret != DEVICE_OK)
+		return ret;
+	transform_.StepsToUm(xSteps, ySteps, x, y);
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::SetRelativePositionUm(double dx, double dy)
+{
+	UpdateTransform();
+	long dxSteps, dySteps;
+	transform_.DeltaUmToSteps(dx, dy, dxSteps, dySteps);
+	return SetRelativePositionSteps(dxSteps, dySteps);
+}
+
+// The current position becomes (x, y). With a calibration the origin only
+// takes effect once the calibration is cleared.
+int CytoTableXYStage::SetAdapterOriginUm(double x, double y)
+{
+	long xSteps, ySteps;
+	int ret = GetPositionSteps(xSteps, ySteps);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	bool mirrorX, mirrorY;
+	GetMirroring(mirrorX, mirrorY);
+	long dx = (long) floor(x / stepSizeXUm_ + 0.5);
+	long dy = (long) floor(y / stepSizeYUm_ + 0.5);
+	adapterOriginX_ = mirrorX ? xSteps + dx : xSteps - dx;
+	adapterOriginY_ = mirrorY ? ySteps + dy : ySteps - dy;
+	UpdateTransform();
+	return DEVICE_OK;
+}
+
+// The mirror settings are properties of CXYStageBase without a handler, so
+// they are read again before each conversion from the core
+void CytoTableXYStage::UpdateTransform()
+{
+	if (calibrated_)
+		return;
+
+	bool mirrorX, mirrorY;
+	GetMirroring(mirrorX, mirrorY);
+	double coeffs[6] = {(mirrorX ? -1.0 : 1.0) / stepSizeXUm_, 0.0, 0.0, (mirrorY ? -1.0 : 1.0) / stepSizeYUm_,
+		(double) adapterOriginX_, (double) adapterOriginY_};
+	MMThreadGuard guard(transformLock_);
+	transform_.Set(coeffs);
+}
+
+void CytoTableXYStage::GetMirroring(bool& mirrorX, bool& mirrorY)
+{
+	char value[MM::MaxStrLength] = "";
+	mirrorX = GetProperty(MM::g_Keyword_Transpose_MirrorX, value) == DEVICE_OK && strcmp(value, "1") == 0;
+	value[0] = 0;
+	mirrorY = GetProperty(MM::g_Keyword_Transpose_MirrorY, value) == DEVICE_OK && strcmp(value, "1") == 0;
+}
+
+int CytoTableXYStage::AddCalibrationPoint(double xUm, double yUm)
+{
+	long xSteps, ySteps;
+	int ret = GetPositionSteps(xSteps, ySteps);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	calUmX_.push_back(xUm);
+	calUmY_.push_back(yUm);
+	calStepsX_.push_back((double) xSteps);
+	calStepsY_.push_back((double) ySteps);
+	return DEVICE_OK;
+}
+
+void CytoTableXYStage::ClearCalibrationPoints()
+{
+	calUmX_.clear();
+	calUmY_.clear();
+	calStepsX_.clear();
+	calStepsY_.clear();
+}
+
+int CytoTableXYStage::EstimateCalibration()
+{
+	StageTransform estimate;
+	double rms;
+	if (!estimate.Estimate(calUmX_, calUmY_, calStepsX_, calStepsY_, rms))
+		return ERR_CALIBRATION_FAILED;
+
+	{
+		MMThreadGuard guard(transformLock_);
+		transform_ = estimate;
+	}
+	calibrationRms_ = rms;
+	calibrated_ = true;
+
+	ostringstream os;
+	os << "Calibration from " << calUmX_.size() << " points: " << transform_.ToString()
+		<< ", rms " << rms << " steps";
+	LogMessage(os.str().c_str(), true);
 	return DEVICE_OK;
 }
 
 int CytoTableXYStage::GetStepLimits(long& /*xMin*/, long& /*xMax*/, long& /*yMin*/, long& /*yMax*/)
 {
-	return DEVICE_UNSUPPORTED_COMMAND;
+	return DEVICE_UNSUPPORTED_COMMAND;
+}
+
+int CytoTableXYStage::GetLimitsUm(double& /*xMin*/, double& /*xMax*/, double& /*yMin*/, double& /*yMax*/)
+{
+	return DEVICE_UNSUPPORTED_COMMAND;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Action handlers
+///////////////////////////////////////////////////////////////////////////////
+int CytoTableXYStage::OnStepSizeX(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(stepSizeXUm_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      double stepSize;
+      pProp->Get(stepSize);
+      if (stepSize <=0.0)
+      {
+         pProp->Set(stepSizeXUm_);
+         return ERR_INVALID_STEP_SIZE;
+      }
+      {
+         // the move queue thread builds programs with the step sizes
+         MMThreadGuard guard(moveQueueLock_);
+         stepSizeXUm_ = stepSize;
+      }
+      UpdateTransform();
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnStepSizeY(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(stepSizeYUm_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double stepSize;
+      pProp->Get(stepSize);
+      if (stepSize <=0.0)
+      {
+         pProp->Set(stepSizeYUm_);
+         return ERR_INVALID_STEP_SIZE;
+      }
+      {
+         MMThreadGuard guard(moveQueueLock_);
+         stepSizeYUm_ = stepSize;
+      }
+      UpdateTransform();
+   }
+
+   return DEVICE_OK;
+}
+
+
+int CytoTableXYStage::OnSpeed(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(speed_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      double speed;
+      pProp->Get(speed);
+      if (speed <= 0.0)
+      {
+         pProp->Set(speed_);
+         return ERR_INVALID_SPEED;
+      }
+      MMThreadGuard guard(moveQueueLock_);
+      speed_ = speed;
+      profile_.speedUm = speed;
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnAdaptiveProfile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(profile_.enabled ? g_On : g_Off);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      string value;
+      pProp->Get(value);
+      MMThreadGuard guard(moveQueueLock_);
+      profile_.enabled = (value == g_On);
+      profileX_.Invalidate();
+      profileY_.Invalidate();
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnLongMoveSpeed(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(profile_.longSpeedUm);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      double speed;
+      pProp->Get(speed);
+      if (speed <= 0.0)
+      {
+         pProp->Set(profile_.longSpeedUm);
+         return ERR_INVALID_SPEED;
+      }
+      MMThreadGuard guard(moveQueueLock_);
+      profile_.longSpeedUm = speed;
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnFineMoveLimit(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(profile_.fineLimitUm);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      double limit;
+      pProp->Get(limit);
+      if (limit < 0.0 || limit > profile_.longLimitUm)
+      {
+         pProp->Set(profile_.fineLimitUm);
+         return ERR_INVALID_MOVE_LIMITS;
+      }
+      MMThreadGuard guard(moveQueueLock_);
+      profile_.fineLimitUm = limit;
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnLongMoveLimit(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(profile_.longLimitUm);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      double limit;
+      pProp->Get(limit);
+      if (limit < 0.0 || limit < profile_.fineLimitUm)
+      {
+         pProp->Set(profile_.longLimitUm);
+         return ERR_INVALID_MOVE_LIMITS;
+      }
+      MMThreadGuard guard(moveQueueLock_);
+      profile_.longLimitUm = limit;
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnJogMode(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(jogEnabled_ ? g_On : g_Off);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      string mode;
+      pProp->Get(mode);
+      bool enable = (mode == g_On);
+      if (enable == jogEnabled_)
+         return DEVICE_OK;
+
+      if (enable)
+      {
+         if (IsMoveQueueRunning())
+         {
+            pProp->Set(g_Off);
+            return ERR_MOVE_QUEUE_RUNNING;
+         }
+         if (!jogThread_)
+            jogThread_ = new JogThread(this);
+         jogEnabled_ = true;
+         jogThread_->Start();
+      }
+      else
+      {
+         jogThread_->Stop();
+         jogThread_->Join();
+         jogEnabled_ = false;
+         int ret = StopJog();
+         if (ret != DEVICE_OK)
+            return ret;
+         return RestoreSpeed();
+      }
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnJogUpdateRate(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(jogRateHz_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      double rate;
+      pProp->Get(rate);
+      if (rate < 1.0 || rate > 100.0)
+      {
+         pProp->Set(jogRateHz_);
+         return ERR_INVALID_JOG_RATE;
+      }
+      jogRateHz_ = rate;
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnJogTimeout(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(jogTimeoutMs_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      pProp->Get(jogTimeoutMs_);
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnCalibration(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(calibrated_ ? transform_.ToString().c_str() : g_None);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      string value;
+      pProp->Get(value);
+      if (value.empty() || value == g_None)
+      {
+         calibrated_ = false;
+         calibrationRms_ = 0.0;
+         UpdateTransform();
+         return DEVICE_OK;
+      }
+
+      StageTransform transform;
+      if (!transform.FromString(value))
+      {
+         pProp->Set(calibrated_ ? transform_.ToString().c_str() : g_None);
+         return ERR_CALIBRATION_FAILED;
+      }
+      {
+         MMThreadGuard guard(transformLock_);
+         transform_ = transform;
+      }
+      calibrated_ = true;
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnCalibrationPoint(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+      string value;
+      pProp->Get(value);
+      pProp->Set("");
+      if (value == g_Clear)
+      {
+         ClearCalibrationPoints();
+         return DEVICE_OK;
+      }
+
+      istringstream is(value);
+      double xUm, yUm;
+      if (!(is >> xUm >> yUm))
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      int ret = AddCalibrationPoint(xUm, yUm);
+      if (ret != DEVICE_OK)
+         return ret;
+
+      // refine with every point once there are enough of them
+      if (calUmX_.size() >= 3)
+         return EstimateCalibration();
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnCalibrationInfo(MM::PropertyBase* pProp, MM::ActionType eAct, long info)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      switch (info)
+      {
+      case CalPoints:
+         pProp->Set((long) calUmX_.size());
+         break;
+      case CalRms:
+         pProp->Set(calibrationRms_);
+         break;
+      case CalRotation:
+         pProp->Set(transform_.GetRotationDeg());
+         break;
+      case CalSkew:
+         pProp->Set(transform_.GetSkew());
+         break;
+      }
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnAdaptiveDelay(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(adaptiveDelay_ ? g_On : g_Off);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      string value;
+      pProp->Get(value);
+      adaptiveDelay_ = (value == g_On);
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnSettleLearning(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(settleLearning_ ? g_On : g_Off);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      string value;
+      pProp->Get(value);
+      settleLearning_ = (value == g_On);
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnRecommendedDelay(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(recommendedDelayMs_);
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnMotionState(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      long x, y;
+      bool readyX = true, readyY = true;
+      hub_->GetTrackedPosition(1, x, readyX);
+      hub_->GetTrackedPosition(2, y, readyY);
+      pProp->Set(readyX && readyY ? g_Idle : g_Moving);
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnMoveQueue(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+      string value;
+      pProp->Get(value);
+      pProp->Set("");
+      if (value == g_Clear)
+      {
+         ClearMoveQueue();
+         return DEVICE_OK;
+      }
+
+      // one move, or a list separated by ';'
+      vector<double> xUm, yUm, dwellMs;
+      istringstream list(value);
+      string entry;
+      while (getline(list, entry, ';'))
+      {
+         istringstream is(entry);
+         double x, y, dwell = 0.0;
+         if (!(is >> x >> y))
+            return DEVICE_INVALID_PROPERTY_VALUE;
+         is >> dwell;
+         xUm.push_back(x);
+         yUm.push_back(y);
+         dwellMs.push_back(dwell);
+      }
+      if (xUm.empty())
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      return QueueMovesUm(xUm, yUm, dwellMs);
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnMoveQueueLength(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(GetMoveQueueLength());
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnLookAheadDepth(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(lookAheadDepth_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      long depth;
+      pProp->Get(depth);
+      if (depth < 1 || depth > 16)
+      {
+         pProp->Set(lookAheadDepth_);
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      }
+      MMThreadGuard guard(moveQueueLock_);
+      lookAheadDepth_ = depth;
+	}
+
+	return DEVICE_OK;
+}
+
+int CytoTableXYStage::OnCoordinatedMoves(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(coordinated_ ? g_On : g_Off);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      string value;
+      pProp->Get(value);
+      bool enable = (value == g_On);
+      if (enable == coordinated_)
+         return DEVICE_OK;
+      if (IsMoveQueueRunning())
+      {
+         pProp->Set(coordinated_ ? g_On : g_Off);
+         return ERR_MOVE_QUEUE_RUNNING;
+      }
+      // the axis profiles know the last scaled speed, so the next plain
+      // move puts Speed back by itself
+      coordinated_ = enable;
+	}
+
+	return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PositionMonitorThread
+///////////////////////////////////////////////////////////////////////////////
+PositionMonitorThread::PositionMonitorThread(Hub* hub) :
+	hub_(hub),
+	stop_(true),
+	started_(false)
+{
+}
+
+PositionMonitorThread::~PositionMonitorThread()
+{
+	Stop();
+	Join();
+}
+
+void PositionMonitorThread::Start()
+{
+	MMThreadGuard guard(stopLock_);
+	stop_ = false;
+	started_ = true;
+	activate();
+}
+
+void PositionMonitorThread::Join()
+{
+	if (!started_)
+		return;
+	wait();
+	started_ = false;
+}
+
+void PositionMonitorThread::Stop()
+{
+	MMThreadGuard guard(stopLock_);
+	stop_ = true;
+}
+
+bool PositionMonitorThread::IsStopped()
+{
+	MMThreadGuard guard(stopLock_);
+	return stop_;
+}
+
+int PositionMonitorThread::svc()
+{
+	while (!IsStopped())
+	{
+		hub_->MonitorPositions();
+		CDeviceUtils::SleepMs(hub_->GetMonitorPeriodMs());
+	}
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MoveHandle
+///////////////////////////////////////////////////////////////////////////////
+MoveHandle::MoveHandle(long x, long y) :
+	x_(x),
+	y_(y),
+	state_(Queued),
+	result_(DEVICE_OK)
+{
+}
+
+MoveHandle::State MoveHandle::GetState()
+{
+	std::lock_guard<std::mutex> guard(mutex_);
+	return state_;
+}
+
+int MoveHandle::GetResult()
+{
+	std::lock_guard<std::mutex> guard(mutex_);
+	return result_;
+}
+
+bool MoveHandle::Wait(double timeoutMs)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	return finished_.wait_for(lock, std::chrono::microseconds((long long) (timeoutMs * 1000.0)),
+		[this] {return state_ == Done || state_ == Failed;});
+}
+
+void MoveHandle::SetRunning()
+{
+	std::lock_guard<std::mutex> guard(mutex_);
+	if (state_ == Queued)
+		state_ = Running;
+}
+
+void MoveHandle::Finish(int result)
+{
+	{
+		std::lock_guard<std::mutex> guard(mutex_);
+		if (state_ == Done || state_ == Failed)
+			return;
+		state_ = result == DEVICE_OK ? Done : Failed;
+		result_ = result;
+	}
+	finished_.notify_all();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MoveQueueThread
+///////////////////////////////////////////////////////////////////////////////
+MoveQueueThread::MoveQueueThread(CytoTableXYStage* stage) :
+	stage_(stage),
+	stop_(true),
+	started_(false)
+{
+}
+
+MoveQueueThread::~MoveQueueThread()
+{
+	Stop();
+	Join();
+}
+
+void MoveQueueThread::Start()
+{
+	MMThreadGuard guard(stopLock_);
+	stop_ = false;
+	started_ = true;
+	activate();
+}
+
+void MoveQueueThread::Join()
+{
+	if (!started_)
+		return;
+	wait();
+	started_ = false;
+}
+
+void MoveQueueThread::Stop()
+{
+	MMThreadGuard guard(stopLock_);
+	stop_ = true;
+}
+
+bool MoveQueueThread::IsStopped()
+{
+	MMThreadGuard guard(stopLock_);
+	return stop_;
+}
+
+// Runs until the queue is empty; the next QueueMove starts it again
+int MoveQueueThread::svc()
+{
+	return stage_->RunMoveQueue(this);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// JogThread
+///////////////////////////////////////////////////////////////////////////////
+JogThread::JogThread(CytoTableXYStage* stage) :
+	stage_(stage),
+	stop_(true),
+	started_(false)
+{
+}
+
+JogThread::~JogThread()
+{
+	Stop();
+	Join();
+}
+
+void JogThread::Start()
+{
+	MMThreadGuard guard(stopLock_);
+	stop_ = false;
+	started_ = true;
+	activate();
+}
+
+// wait() may only be called once per activate()
+void JogThread::Join()
+{
+	if (!started_)
+		return;
+	wait();
+	started_ = false;
+}
+
+void JogThread::Stop()
+{
+	MMThreadGuard guard(stopLock_);
+	stop_ = true;
+}
+
+bool JogThread::IsStopped()
+{
+	MMThreadGuard guard(stopLock_);
+	return stop_;
+}
+
+int JogThread::svc()
+{
+	while (!IsStopped())
+	{
+		stage_->ProcessJog();
+		CDeviceUtils::SleepMs(stage_->GetJogPeriodMs());
+	}
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//Z Stage
+///////////////////////////////////////////////////////////////////////////////
+ZStage::ZStage() :
+   hub_(0),
+   initialized_(false),
+   stepSizeUm_(0.1),
+   targetSteps_(0),
+   motion_(3),
+   adaptiveDelay_(false),
+   settleLearning_(false),
+   recommendedDelayMs_(0.0),
+   profile_(500.0, 1500.0),
+   sweepThread_(0),
+   sweepSamples_(g_SweepRingSize),
+   sweeping_(false),
+   sweepStartUm_(-50.0),
+   sweepEndUm_(50.0),
+   sweepSpeedUm_(100.0),
+   moving_(false)
+{
+	InitializeDefaultErrorMessages();
+	SetErrorText(ERR_NO_HUB, "Please add the Hub device first!");
+	SetErrorText(ERR_INVALID_SPEED, "Speed must be greater than zero");
+	SetErrorText(ERR_INVALID_MOVE_LIMITS, "FineMoveLimit-um must not be greater than LongMoveLimit-um");
+	SetErrorText(ERR_SWEEP_RUNNING, "A Z sweep is running");
+	SetErrorText(ERR_LINK_LOST, "Serial link to the controller lost, reconnecting");
+	SetErrorText(ERR_LED_SEQUENCE_RUNNING, "Not possible while the LED sequence is running");
+	SetErrorText(ERR_AXIS_IN_USE, g_AxisInUseText);
+	EnableDelay();
+
+   // Name
+   CreateProperty(MM::g_Keyword_Name, g_ZStageDeviceName, MM::String, true);
+
+   // Description
+   CreateProperty(MM::g_Keyword_Description, "Z stage driver adapter", MM::String, true);
+
+   // Axis ID
+   id_ = "Z";
+   CPropertyAction* pAct = new CPropertyAction(this, &ZStage::OnID);
+   CreateProperty(g_Axis_Id, id_.c_str(), MM::String, false, pAct, true); 
+   //Need to figure out this for Cyto
+   /*AddAllowedValue(g_Axis_Id, "X");
+   AddAllowedValue(g_Axis_Id, "Y");
+   AddAllowedValue(g_Axis_Id, "Z");
+   AddAllowedValue(g_Axis_Id, "R");
+   AddAllowedValue(g_Axis_Id, "T");
+   AddAllowedValue(g_Axis_Id, "F");
+   AddAllowedValue(g_Axis_Id, "A");
+   AddAllowedValue(g_Axis_Id, "B");
+   AddAllowedValue(g_Axis_Id, "C");*/
+}
+
+ZStage::~ZStage()
+{
+   Shutdown();
+   delete sweepThread_;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Stage methods required by the API
+///////////////////////////////////////////////////////////////////////////////
+
+void ZStage::GetName(char* Name) const
+{
+   CDeviceUtils::CopyLimitedString(Name, g_ZStageDeviceName);
+}
+
+
+int ZStage::Initialize()
+{
+	hub_ = static_cast<Hub*>(GetParentHub());
+	if (!hub_)
+		return ERR_NO_HUB;
+	motion_.SetAxis(GetAxisAddress(id_));
+
+	// Position
+	CPropertyAction* pAct = new CPropertyAction (this, &ZStage::OnStepSize);
+	int ret = CreateProperty("StepSize", "1.0", MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	// Adaptive delay, see CytoTableXYStage
+	pAct = new CPropertyAction (this, &ZStage::OnAdaptiveDelay);
+	ret = CreateProperty(g_AdaptiveDelay, g_Off, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_AdaptiveDelay, g_Off);
+	AddAllowedValue(g_AdaptiveDelay, g_On);
+
+	pAct = new CPropertyAction (this, &ZStage::OnSettleLearning);
+	ret = CreateProperty(g_SettleLearning, g_Off, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_SettleLearning, g_Off);
+	AddAllowedValue(g_SettleLearning, g_On);
+
+	pAct = new CPropertyAction (this, &ZStage::OnRecommendedDelay);
+	ret = CreateProperty(g_RecommendedDelay, "0.0", MM::Float, true, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	// Speed (in um/sec) and adaptive profile, see CytoTableXYStage
+	pAct = new CPropertyAction (this, &ZStage::OnSpeed);
+	ret = CreateProperty("Speed", "500.0", MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	pAct = new CPropertyAction (this, &ZStage::OnAdaptiveProfile);
+	ret = CreateProperty(g_AdaptiveProfile, g_Off, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_AdaptiveProfile, g_Off);
+	AddAllowedValue(g_AdaptiveProfile, g_On);
+
+	pAct = new CPropertyAction (this, &ZStage::OnLongMoveSpeed);
+	ret = CreateProperty(g_LongMoveSpeed, "1500.0", MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	pAct = new CPropertyAction (this, &ZStage::OnFineMoveLimit);
+	ret = CreateProperty(g_FineMoveLimit, "10.0", MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	SetPropertyLimits(g_FineMoveLimit, 0.0, g_MaxMoveLimitUm);
+
+	pAct = new CPropertyAction (this, &ZStage::OnLongMoveLimit);
+	ret = CreateProperty(g_LongMoveLimit, "2000.0", MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	SetPropertyLimits(g_LongMoveLimit, 0.0, g_MaxMoveLimitUm);
+
+	// Continuous sweep - set Sweep to Run to start, Idle to abort
+	pAct = new CPropertyAction (this, &ZStage::OnSweep);
+	ret = CreateProperty(g_Sweep, g_Idle, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_Sweep, g_Idle);
+	AddAllowedValue(g_Sweep, g_Run);
+
+	pAct = new CPropertyAction (this, &ZStage::OnSweepStart);
+	ret = CreateProperty(g_SweepStart, "-50.0", MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	pAct = new CPropertyAction (this, &ZStage::OnSweepEnd);
+	ret = CreateProperty(g_SweepEnd, "50.0", MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	pAct = new CPropertyAction (this, &ZStage::OnSweepSpeed);
+	ret = CreateProperty(g_SweepSpeed, "100.0", MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	// samples waiting to be read
+	pAct = new CPropertyAction (this, &ZStage::OnSweepSamples);
+	ret = CreateProperty(g_SweepSamples, "0", MM::Integer, true, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	// Set to Next to take the oldest samples out of the ring, then read
+	// them back as "time-us position-um;..." - empty once none are left
+	pAct = new CPropertyAction (this, &ZStage::OnSweepData);
+	ret = CreateProperty(g_SweepData, "", MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	// samples lost because the ring was full
+	pAct = new CPropertyAction (this, &ZStage::OnSweepDropped);
+	ret = CreateProperty(g_SweepDropped, "0", MM::Integer, true, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	// Moving/Idle, see CytoTableXYStage
+	pAct = new CPropertyAction (this, &ZStage::OnMotionState);
+	ret = CreateProperty(g_MotionState, g_Idle, MM::String, true, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	ret = GetPositionSteps(targetSteps_);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	ret = UpdateStatus();
+	if (ret != DEVICE_OK)
+		return ret;
+
+	ret = hub_->ClaimAxis(motion_.GetAxis(), this);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	hub_->AddAxisListener(this, motion_.GetAxis());
+	initialized_ = true;
+	return DEVICE_OK;
+}
+
+int ZStage::Shutdown()
+{
+   if (initialized_)
+   {
+      hub_->RemoveAxisListener(this);
+      StopSweep();
+      hub_->ReleaseAxes(this);
+      initialized_ = false;
+   }
+   return DEVICE_OK;
+}
+
+bool ZStage::Busy()
+{
+	if (IsSweeping())
+		return true;
+
+	bool busy = false;
+	int ret = motion_.Update(hub_, settleLearning_, GetCurrentMMTime(), busy);
+	if (ret != DEVICE_OK)
+		return ret == ERR_LINK_LOST;
+	return busy;
+}
+
+// Called by the hub's position monitor after the Z axis changed
+void ZStage::OnAxisUpdate()
+{
+	long steps;
+	bool ready;
+	if (!hub_->GetTrackedPosition(motion_.GetAxis(), steps, ready))
+		return;
+
+	double stepSizeUm;
+	{
+		MMThreadGuard guard(profileLock_);
+		stepSizeUm = stepSizeUm_;
+	}
+	OnStagePositionChanged(steps * stepSizeUm);
+	bool moving = !ready || IsSweeping();
+	if (moving != moving_)
+	{
+		moving_ = moving;
+		OnPropertyChanged(g_MotionState, moving_ ? g_Moving : g_Idle);
+	}
+}
+
+double ZStage::GetDelayMs() const
+{
+	if (adaptiveDelay_)
+		return recommendedDelayMs_;
+	return CStageBase<ZStage>::GetDelayMs();
+}
+
+int ZStage::SetPositionUm(double pos)
+{
+	return SetPositionSteps((long) floor(pos / stepSizeUm_ + 0.5));
+}
+
+int ZStage::GetPositionUm(double& pos)
+{
+	long steps;
+	int ret = GetPositionSteps(steps);
+	if (ret != DEVICE_OK)
+		return ret;
+	pos = steps * stepSizeUm_;
+	return DEVICE_OK;
+}
+
+int ZStage::SetPositionSteps(long steps)
+{
+	if (IsSweeping())
+		return ERR_SWEEP_RUNNING;
+	if (hub_->IsSequenceRunning(motion_.GetAxis()))
+		return ERR_LED_SEQUENCE_RUNNING;
+
+	// V goes along whenever Speed or the profile changed it
+	ostringstream cmd;
+	cmd << "/" << motion_.GetAxis();
+	{
+		MMThreadGuard guard(profileLock_);
+		if (profile_.enabled)
+			axisProfile_.AppendMove(cmd, profile_.Select(steps - targetSteps_, stepSizeUm_), steps);
+		else
+			axisProfile_.AppendMove(cmd, profile_.Fixed(stepSizeUm_), steps);
+	}
+	cmd << "R";
+
+	string answer;
+	int ret = hub_->ExecuteCommand(cmd.str(), answer);
+	if (ret != DEVICE_OK)
+	{
+		MMThreadGuard guard(profileLock_);
+		axisProfile_.Invalidate();
+		return ret;
+	}
+
+	long distance = steps - targetSteps_;
+	motion_.Start(distance, GetCurrentMMTime());
+	recommendedDelayMs_ = hub_->GetSettleTable().GetRecommendedDelayMs(motion_.GetAxis(), distance,
+		CStageBase<ZStage>::GetDelayMs());
+	targetSteps_ = steps;
+	return DEVICE_OK;
+}
+
+int ZStage::GetPositionSteps(long& steps)
+{
+	return hub_->GetAxisPosition(motion_.GetAxis(), steps);
+}
+
+int ZStage::SetOrigin()
+{
+	return DEVICE_UNSUPPORTED_COMMAND;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Z sweep
+///////////////////////////////////////////////////////////////////////////////
+int ZStage::StartSweep(double startUm, double endUm, double speedUmPerSec)
+{
+	if (speedUmPerSec <= 0.0)
+		return ERR_INVALID_SPEED;
+	if (IsSweeping())
+		return ERR_SWEEP_RUNNING;
+	if (hub_->IsSequenceRunning(motion_.GetAxis()))
+		return ERR_LED_SEQUENCE_RUNNING;
+
+	// the previous thread has finished on its own, collect it before reuse
+	if (sweepThread_)
+		sweepThread_->Join();
+	else
+		sweepThread_ = new ZSweepThread(this);
+
+	sweepSamples_.Reset();
+	sweepData_.clear();
+	{
+		MMThreadGuard guard(sweepLock_);
+		sweepRun_.startSteps = (long) floor(startUm / stepSizeUm_ + 0.5);
+		sweepRun_.endSteps = (long) floor(endUm / stepSizeUm_ + 0.5);
+		sweepRun_.speed = max(1L, (long) (speedUmPerSec / stepSizeUm_));
+		sweepRun_.stepSizeUm = stepSizeUm_;
+		sweeping_ = true;
+	}
+	sweepThread_->Start();
+	return DEVICE_OK;
+}
+
+int ZStage::StopSweep()
+{
+	if (!sweepThread_)
+		return DEVICE_OK;
+
+	sweepThread_->Stop();
+	sweepThread_->Join();
+
+	// a sweep stopped on an error may have left its V behind
+	{
+		MMThreadGuard guard(profileLock_);
+		axisProfile_.Invalidate();
+	}
+
+	ostringstream cmd;
+	cmd << "/" << motion_.GetAxis() << "TR";
+	string answer;
+	return hub_->ExecuteCommand(cmd.str(), answer);
+}
+
+bool ZStage::IsSweeping()
+{
+	MMThreadGuard guard(sweepLock_);
+	return sweeping_;
+}
+
+// Moves to the start at the normal speed, then commands the whole sweep as
+// one move and polls ?0 back to back. Each answer carries both the position
+// and the ready bit, so one exchange per sample is all it costs. The sweep
+// speed is replaced by the normal one again at the end, as moves only carry
+// V when the profile thinks it changed.
+int ZStage::RunSweep(ZSweepThread* thread)
+{
+	int axis = motion_.GetAxis();
+	SweepRun run;
+	{
+		MMThreadGuard guard(sweepLock_);
+		run = sweepRun_;
+	}
+
+	string answer;
+	ostringstream toStart;
+	toStart << "/" << axis;
+	{
+		MMThreadGuard guard(profileLock_);
+		axisProfile_.AppendMove(toStart, profile_.Fixed(run.stepSizeUm), run.startSteps);
+	}
+	toStart << "R";
+	int ret = hub_->ExecuteCommand(toStart.str(), answer);
+
+	bool ready = false;
+	long steps;
+	while (ret == DEVICE_OK && !ready && !thread->IsStopped())
+		ret = hub_->GetAxisPosition(axis, steps, ready);
+
+	if (ret == DEVICE_OK && !thread->IsStopped())
+	{
+		ostringstream sweep;
+		sweep << "/" << axis << "V" << run.speed << "A" << run.endSteps << "R";
+		ret = hub_->ExecuteCommand(sweep.str(), answer);
+	}
+	// V was changed outside the profile, or may not have arrived
+	{
+		MMThreadGuard guard(profileLock_);
+		axisProfile_.Invalidate();
+	}
+
+	ready = false;
+	while (ret == DEVICE_OK && !ready && !thread->IsStopped())
+	{
+		MM::MMTime before = GetCurrentMMTime();
+		ret = hub_->GetAxisPosition(axis, steps, ready);
+		MM::MMTime after = GetCurrentMMTime();
+		if (ret != DEVICE_OK)
+			break;
+
+		PositionSample sample;
+		sample.timeUs = (before.getUsec() + after.getUsec()) / 2.0;
+		sample.steps = steps;
+		sample.positionUm = steps * run.stepSizeUm;
+		sweepSamples_.Push(sample);
+	}
+
+	if (ret == DEVICE_OK)
+		ret = hub_->GetAxisPosition(axis, targetSteps_);
+
+	// back to the normal speed; an aborted sweep is terminated right after
+	if (ret == DEVICE_OK)
+	{
+		ostringstream restore;
+		restore << "/" << axis;
+		{
+			MMThreadGuard guard(profileLock_);
+			axisProfile_.AppendSpeed(restore, profile_.Fixed(run.stepSizeUm));
+		}
+		restore << "R";
+		ret = hub_->ExecuteCommand(restore.str(), answer);
+		if (ret != DEVICE_OK)
+		{
+			MMThreadGuard guard(profileLock_);
+			axisProfile_.Invalidate();
+		}
+	}
+
+	MMThreadGuard guard(sweepLock_);
+	sweeping_ = false;
+	return ret;
+}
+
+int ZStage::GetLimits(double& /*min*/, double& /*max*/)
+{
+   return DEVICE_UNSUPPORTED_COMMAND;
+}
+
+int ZStage::OnStepSize(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(stepSizeUm_);
+	}
+   else if (eAct == MM::AfterSet)
+	{
+      double stepSize;
+      pProp->Get(stepSize);
+      if (stepSize <=0.0)
+      {
+         pProp->Set(stepSizeUm_);
+         return ERR_INVALID_STEP_SIZE;
+      }
+      MMThreadGuard guard(profileLock_);
+      stepSizeUm_ = stepSize;
+	}
+
+   return DEVICE_OK;
+}
+
+int ZStage::OnID(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(id_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      string id;
+      pProp->Get(id);
+      // Only allow axis that we know:
+      if (id == "X" || id == "Y" || id == "Z")
+      {
+         id_ = id;
+         motion_.SetAxis(GetAxisAddress(id_));
+      }
+	}
+
+   return DEVICE_OK;
+}
+
+int ZStage::OnAdaptiveDelay(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(adaptiveDelay_ ? g_On : g_Off);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      string value;
+      pProp->Get(value);
+      adaptiveDelay_ = (value == g_On);
+	}
+
+   return DEVICE_OK;
+}
+
+int ZStage::OnSettleLearning(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(settleLearning_ ? g_On : g_Off);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      string value;
+      pProp->Get(value);
+      settleLearning_ = (value == g_On);
+	}
+
+   return DEVICE_OK;
+}
+
+int ZStage::OnRecommendedDelay(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(recommendedDelayMs_);
+	}
+
+   return DEVICE_OK;
+}
+
+int ZStage::OnSweep(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(IsSweeping() ? g_Run : g_Idle);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      string value;
+      pProp->Get(value);
+      if (value == g_Run)
+         return StartSweep(sweepStartUm_, sweepEndUm_, sweepSpeedUm_);
+      return StopSweep();
+	}
+
+   return DEVICE_OK;
+}
+
+int ZStage::OnSweepStart(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(sweepStartUm_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      pProp->Get(sweepStartUm_);
+	}
+
+   return DEVICE_OK;
+}
+
+int ZStage::OnSweepEnd(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(sweepEndUm_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      pProp->Get(sweepEndUm_);
+	}
+
+   return DEVICE_OK;
+}
+
+int ZStage::OnSweepSpeed(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(sweepSpeedUm_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      double speed;
+      pProp->Get(speed);
+      if (speed <= 0.0)
+      {
+         pProp->Set(sweepSpeedUm_);
+         return ERR_INVALID_SPEED;
+      }
+      sweepSpeedUm_ = speed;
+	}
+
+   return DEVICE_OK;
+}
+
+int ZStage::OnSweepSamples(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set((long) sweepSamples_.Size());
+	}
+
+   return DEVICE_OK;
+}
+
+// A chunk is as many samples as fit in one property value. Reading does not
+// take samples out, so a property browser refresh loses none.
+int ZStage::OnSweepData(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(sweepData_.c_str());
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      string value;
+      pProp->Get(value);
+      if (value != g_Next)
+      {
+         pProp->Set(sweepData_.c_str());
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      }
+
+      ostringstream os;
+      os << fixed;
+      PositionSample sample;
+      while (os.tellp() < (std::streamoff) MM::MaxStrLength - 64 && sweepSamples_.Pop(sample))
+         os << setprecision(0) << sample.timeUs << " " << setprecision(3) << sample.positionUm << ";";
+      sweepData_ = os.str();
+      pProp->Set(sweepData_.c_str());
+	}
+
+   return DEVICE_OK;
 }
 
-int CytoTableXYStage::GetLimitsUm(double& /*xMin*/, double& /*xMax*/, double& /*yMin*/, double& /*yMax*/)
+int ZStage::OnSweepDropped(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	return DEVICE_UNSUPPORTED_COMMAND;
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set((long) sweepSamples_.Dropped());
+	}
+
+   return DEVICE_OK;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Action handlers
-///////////////////////////////////////////////////////////////////////////////
-int CytoTableXYStage::OnStepSizeX(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ZStage::OnMotionState(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
 	if (eAct == MM::BeforeGet)
 	{
-      pProp->Set(stepSizeXUm_);
+      long steps;
+      bool ready = true;
+      hub_->GetTrackedPosition(motion_.GetAxis(), steps, ready);
+      pProp->Set(ready && !IsSweeping() ? g_Idle : g_Moving);
+	}
+
+   return DEVICE_OK;
+}
+
+int ZStage::OnSpeed(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(profile_.speedUm);
 	}
 	else if (eAct == MM::AfterSet)
 	{
-      double stepSize;
-      pProp->Get(stepSize);
-      if (stepSize <=0.0)
+      double speed;
+      pProp->Get(speed);
+      if (speed <= 0.0)
       {
-         pProp->Set(stepSizeXUm_);
-         return ERR_INVALID_STEP_SIZE;
+         pProp->Set(profile_.speedUm);
+         return ERR_INVALID_SPEED;
       }
-      stepSizeXUm_ = stepSize;
+      MMThreadGuard guard(profileLock_);
+      profile_.speedUm = speed;
 	}
 
-	return DEVICE_OK;
+   return DEVICE_OK;
 }
 
-int CytoTableXYStage::OnStepSizeY(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ZStage::OnAdaptiveProfile(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-   if (eAct == MM::BeforeGet)
-   {
-      pProp->Set(stepSizeYUm_);
-   }
-   else if (eAct == MM::AfterSet)
-   {
-      double stepSize;
-      pProp->Get(stepSize);
-      if (stepSize <=0.0)
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(profile_.enabled ? g_On : g_Off);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      string value;
+      pProp->Get(value);
+      MMThreadGuard guard(profileLock_);
+      profile_.enabled = (value == g_On);
+      axisProfile_.Invalidate();
+	}
+
+   return DEVICE_OK;
+}
+
+int ZStage::OnLongMoveSpeed(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(profile_.longSpeedUm);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      double speed;
+      pProp->Get(speed);
+      if (speed <= 0.0)
       {
-         pProp->Set(stepSizeYUm_);
-         return ERR_INVALID_STEP_SIZE;
+         pProp->Set(profile_.longSpeedUm);
+         return ERR_INVALID_SPEED;
       }
-      stepSizeYUm_ = stepSize;
-   }
+      MMThreadGuard guard(profileLock_);
+      profile_.longSpeedUm = speed;
+	}
 
    return DEVICE_OK;
 }
 
+int ZStage::OnFineMoveLimit(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(profile_.fineLimitUm);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      double limit;
+      pProp->Get(limit);
+      if (limit < 0.0 || limit > profile_.longLimitUm)
+      {
+         pProp->Set(profile_.fineLimitUm);
+         return ERR_INVALID_MOVE_LIMITS;
+      }
+      MMThreadGuard guard(profileLock_);
+      profile_.fineLimitUm = limit;
+	}
+
+   return DEVICE_OK;
+}
 
-int CytoTableXYStage::OnSpeed(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ZStage::OnLongMoveLimit(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-//
-	return DEVICE_OK;
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(profile_.longLimitUm);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      double limit;
+      pProp->Get(limit);
+      if (limit < 0.0 || limit < profile_.fineLimitUm)
+      {
+         pProp->Set(profile_.longLimitUm);
+         return ERR_INVALID_MOVE_LIMITS;
+      }
+      MMThreadGuard guard(profileLock_);
+      profile_.longLimitUm = limit;
+	}
+
+   return DEVICE_OK;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-//Z Stage
+// ZSweepThread
 ///////////////////////////////////////////////////////////////////////////////
-ZStage::ZStage() :
+ZSweepThread::ZSweepThread(ZStage* stage) :
+	stage_(stage),
+	stop_(true),
+	started_(false)
+{
+}
+
+ZSweepThread::~ZSweepThread()
+{
+	Stop();
+	Join();
+}
+
+void ZSweepThread::Start()
+{
+	MMThreadGuard guard(stopLock_);
+	stop_ = false;
+	started_ = true;
+	activate();
+}
+
+// wait() may only be called once per activate()
+void ZSweepThread::Join()
+{
+	if (!started_)
+		return;
+	wait();
+	started_ = false;
+}
+
+void ZSweepThread::Stop()
+{
+	MMThreadGuard guard(stopLock_);
+	stop_ = true;
+}
+
+bool ZSweepThread::IsStopped()
+{
+	MMThreadGuard guard(stopLock_);
+	return stop_;
+}
+
+int ZSweepThread::svc()
+{
+	return stage_->RunSweep(this);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LEDShutter
+///////////////////////////////////////////////////////////////////////////////
+LEDShutter::LEDShutter() :
+   hub_(0),
    initialized_(false),
-   stepSizeUm_(0.1)
+   output_(1),
+   triggerInput_(1),
+   open_(false),
+   sequenceRunning_(false)
 {
 	InitializeDefaultErrorMessages();
 	SetErrorText(ERR_NO_HUB, "Please add the Hub device first!");
+	SetErrorText(ERR_LED_SEQUENCE_RUNNING, "Not possible while the LED sequence is running");
+	SetErrorText(ERR_LINK_LOST, "Serial link to the controller lost, reconnecting");
+	SetErrorText(ERR_AXIS_IN_USE, g_AxisInUseText);
 
-   // Name
-   CreateProperty(MM::g_Keyword_Name, g_ZStageDeviceName, MM::String, true);
-
-   // Description
-   CreateProperty(MM::g_Keyword_Description, "Z stage driver adapter", MM::String, true);
+   CreateProperty(MM::g_Keyword_Name, g_LEDName, MM::String, true);
+   CreateProperty(MM::g_Keyword_Description, "LED on the table controller outputs", MM::String, true);
 
-   // Axis ID
+   // Controller axis whose outputs drive the LED. It must be one no stage
+   // drives: J commands and sequence programs would land in its moves.
    id_ = "Z";
-   CPropertyAction* pAct = new CPropertyAction(this, &ZStage::OnID);
-   CreateProperty(g_Axis_Id, id_.c_str(), MM::String, false, pAct, true); 
-   //Need to figure out this for Cyto
-   /*AddAllowedValue(g_Axis_Id, "X");
+   CPropertyAction* pAct = new CPropertyAction(this, &LEDShutter::OnID);
+   CreateProperty(g_Axis_Id, id_.c_str(), MM::String, false, pAct, true);
+   AddAllowedValue(g_Axis_Id, "X");
    AddAllowedValue(g_Axis_Id, "Y");
    AddAllowedValue(g_Axis_Id, "Z");
-   AddAllowedValue(g_Axis_Id, "R");
-   AddAllowedValue(g_Axis_Id, "T");
-   AddAllowedValue(g_Axis_Id, "F");
-   AddAllowedValue(g_Axis_Id, "A");
-   AddAllowedValue(g_Axis_Id, "B");
-   AddAllowedValue(g_Axis_Id, "C");*/
 }
 
-ZStage::~ZStage()
+LEDShutter::~LEDShutter()
 {
    Shutdown();
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Stage methods required by the API
-///////////////////////////////////////////////////////////////////////////////
-
-void ZStage::GetName(char* Name) const
+void LEDShutter::GetName(char* Name) const
 {
-   CDeviceUtils::CopyLimitedString(Name, g_ZStageDeviceName);
+   CDeviceUtils::CopyLimitedString(Name, g_LEDName);
 }
 
-
-int ZStage::Initialize()
+int LEDShutter::Initialize()
 {
-	// Position
-	CPropertyAction* pAct = new CPropertyAction (this, &ZStage::OnStepSize);
-	int ret = CreateProperty("StepSize", "1.0", MM::Float, false, pAct);
+	hub_ = static_cast<Hub*>(GetParentHub());
+	if (!hub_)
+		return ERR_NO_HUB;
+
+	// J bit driving the LED
+	CPropertyAction* pAct = new CPropertyAction (this, &LEDShutter::OnOutput);
+	int ret = CreateProperty(g_Output, "1", MM::Integer, false, pAct);
 	if (ret != DEVICE_OK)
 		return ret;
+	AddAllowedValue(g_Output, "1");
+	AddAllowedValue(g_Output, "2");
 
-	ret = UpdateStatus();
+	// Input with the camera's exposure signal, steps State sequences
+	pAct = new CPropertyAction (this, &LEDShutter::OnTriggerInput);
+	ret = CreateProperty(g_TriggerInput, "1", MM::Integer, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	SetPropertyLimits(g_TriggerInput, 1, 4);
+
+	// 0 = closed, 1 = open; sequenceable
+	pAct = new CPropertyAction (this, &LEDShutter::OnState);
+	ret = CreateProperty(MM::g_Keyword_State, "0", MM::Integer, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(MM::g_Keyword_State, "0");
+	AddAllowedValue(MM::g_Keyword_State, "1");
+
+	ret = hub_->ClaimAxis(GetAxisAddress(id_), this);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	ret = SetOutputs(0);
 	if (ret != DEVICE_OK)
+	{
+		hub_->ReleaseAxes(this);
 		return ret;
+	}
 
 	initialized_ = true;
 	return DEVICE_OK;
 }
 
-int ZStage::Shutdown()
+int LEDShutter::Shutdown()
 {
    if (initialized_)
    {
+      StopSequence();
+      SetOutputs(0);
+      hub_->ReleaseAxes(this);
       initialized_ = false;
    }
    return DEVICE_OK;
 }
 
-bool ZStage::Busy()
+// A running sequence is never done; a Fire pulse is until the axis is ready
+bool LEDShutter::Busy()
 {
-//
-	return false;
+	if (sequenceRunning_)
+		return false;
+
+	bool ready;
+	int ret = hub_->QueryAxisReady(GetAxisAddress(id_), ready);
+	if (ret != DEVICE_OK)
+		return ret == ERR_LINK_LOST;
+	return !ready;
 }
 
-int ZStage::SetPositionUm(double pos)
+int LEDShutter::SetOpen(bool open)
 {
-	pos;
+	if (sequenceRunning_)
+		return ERR_LED_SEQUENCE_RUNNING;
+
+	int ret = SetOutputs(open ? output_ : 0);
+	if (ret != DEVICE_OK)
+		return ret;
+	open_ = open;
 	return DEVICE_OK;
 }
 
-int ZStage::GetPositionUm(double& pos)
+int LEDShutter::GetOpen(bool& open)
 {
-	pos;
+	open = open_;
 	return DEVICE_OK;
 }
 
-int ZStage::SetPositionSteps(long steps)
+// The controller times the pulse: J<on>, M<deltaT ms>, J0
+int LEDShutter::Fire(double deltaT)
 {
-	steps;
+	if (sequenceRunning_)
+		return ERR_LED_SEQUENCE_RUNNING;
+	if (deltaT <= 0.0)
+		return DEVICE_INVALID_PROPERTY_VALUE;
+
+	ostringstream cmd;
+	cmd << "/" << GetAxisAddress(id_) << "J" << output_ << "M" << (long) (deltaT + 0.5) << "J0R";
+	string answer;
+	int ret = hub_->ExecuteCommand(cmd.str(), answer);
+	if (ret != DEVICE_OK)
+		return ret;
+	open_ = false;
 	return DEVICE_OK;
 }
 
-int ZStage::GetPositionSteps(long& steps)
+int LEDShutter::SetOutputs(long value)
+{
+	ostringstream cmd;
+	cmd << "/" << GetAxisAddress(id_) << "J" << value << "R";
+	string answer;
+	return hub_->ExecuteCommand(cmd.str(), answer);
+}
+
+int LEDShutter::LoadSequence(const std::vector<std::string>& states)
 {
-	steps;
+	if ((long) states.size() > g_LEDMaxSequence)
+		return DEVICE_SEQUENCE_TOO_LARGE;
+
+	sequence_.clear();
+	for (size_t i = 0; i < states.size(); i++)
+		sequence_.push_back(atol(states[i].c_str()) != 0 ? 1 : 0);
 	return DEVICE_OK;
 }
 
-int ZStage::SetOrigin()
+// One step per exposure: wait for the trigger to go high, set the state,
+// wait for it to go low, turn the LED off. g...G0 repeats until T.
+std::string LEDShutter::BuildSequenceProgram() const
 {
-	return DEVICE_UNSUPPORTED_COMMAND;
+	ostringstream program;
+	program << "g";
+	for (size_t i = 0; i < sequence_.size(); i++)
+	{
+		program << "H1" << triggerInput_ << "J" << (sequence_[i] ? output_ : 0);
+		program << "H0" << triggerInput_ << "J0";
+	}
+	program << "G0";
+	return program.str();
 }
 
-int ZStage::GetLimits(double& /*min*/, double& /*max*/)
+int LEDShutter::StartSequence()
 {
-   return DEVICE_UNSUPPORTED_COMMAND;
+	if (sequence_.empty())
+		return DEVICE_INVALID_PROPERTY_VALUE;
+
+	int ret = hub_->RunProgram(GetAxisAddress(id_), BuildSequenceProgram(), true);
+	if (ret != DEVICE_OK)
+		return ret;
+	hub_->SetSequenceRunning(GetAxisAddress(id_), true);
+	sequenceRunning_ = true;
+	open_ = false;
+	return DEVICE_OK;
 }
 
-int ZStage::OnStepSize(MM::PropertyBase* pProp, MM::ActionType eAct)
+int LEDShutter::StopSequence()
+{
+	if (!sequenceRunning_)
+		return DEVICE_OK;
+
+	ostringstream cmd;
+	cmd << "/" << GetAxisAddress(id_) << "TR";
+	string answer;
+	int ret = hub_->ExecuteCommand(cmd.str(), answer);
+	if (ret != DEVICE_OK)
+		return ret;
+	hub_->SetSequenceRunning(GetAxisAddress(id_), false);
+	sequenceRunning_ = false;
+	return SetOutputs(0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Action handlers
+///////////////////////////////////////////////////////////////////////////////
+int LEDShutter::OnID(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
 	if (eAct == MM::BeforeGet)
 	{
-      pProp->Set(stepSizeUm_);
+      pProp->Set(id_.c_str());
 	}
-   else if (eAct == MM::AfterSet)
+	else if (eAct == MM::AfterSet)
 	{
-      double stepSize;
-      pProp->Get(stepSize);
-      if (stepSize <=0.0)
+      string id;
+      pProp->Get(id);
+      if (id == "X" || id == "Y" || id == "Z")
+         id_ = id;
+	}
+
+   return DEVICE_OK;
+}
+
+int LEDShutter::OnOutput(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(output_);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      if (sequenceRunning_)
       {
-         pProp->Set(stepSizeUm_);
-         return ERR_INVALID_STEP_SIZE;
+         pProp->Set(output_);
+         return ERR_LED_SEQUENCE_RUNNING;
       }
-      stepSizeUm_ = stepSize;
+      long output;
+      pProp->Get(output);
+      output_ = output;
+      if (open_)
+         return SetOutputs(output_);
 	}
 
-   return DEVICE_OK;
+	return DEVICE_OK;
 }
 
-int ZStage::OnID(MM::PropertyBase* pProp, MM::ActionType eAct)
+int LEDShutter::OnTriggerInput(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
 	if (eAct == MM::BeforeGet)
 	{
-      pProp->Set(id_.c_str());
+      pProp->Set(triggerInput_);
 	}
 	else if (eAct == MM::AfterSet)
 	{
-      string id;
-      pProp->Get(id_);
-      // Only allow axis that we know:
-      if (id == "X" || id == "Y" || id == "Z")
-         id_ = id;
+      long input;
+      pProp->Get(input);
+      if (input < 1 || input > 4)
+      {
+         pProp->Set(triggerInput_);
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      }
+      triggerInput_ = input;
 	}
 
-   return DEVICE_OK;
+	return DEVICE_OK;
+}
+
+int LEDShutter::OnState(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+      pProp->Set(open_ ? 1L : 0L);
+	}
+	else if (eAct == MM::AfterSet)
+	{
+      long state;
+      pProp->Get(state);
+      return SetOpen(state != 0);
+	}
+	else if (eAct == MM::IsSequenceable)
+	{
+      pProp->SetSequenceable(g_LEDMaxSequence);
+	}
+	else if (eAct == MM::AfterLoadSequence)
+	{
+      return LoadSequence(pProp->GetSequence());
+	}
+	else if (eAct == MM::StartSequence)
+	{
+      return StartSequence();
+	}
+	else if (eAct == MM::StopSequence)
+	{
+      return StopSequence();
+	}
+
+	return DEVICE_OK;
 }
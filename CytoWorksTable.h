@@ -30,9 +30,21 @@
 
 #include "../../../MMDevice/MMDevice.h"
 #include "../../../MMDevice/DeviceBase.h"
+#include "../../../MMDevice/DeviceThreads.h"
+#include "SettleTable.h"
+#include "StageTransform.h"
+#include "SampleRing.h"
+#include "SerialRecorder.h"
+#include "ProgramCache.h"
 
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <sstream>
 #include <map>
+#include <vector>
 
 //////////////////////////////////////////////////////////////////////////////
 // Error codes
@@ -65,16 +77,62 @@
 #define ERR_OFFSET                    10100
 #define ERR_SERIAL_COMMAND_FAILED     10101 //Used in Hub
 #define ERR_NO_PORT_SET				  10102 //Used in Hub
+#define ERR_INVALID_JOG_RATE          10103 //Used in CytoTableXYStage::OnJogUpdateRate
+#define ERR_SETTLE_TABLE_IO           10104 //Used in Hub::OnSettleTableFile
+#define ERR_CALIBRATION_FAILED        10105 //Used in CytoTableXYStage calibration
+#define ERR_SWEEP_RUNNING             10106 //Used in ZStage sweep
+#define ERR_RECORD_FILE               10107 //Used in Hub::OnRecordFile
+#define ERR_INVALID_UPDATE_RATE       10108 //Used in Hub::OnPositionUpdateRate
+#define ERR_MOVE_QUEUE_RUNNING        10109 //Used in CytoTableXYStage move queue
+#define ERR_MOVE_QUEUE_FULL           10110 //Used in CytoTableXYStage move queue
+#define ERR_MOVE_ABORTED              10111 //Used in CytoTableXYStage move queue
+#define ERR_LED_SEQUENCE_RUNNING      10112 //Used in LEDShutter
+#define ERR_PROGRAM_CACHE_IO          10113 //Used in Hub::OnProgramCacheFile
+#define ERR_LINK_LOST                 10114 //Used in Hub reconnect
+#define ERR_INVALID_MOVE_LIMITS       10115 //Used in FineMoveLimit/LongMoveLimit
+#define ERR_AXIS_IN_USE               10116 //Used in Hub::ClaimAxis
 
 
 // MMCore name of serial port
-std::string port_ = "";
+extern std::string port_;
 
 int clearPort(MM::Device& device, MM::Core& core, const char* port);
+int GetAxisAddress(const std::string& id);
 
 //It's possible that I will need these - not sure yet 11.10.14
 //int getResult(MM::Device& device, MM::Core& core, const char* port);
 
+// Device that publishes position changes of hub axes. Called from the hub's
+// position monitor thread, so it must not block on the controller.
+class AxisListener
+{
+public:
+	virtual ~AxisListener() {}
+	virtual void OnAxisUpdate() = 0;
+};
+
+class Hub;
+
+// Polls moving axes and hands changes to the listeners at a bounded rate
+class PositionMonitorThread : public MMDeviceThreadBase
+{
+public:
+	PositionMonitorThread(Hub* hub);
+	~PositionMonitorThread();
+
+	int svc();
+	void Start();
+	void Stop();
+	void Join();
+	bool IsStopped();
+
+private:
+	Hub* hub_;
+	bool stop_;
+	bool started_;
+	MMThreadLock stopLock_;
+};
+
 class Hub : public HubBase<Hub>
 {
    public:
@@ -94,15 +152,272 @@ class Hub : public HubBase<Hub>
 	  
 	  // action interface
       int OnPort (MM::PropertyBase* pProp, MM::ActionType eAct);
+      int OnSettleTableFile (MM::PropertyBase* pProp, MM::ActionType eAct);
+      int OnRecordFile (MM::PropertyBase* pProp, MM::ActionType eAct);
+      int OnPositionUpdates (MM::PropertyBase* pProp, MM::ActionType eAct);
+      int OnPositionUpdateRate (MM::PropertyBase* pProp, MM::ActionType eAct);
+      int OnProgramCache (MM::PropertyBase* pProp, MM::ActionType eAct);
+      int OnProgramCacheFile (MM::PropertyBase* pProp, MM::ActionType eAct);
+      int OnProgramCacheInfo (MM::PropertyBase* pProp, MM::ActionType eAct, long info);
+      int OnLinkInfo (MM::PropertyBase* pProp, MM::ActionType eAct, long info);
+
+	  // Serial transaction with the controller. All peripherals go through
+	  // here so that worker threads never interleave frames on the port.
+	  // A dead port is reopened on the way; ERR_LINK_LOST while it can not be.
+	  int ExecuteCommand(const std::string& cmd, std::string& data);
+	  int ExecuteCommand(const std::string& cmd, std::string& data, bool& ready);
+	  // For the broadcast addresses, which the controller does not answer
+	  int BroadcastCommand(const std::string& cmd);
+	  // Command string for one axis, without address and R. With start
+	  // false it is only loaded, to be started by a broadcast R. With the
+	  // program cache on it runs from the controller's program storage.
+	  int RunProgram(int axis, const std::string& program, bool start);
+	  // For work that has to outlive a dropout, like a running move queue:
+	  // keeps trying to reconnect for up to timeoutMs
+	  int WaitForLink(double timeoutMs);
+
+	  // Single axis queries, axis is the controller address. With position
+	  // updates on, QueryAxisReady and the two argument GetAxisPosition answer
+	  // from the tracked state when it is recent enough.
+	  int QueryAxisReady(int axis, bool& ready);
+	  int GetAxisPosition(int axis, long& steps);
+	  int GetAxisPosition(int axis, long& steps, bool& ready);
+	  int GetAxisEncoder(int axis, long& steps);
+
+	  SettleTable& GetSettleTable() {return settleTable_;}
+
+	  // Each controller axis belongs to one device: a stage's moves and the
+	  // LED's output programs can not share it. ClaimAxis fails with
+	  // ERR_AXIS_IN_USE for an axis another device holds.
+	  int ClaimAxis(int axis, const MM::Device* owner);
+	  void ReleaseAxes(const MM::Device* owner);
+	  // An LED sequence program runs on the axis until the next T
+	  void SetSequenceRunning(int axis, bool running);
+	  bool IsSequenceRunning(int axis);
+
+	  // Position updates: listeners hear about changes of their axes
+	  void AddAxisListener(AxisListener* listener, int axis);
+	  void RemoveAxisListener(AxisListener* listener);
+	  bool GetTrackedPosition(int axis, long& steps, bool& ready);
+
+	  // called from PositionMonitorThread
+	  void MonitorPositions();
+	  long GetMonitorPeriodMs();
 
    private:
+	  enum { MaxAxis = 3 };
+
+	  // Last known state of an axis, from the queries that went over the line
+	  struct AxisState
+	  {
+		  AxisState();
+
+		  long steps;
+		  bool ready;
+		  bool valid;           // steps is the position since the last command
+		  MM::MMTime polled;    // when steps was read
+		  long publishedSteps;
+		  bool publishedReady;
+		  bool published;
+	  };
+
+	  int Exchange(const std::string& cmd, std::string& data, bool& ready, bool& sent, bool& portError);
+	  int Reconnect();
+	  int ResyncState();
+	  int DrainPort();
+	  bool AnswerFits(const std::string& cmd, const std::string& answer);
+	  int ParseAnswer(const std::string& answer, std::string& data, bool& ready);
+	  void TrackCommand(const std::string& cmd, bool answered, const std::string& data, bool ready);
+	  int StartPositionUpdates();
+	  void StopPositionUpdates();
+	  int SelectStoredProgram(int axis, const std::string& program, int& slot);
+
       // Command exchange with MMCore
       std::string command_;
       bool initialized_;
 	  int transmissionDelay_;
+	  MMThreadLock executeLock_;
+	  SettleTable settleTable_;
+	  std::string settleTableFile_;
+	  SerialRecorder recorder_;
+	  std::string recordFile_;
+
+	  AxisState axisStates_[MaxAxis + 1];
+	  MMThreadLock stateLock_;
+	  const MM::Device* axisOwners_[MaxAxis + 1];    // under stateLock_
+	  bool sequenceRunning_[MaxAxis + 1];            // under stateLock_
+	  std::vector<std::pair<AxisListener*, int> > listeners_;
+	  MMThreadLock listenerLock_;
+	  PositionMonitorThread* monitorThread_;
+	  bool positionUpdates_;
+	  double positionUpdateRateHz_;
+
+	  // Programs kept in the controller's program storage across runs
+	  ProgramCache programCache_;
+	  std::string programCacheFile_;
+	  bool programCacheEnabled_;
+	  long programCacheHits_;
+	  long programCacheUploads_;
+
+	  // Link recovery, all under executeLock_ except the statistics
+	  bool linkLost_;
+	  bool reconnecting_;
+	  bool purgeBeforeNext_;    // stale input may follow a failed exchange
+	  int consecutiveTimeouts_;
+	  bool axisAnswered_[MaxAxis + 1];
+	  long linkReconnects_;     // under stateLock_
+	  double linkRecoveryMs_;   // under stateLock_
+};
+
+// Follows one axis from move start through ready and settle, and feeds the
+// hub's settle table. Driven from the owning device's Busy().
+class AxisMotion
+{
+public:
+	AxisMotion(int axis);
+
+	void SetAxis(int axis) {axis_ = axis;}
+	int GetAxis() const {return axis_;}
+	void Start(long distanceSteps, MM::MMTime now);
+	int Update(Hub* hub, bool learnSettle, MM::MMTime now, bool& busy);
+
+private:
+	enum State { Idle, Moving, Settling };
+
+	int axis_;
+	State state_;
+	long distance_;
+	MM::MMTime start_;
+	MM::MMTime readyAt_;
+	long lastEncoder_;
+	// Busy() is polled from the GUI, acquisition and script threads at once
+	MMThreadLock lock_;
+};
+
+// Motion parameters for one move. Speeds are in full resolution steps/sec,
+// resolution in microsteps per full step (j), accel is the L factor.
+struct MotionProfile
+{
+	long resolution;
+	long speed;
+	long accel;
+};
+
+// Picks a profile from the length of a move: fine moves crawl at full
+// resolution, short moves use high acceleration, long traverses run at
+// coarse resolution and a higher top speed.
+struct ProfileSettings
+{
+	ProfileSettings(double speed, double longSpeed);
+	MotionProfile Select(long distanceSteps, double stepSizeUm) const;
+	// every move at speedUm, for when the profile is off
+	MotionProfile Fixed(double stepSizeUm) const;
+
+	bool enabled;
+	double fineLimitUm;
+	double longLimitUm;
+	double speedUm;
+	double longSpeedUm;
+};
+
+// Scales the speed and acceleration of a two axis move down on the axis
+// with the shorter distance, so that both axes start and arrive together
+// and the stage follows a straight line. Neither axis exceeds its own
+// profile.
+void CoordinateProfiles(long dx, long dy, MotionProfile& x, MotionProfile& y);
+
+// Remembers the speed and acceleration an axis is set to, so a move frame
+// only carries the parameters that change. Every move ends at full
+// resolution, so resolution is not part of the resting state.
+class AxisProfile
+{
+public:
+	AxisProfile();
+
+	void Invalidate();
+	void AppendMove(std::ostringstream& frame, const MotionProfile& profile, long target);
+	// only V and L, e.g. ahead of a relative move
+	void AppendSpeed(std::ostringstream& frame, const MotionProfile& profile);
+
+private:
+	long speed_;
+	long accel_;
+};
+
+// Completion handle of one queued XY move. Done once the stage has reached
+// the target, Failed if the queue stopped before that.
+class MoveHandle
+{
+public:
+	enum State { Queued, Running, Done, Failed };
+
+	MoveHandle(long x, long y);
+
+	long GetTargetX() const {return x_;}
+	long GetTargetY() const {return y_;}
+	State GetState();
+	int GetResult();
+	// true once the move is Done or Failed, false on timeout
+	bool Wait(double timeoutMs);
+
+	// called by the queue
+	void SetRunning();
+	void Finish(int result);
+
+private:
+	long x_;
+	long y_;
+	State state_;
+	int result_;
+	std::mutex mutex_;
+	std::condition_variable finished_;
 };
 
-class CytoTableXYStage : public CXYStageBase<CytoTableXYStage>
+typedef std::shared_ptr<MoveHandle> MoveHandlePtr;
+
+class CytoTableXYStage;
+
+// Feeds queued moves to the controller and follows them
+class MoveQueueThread : public MMDeviceThreadBase
+{
+public:
+	MoveQueueThread(CytoTableXYStage* stage);
+	~MoveQueueThread();
+
+	int svc();
+	void Start();
+	void Stop();
+	void Join();
+	bool IsStopped();
+
+private:
+	CytoTableXYStage* stage_;
+	bool stop_;
+	bool started_;
+	MMThreadLock stopLock_;
+};
+
+// Sends coalesced jog velocities to the controller at a bounded rate
+class JogThread : public MMDeviceThreadBase
+{
+public:
+	JogThread(CytoTableXYStage* stage);
+	~JogThread();
+
+	int svc();
+	void Start();
+	void Stop();
+	void Join();
+	bool IsStopped();
+
+private:
+	CytoTableXYStage* stage_;
+	bool stop_;
+	bool started_;
+	MMThreadLock stopLock_;
+};
+
+class CytoTableXYStage : public CXYStageBase<CytoTableXYStage>, public AxisListener
 {
 public: 
 	CytoTableXYStage();
@@ -127,14 +442,93 @@ public:
 		double GetStepSizeXUm() {return stepSizeXUm_;}
 		double GetStepSizeYUm() {return stepSizeYUm_;}
 		int IsXYStageSequenceable(bool& isSequenceable) const {isSequenceable =	false; return			DEVICE_OK;}
+		double GetDelayMs() const;
+
+		// Calibrated um <-> steps; without a calibration these use the step
+		// sizes, the adapter origin and the core's mirror settings
+		int SetPositionUm(double x, double y);
+		int GetPositionUm(double& x, double& y);
+		int SetRelativePositionUm(double dx, double dy);
+		int SetAdapterOriginUm(double x, double y);
+
+		// Calibration from stage/camera correspondences: each point pairs a
+		// position in um with the current stage position in steps
+		int AddCalibrationPoint(double xUm, double yUm);
+		void ClearCalibrationPoints();
+		int EstimateCalibration();
+
+		// Move look-ahead: targets queue up without blocking and run back to
+		// back. The controller gets up to LookAheadDepth targets as one
+		// command string, so each starts as soon as the one before ends.
+		// dwellMs holds the stage at a target before the next move.
+		int QueueMove(long x, long y, long dwellMs, MoveHandlePtr* handle = 0);
+		int QueueMoveUm(double x, double y, double dwellMs, MoveHandlePtr* handle = 0);
+		// A position list in um, converted in one batch and queued as a
+		// block: all of it, or nothing if the queue has no room
+		int QueueMovesUm(const std::vector<double>& x, const std::vector<double>& y, const std::vector<double>& dwellMs);
+		void ClearMoveQueue();
+		long GetMoveQueueLength();
+		bool IsMoveQueueRunning();
+
+		// called from MoveQueueThread
+		int RunMoveQueue(MoveQueueThread* thread);
 
 		// action interface
 		int OnStepSizeX		(MM::PropertyBase* pProp, MM::ActionType eAct);
 		int OnStepSizeY		(MM::PropertyBase* pProp, MM::ActionType eAct);
 		int OnSpeed			(MM::PropertyBase* pProp, MM::ActionType eAct);
+		int OnAdaptiveProfile(MM::PropertyBase* pProp, MM::ActionType eAct);
+		int OnLongMoveSpeed	(MM::PropertyBase* pProp, MM::ActionType eAct);
+		int OnFineMoveLimit	(MM::PropertyBase* pProp, MM::ActionType eAct);
+		int OnLongMoveLimit	(MM::PropertyBase* pProp, MM::ActionType eAct);
+		int OnJogMode		(MM::PropertyBase* pProp, MM::ActionType eAct);
+		int OnJogUpdateRate	(MM::PropertyBase* pProp, MM::ActionType eAct);
+		int OnJogTimeout	(MM::PropertyBase* pProp, MM::ActionType eAct);
+		int OnAdaptiveDelay	(MM::PropertyBase* pProp, MM::ActionType eAct);
+		int OnSettleLearning(MM::PropertyBase* pProp, MM::ActionType eAct);
+		int OnRecommendedDelay(MM::PropertyBase* pProp, MM::ActionType eAct);
+		int OnCalibration	(MM::PropertyBase* pProp, MM::ActionType eAct);
+		int OnCalibrationPoint(MM::PropertyBase* pProp, MM::ActionType eAct);
+		int OnCalibrationInfo(MM::PropertyBase* pProp, MM::ActionType eAct, long info);
+		int OnMotionState	(MM::PropertyBase* pProp, MM::ActionType eAct);
+		int OnMoveQueue		(MM::PropertyBase* pProp, MM::ActionType eAct);
+		int OnMoveQueueLength(MM::PropertyBase* pProp, MM::ActionType eAct);
+		int OnLookAheadDepth(MM::PropertyBase* pProp, MM::ActionType eAct);
+		int OnCoordinatedMoves(MM::PropertyBase* pProp, MM::ActionType eAct);
 
+		// Position updates from the hub
+		void OnAxisUpdate();
+
+		// Jog (velocity) mode - called from JogThread
+		int ProcessJog();
+		long GetJogPeriodMs();
 
 private:
+	int Jog(long x, long y);
+	int StopJog();
+	int TerminateJog();
+	int SetAxisVelocity(int axis, long& current, long target);
+	int RestoreSpeed();
+	void SetTarget(long x, long y);
+	void GetTarget(long& x, long& y);
+	void StartMotion(long dx, long dy);
+	void AppendAxisMove(std::ostringstream& cmd, AxisProfile& axisProfile, long from, long to, double stepSizeUm);
+	void AppendXYMove(std::ostringstream& cmdX, std::ostringstream& cmdY, long fromX, long fromY, long x, long y, bool coordinate);
+	MotionProfile SelectProfile(double distanceUm, double stepSizeUm) const;
+	void UpdateTransform();
+	void GetMirroring(bool& mirrorX, bool& mirrorY);
+	void AbortMoveQueue(int result);
+	int QueueMoves(const long* x, const long* y, const long* dwellMs, size_t n, MoveHandlePtr* handles);
+
+	struct QueuedMove
+	{
+		long x;
+		long y;
+		long dwellMs;
+		MoveHandlePtr handle;
+	};
+
+	Hub* hub_;
 	bool initialized_;
 	double stepSizeXUm_;
 	double stepSizeYUm_;
@@ -147,11 +541,92 @@ private:
 	//long accel_; - only need this if you use OnAccel
 	double originX_; //- only need this if you use SetAdapterOrigin
 	double originY_; //- only need this if you use SetAdapterOrigin
+	long targetX_;    // under moveQueueLock_
+	long targetY_;    // under moveQueueLock_
+
+	// Adaptive delay: per-move settle time looked up in the hub's table
+	AxisMotion motionX_;
+	AxisMotion motionY_;
+	bool adaptiveDelay_;
+	bool settleLearning_;
+	double recommendedDelayMs_;
+
+	// Adaptive motion profile
+	ProfileSettings profile_;
+	AxisProfile profileX_;
+	AxisProfile profileY_;
+	// Straight line moves: both axes scaled to start and arrive together
+	bool coordinated_;
+
+	// Affine calibration, replaces the step sizes once set. Without one,
+	// transform_ holds the step sizes, the adapter origin and mirroring.
+	// It is written under transformLock_ because the position monitor
+	// converts with it.
+	StageTransform transform_;
+	MMThreadLock transformLock_;
+	long adapterOriginX_;
+	long adapterOriginY_;
+	bool calibrated_;
+	double calibrationRms_;
+	std::vector<double> calUmX_;
+	std::vector<double> calUmY_;
+	std::vector<double> calStepsX_;
+	std::vector<double> calStepsY_;
 	//unsigned idX_; - only need this if you use OnIDX
 	//unsigned idY_; - only need this if you use OnIDY
+
+	// Jog mode: the newest requested velocity (steps/sec) replaces any
+	// request the jog thread has not yet sent
+	JogThread* jogThread_;
+	MMThreadLock jogLock_;
+	MMThreadLock jogSendLock_;
+	bool jogEnabled_;
+	bool jogPending_;
+	long jogVX_;
+	long jogVY_;
+	long sentVX_;
+	long sentVY_;
+	double jogRateHz_;
+	double jogTimeoutMs_;
+	MM::MMTime lastJogRequest_;
+
+	// last motion state published through MotionState
+	bool moving_;
+
+	// Move look-ahead queue; moveQueue_ has not been sent yet.
+	// moveQueueLock_ also covers the step sizes, Speed and the profile
+	// settings, which the queue thread reads while it builds a program.
+	MoveQueueThread* moveQueueThread_;
+	MMThreadLock moveQueueLock_;
+	std::deque<QueuedMove> moveQueue_;
+	std::vector<QueuedMove> runningMoves_;
+	bool moveQueueRunning_;
+	long lookAheadDepth_;
 };
 
-class ZStage : public CStageBase<ZStage>
+class ZStage;
+
+// Runs one constant velocity Z sweep and streams positions into the ring
+class ZSweepThread : public MMDeviceThreadBase
+{
+public:
+	ZSweepThread(ZStage* stage);
+	~ZSweepThread();
+
+	int svc();
+	void Start();
+	void Stop();
+	void Join();
+	bool IsStopped();
+
+private:
+	ZStage* stage_;
+	bool stop_;
+	bool started_;
+	MMThreadLock stopLock_;
+};
+
+class ZStage : public CStageBase<ZStage>, public AxisListener
 {
 	public:
 		ZStage();
@@ -173,20 +648,134 @@ class ZStage : public CStageBase<ZStage>
 	int GetLimits(double& min, double& max);
 
 	bool IsContinuousFocusDrive() const {return false;} 
+	double GetDelayMs() const;
 
    // action interface
 	int OnID(MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnStepSize	(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnAdaptiveDelay	(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSettleLearning(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnRecommendedDelay(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSpeed			(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnAdaptiveProfile(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnLongMoveSpeed	(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnFineMoveLimit	(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnLongMoveLimit	(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSweep			(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSweepStart	(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSweepEnd		(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSweepSpeed	(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSweepSamples	(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSweepData		(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSweepDropped	(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnMotionState	(MM::PropertyBase* pProp, MM::ActionType eAct);
 	int IsStageSequenceable(bool& isSequenceable) const {isSequenceable = false; return DEVICE_OK;}
 
+	// Continuous sweep for autofocus: drives Z at constant speed from
+	// startUm to endUm while sampling the position as fast as the link
+	// allows. Samples are read through the SweepData property, also while
+	// sweeping.
+	int StartSweep(double startUm, double endUm, double speedUmPerSec);
+	int StopSweep();
+	bool IsSweeping();
+
+	// called from ZSweepThread
+	int RunSweep(ZSweepThread* thread);
+
+	// Position updates from the hub
+	void OnAxisUpdate();
+
 	//This one i'm not sure - comes from ASI
 	//int OnPort(MM::PropertyBase* pProp, MM::ActionType eAct); //When you see OnID from Ludl, that's what this is--same function
 
 private:
+	Hub* hub_;
 	bool initialized_;
 	double stepSizeUm_;
 	std::string id_;
-   
+	long targetSteps_;
+
+	AxisMotion motion_;
+	bool adaptiveDelay_;
+	bool settleLearning_;
+	double recommendedDelayMs_;
+
+	ProfileSettings profile_;
+	AxisProfile axisProfile_;
+	// Covers stepSizeUm_, profile_ and axisProfile_, which the sweep thread
+	// uses as well
+	MMThreadLock profileLock_;
+
+	// What the running sweep was started with, copied under sweepLock_;
+	// the properties may change while it runs
+	struct SweepRun
+	{
+		long startSteps;
+		long endSteps;
+		long speed;
+		double stepSizeUm;
+	};
+
+	ZSweepThread* sweepThread_;
+	SampleRing sweepSamples_;
+	bool sweeping_;
+	SweepRun sweepRun_;
+	MMThreadLock sweepLock_;
+	double sweepStartUm_;
+	double sweepEndUm_;
+	double sweepSpeedUm_;
+	// last chunk of samples taken out of the ring by SweepData
+	std::string sweepData_;
+
+	bool moving_;
+};
+
+// LED (or any TTL load) on the digital outputs of one controller axis.
+// Open/close, Fire pulses and State sequences are all timed by the
+// controller. A sequence steps on the exposure signal of the camera, wired
+// to one of the same axis's inputs: the LED is set to the next state while
+// the signal is high and turned off when it goes low again.
+class LEDShutter : public CShutterBase<LEDShutter>
+{
+public:
+	LEDShutter();
+	~LEDShutter();
+
+	// Device API
+	int Initialize();
+	int Shutdown();
+
+	void GetName(char* pszName) const;
+	bool Busy();
+
+	// Shutter API
+	int SetOpen(bool open = true);
+	int GetOpen(bool& open);
+	int Fire(double deltaT);
+
+	// action interface
+	int OnID			(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnOutput		(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTriggerInput	(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnState			(MM::PropertyBase* pProp, MM::ActionType eAct);
+
+private:
+	int SetOutputs(long value);
+	int LoadSequence(const std::vector<std::string>& states);
+	std::string BuildSequenceProgram() const;
+	int StartSequence();
+	int StopSequence();
+
+	Hub* hub_;
+	bool initialized_;
+	std::string id_;
+	long output_;
+	long triggerInput_;
+	bool open_;
+
+	// last loaded State sequence, sent as a program on StartSequence
+	std::vector<long> sequence_;
+	bool sequenceRunning_;
 };
 
 #endif //_CYTOWORKSTABLE_H_
@@ -0,0 +1,210 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ProgramCache.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Index of the programs in the controller's program storage,
+//                keyed by content hash, with least recently used eviction.
+//
+// LICENSE:       This library is free software; you can redistribute it and/or
+//                modify it under the terms of the GNU Lesser General Public
+//                License as published by the Free Software Foundation.
+//                
+//                You should have received a copy of the GNU Lesser General Public
+//                License along with the source distribution; if not, write to
+//                the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+//                Boston, MA  02111-1307  USA
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES. 
+//
+#include "ProgramCache.h"
+
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+// File format: a header line, the use counter, then one line per used slot:
+//   axis slot hash(hex) lastUse
+const char* g_ProgramCacheHeader = "CytoTablePrograms 1";
+
+ProgramCache::ProgramCache()
+{
+	Clear();
+}
+
+// 64 bit FNV-1a
+unsigned long long ProgramCache::Hash(const std::string& program)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < program.length(); i++)
+	{
+		hash ^= (unsigned char) program[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+ProgramCache::Slot* ProgramCache::Find(int axis, int slot)
+{
+	if (axis < 1 || axis > MaxAxes || slot < FirstSlot || slot >= NumSlots)
+		return 0;
+	return &slots_[axis - 1][slot];
+}
+
+int ProgramCache::Find(int axis, unsigned long long hash, bool& verified) const
+{
+	MMThreadGuard guard(lock_);
+	if (axis < 1 || axis > MaxAxes)
+		return -1;
+	for (int s = FirstSlot; s < NumSlots; s++)
+	{
+		const Slot& slot = slots_[axis - 1][s];
+		if (slot.used && slot.hash == hash)
+		{
+			verified = slot.verified;
+			return s;
+		}
+	}
+	return -1;
+}
+
+int ProgramCache::SelectSlot(int axis) const
+{
+	MMThreadGuard guard(lock_);
+	if (axis < 1 || axis > MaxAxes)
+		return -1;
+	int oldest = FirstSlot;
+	for (int s = FirstSlot; s < NumSlots; s++)
+	{
+		const Slot& slot = slots_[axis - 1][s];
+		if (!slot.used)
+			return s;
+		if (slot.lastUse < slots_[axis - 1][oldest].lastUse)
+			oldest = s;
+	}
+	return oldest;
+}
+
+void ProgramCache::Store(int axis, int slot, unsigned long long hash)
+{
+	MMThreadGuard guard(lock_);
+	Slot* s = Find(axis, slot);
+	if (!s)
+		return;
+	s->used = true;
+	s->verified = true;
+	s->hash = hash;
+	s->lastUse = ++useCount_;
+}
+
+void ProgramCache::MarkVerified(int axis, int slot)
+{
+	MMThreadGuard guard(lock_);
+	Slot* s = Find(axis, slot);
+	if (s)
+		s->verified = true;
+}
+
+void ProgramCache::Forget(int axis, int slot)
+{
+	MMThreadGuard guard(lock_);
+	Slot* s = Find(axis, slot);
+	if (s)
+		s->used = false;
+}
+
+void ProgramCache::Touch(int axis, int slot)
+{
+	MMThreadGuard guard(lock_);
+	Slot* s = Find(axis, slot);
+	if (s)
+		s->lastUse = ++useCount_;
+}
+
+void ProgramCache::Unverify()
+{
+	MMThreadGuard guard(lock_);
+	for (int a = 0; a < MaxAxes; a++)
+	{
+		for (int s = 0; s < NumSlots; s++)
+			slots_[a][s].verified = false;
+	}
+}
+
+void ProgramCache::Clear()
+{
+	MMThreadGuard guard(lock_);
+	useCount_ = 0;
+	for (int a = 0; a < MaxAxes; a++)
+	{
+		for (int s = 0; s < NumSlots; s++)
+		{
+			Slot& slot = slots_[a][s];
+			slot.used = false;
+			slot.verified = false;
+			slot.hash = 0;
+			slot.lastUse = 0;
+		}
+	}
+}
+
+bool ProgramCache::Load(const std::string& path)
+{
+	ifstream in(path.c_str());
+	if (!in)
+		return false;
+
+	string line;
+	getline(in, line);
+	if (line.compare(0, string(g_ProgramCacheHeader).length(), g_ProgramCacheHeader) != 0)
+		return false;
+
+	Clear();
+	MMThreadGuard guard(lock_);
+	if (!getline(in, line) || !(istringstream(line) >> useCount_))
+		return false;
+	while (getline(in, line))
+	{
+		istringstream is(line);
+		int axis, slot;
+		unsigned long long hash, lastUse;
+		if (!(is >> axis >> slot >> hex >> hash >> dec >> lastUse))
+			continue;
+		Slot* s = Find(axis, slot);
+		if (!s)
+			continue;
+		s->used = true;
+		s->verified = false;
+		s->hash = hash;
+		s->lastUse = lastUse;
+	}
+	return true;
+}
+
+bool ProgramCache::Save(const std::string& path) const
+{
+	ofstream out(path.c_str());
+	if (!out)
+		return false;
+
+	MMThreadGuard guard(lock_);
+	out << g_ProgramCacheHeader << "\n" << useCount_ << "\n";
+	for (int a = 0; a < MaxAxes; a++)
+	{
+		for (int s = FirstSlot; s < NumSlots; s++)
+		{
+			const Slot& slot = slots_[a][s];
+			if (!slot.used)
+				continue;
+			out << (a + 1) << " " << s << " " << hex << slot.hash << dec << " " << slot.lastUse << "\n";
+		}
+	}
+	return out.good();
+}
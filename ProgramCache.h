@@ -0,0 +1,79 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ProgramCache.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Index of the programs in the controller's program storage,
+//                keyed by content hash, with least recently used eviction.
+//
+// LICENSE:       This library is free software; you can redistribute it and/or
+//                modify it under the terms of the GNU Lesser General Public
+//                License as published by the Free Software Foundation.
+//                
+//                You should have received a copy of the GNU Lesser General Public
+//                License along with the source distribution; if not, write to
+//                the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+//                Boston, MA  02111-1307  USA
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES. 
+//
+#ifndef _PROGRAMCACHE_H_
+#define _PROGRAMCACHE_H_
+
+#include "../../../MMDevice/DeviceThreads.h"
+
+#include <string>
+
+// Only keeps the index; the hub does the uploads and the read-backs. A slot
+// loaded from a file is trusted only after it was read back once, since
+// the controller may have been reprogrammed in between.
+class ProgramCache
+{
+public:
+	// slot 0 runs at power up, so it is never used
+	enum { MaxAxes = 3, FirstSlot = 1, NumSlots = 16 };
+
+	ProgramCache();
+
+	static unsigned long long Hash(const std::string& program);
+
+	// axis is the controller address (1 = X, 2 = Y, 3 = Z). Slot holding
+	// the program, or -1.
+	int Find(int axis, unsigned long long hash, bool& verified) const;
+	// A free slot, else the least recently used one
+	int SelectSlot(int axis) const;
+
+	void Store(int axis, int slot, unsigned long long hash);
+	void MarkVerified(int axis, int slot);
+	void Forget(int axis, int slot);
+	void Touch(int axis, int slot);
+	// After the link was down: the controller may have been reset with it
+	void Unverify();
+
+	void Clear();
+	bool Load(const std::string& path);
+	bool Save(const std::string& path) const;
+
+private:
+	struct Slot
+	{
+		bool used;
+		bool verified;
+		unsigned long long hash;
+		unsigned long long lastUse;
+	};
+
+	Slot* Find(int axis, int slot);
+
+	Slot slots_[MaxAxes][NumSlots];
+	unsigned long long useCount_;
+	mutable MMThreadLock lock_;
+};
+
+#endif //_PROGRAMCACHE_H_
@@ -0,0 +1,114 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SampleRing.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Lock-free single-producer/single-consumer ring buffer of
+//                timestamped stage positions.
+//
+// LICENSE:       This library is free software; you can redistribute it and/or
+//                modify it under the terms of the GNU Lesser General Public
+//                License as published by the Free Software Foundation.
+//                
+//                You should have received a copy of the GNU Lesser General Public
+//                License along with the source distribution; if not, write to
+//                the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+//                Boston, MA  02111-1307  USA
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES. 
+//
+#ifndef _SAMPLERING_H_
+#define _SAMPLERING_H_
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+// One position reading. timeUs is on the core's clock (the one camera
+// frames are stamped with), taken halfway between sending the query and
+// receiving the answer.
+struct PositionSample
+{
+	double timeUs;
+	long steps;
+	double positionUm;
+};
+
+// The sweep thread pushes, one consumer (autofocus) pops. Neither side ever
+// blocks: a full ring drops the new sample and counts it instead.
+class SampleRing
+{
+public:
+	// capacity is rounded up to a power of two
+	explicit SampleRing(size_t capacity) :
+		head_(0),
+		tail_(0),
+		dropped_(0)
+	{
+		size_t size = 1;
+		while (size < capacity)
+			size <<= 1;
+		buffer_.resize(size);
+		mask_ = size - 1;
+	}
+
+	// producer side
+	bool Push(const PositionSample& sample)
+	{
+		size_t head = head_.load(std::memory_order_relaxed);
+		if (head - tail_.load(std::memory_order_acquire) > mask_)
+		{
+			dropped_.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		buffer_[head & mask_] = sample;
+		head_.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	// consumer side
+	bool Pop(PositionSample& sample)
+	{
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail == head_.load(std::memory_order_acquire))
+			return false;
+		sample = buffer_[tail & mask_];
+		tail_.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	size_t Size() const
+	{
+		return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+	}
+
+	unsigned long Dropped() const {return dropped_.load(std::memory_order_relaxed);}
+
+	// only while neither side is running
+	void Reset()
+	{
+		head_.store(0);
+		tail_.store(0);
+		dropped_.store(0);
+	}
+
+private:
+	std::vector<PositionSample> buffer_;
+	size_t mask_;
+	// head and tail on separate cache lines so producer and consumer do not
+	// invalidate each other's line on every sample
+	char pad0_[64];
+	std::atomic<size_t> head_;
+	char pad1_[64];
+	std::atomic<size_t> tail_;
+	char pad2_[64];
+	std::atomic<unsigned long> dropped_;
+};
+
+#endif //_SAMPLERING_H_
@@ -0,0 +1,266 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SerialRecorder.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Binary recorder of the serial traffic between the hub and
+//                the controller, and a reader for replaying recordings.
+//
+// LICENSE:       This library is free software; you can redistribute it and/or
+//                modify it under the terms of the GNU Lesser General Public
+//                License as published by the Free Software Foundation.
+//                
+//                You should have received a copy of the GNU Lesser General Public
+//                License along with the source distribution; if not, write to
+//                the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+//                Boston, MA  02111-1307  USA
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES. 
+//
+#ifdef WIN32
+   #include <windows.h>
+#else
+   #include <sys/mman.h>
+   #include <sys/stat.h>
+   #include <fcntl.h>
+   #include <unistd.h>
+#endif
+
+#include "SerialRecorder.h"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <map>
+
+using namespace std;
+
+const char g_RecordingMagic[8] = {'C', 'W', 'R', 'E', 'C', '0', '1', '\0'};
+
+// The file grows by this much whenever the mapping fills up
+const uint64_t g_MapChunk = 16 * 1024 * 1024;
+
+static uint64_t Padded(uint64_t length)
+{
+	return (length + 7) & ~((uint64_t) 7);
+}
+
+SerialRecorder::SerialRecorder() :
+	base_(0),
+	mappedSize_(0),
+	used_(0),
+	startNs_(0),
+	exchange_(0)
+#ifdef WIN32
+	, file_(INVALID_HANDLE_VALUE),
+	mapping_(0)
+#else
+	, fd_(-1)
+#endif
+{
+}
+
+SerialRecorder::~SerialRecorder()
+{
+	Close();
+}
+
+uint64_t SerialRecorder::NowNs()
+{
+	return (uint64_t) chrono::duration_cast<chrono::nanoseconds>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool SerialRecorder::Open(const std::string& path)
+{
+	Close();
+
+#ifdef WIN32
+	file_ = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file_ == INVALID_HANDLE_VALUE)
+		return false;
+#else
+	fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd_ < 0)
+		return false;
+#endif
+	path_ = path;
+	if (!Map(g_MapChunk))
+	{
+		Close();
+		return false;
+	}
+
+	startNs_ = NowNs();
+	exchange_ = 0;
+	RecordingHeader* header = (RecordingHeader*) base_;
+	memcpy(header->magic, g_RecordingMagic, sizeof(header->magic));
+	header->dataBytes = 0;
+	header->startTimeNs = startNs_;
+	header->reserved = 0;
+	used_ = sizeof(RecordingHeader);
+	return true;
+}
+
+void SerialRecorder::Close()
+{
+	if (base_)
+		((RecordingHeader*) base_)->dataBytes = used_ - sizeof(RecordingHeader);
+	Unmap();
+
+	// cut the unused tail of the last chunk
+#ifdef WIN32
+	if (file_ != INVALID_HANDLE_VALUE)
+	{
+		LARGE_INTEGER size;
+		size.QuadPart = (LONGLONG) used_;
+		SetFilePointerEx(file_, size, 0, FILE_BEGIN);
+		SetEndOfFile(file_);
+		CloseHandle(file_);
+		file_ = INVALID_HANDLE_VALUE;
+	}
+#else
+	if (fd_ >= 0)
+	{
+		// best effort; readers also stop at the first empty record
+		int ret = ftruncate(fd_, (off_t) used_);
+		(void) ret;
+		close(fd_);
+		fd_ = -1;
+	}
+#endif
+	used_ = 0;
+}
+
+bool SerialRecorder::Map(uint64_t size)
+{
+#ifdef WIN32
+	mapping_ = CreateFileMappingA(file_, 0, PAGE_READWRITE, (DWORD) (size >> 32), (DWORD) size, 0);
+	if (!mapping_)
+		return false;
+	base_ = (unsigned char*) MapViewOfFile(mapping_, FILE_MAP_WRITE, 0, 0, (SIZE_T) size);
+	if (!base_)
+	{
+		CloseHandle(mapping_);
+		mapping_ = 0;
+		return false;
+	}
+#else
+	if (ftruncate(fd_, (off_t) size) != 0)
+		return false;
+	void* p = mmap(0, (size_t) size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+	if (p == MAP_FAILED)
+		return false;
+	base_ = (unsigned char*) p;
+#endif
+	mappedSize_ = size;
+	return true;
+}
+
+void SerialRecorder::Unmap()
+{
+	if (!base_)
+		return;
+#ifdef WIN32
+	UnmapViewOfFile(base_);
+	CloseHandle(mapping_);
+	mapping_ = 0;
+#else
+	munmap(base_, (size_t) mappedSize_);
+#endif
+	base_ = 0;
+	mappedSize_ = 0;
+}
+
+void SerialRecorder::Record(uint32_t exchange, int direction, const std::string& frame, int status)
+{
+	if (!base_)
+		return;
+
+	uint64_t now = NowNs();
+	uint16_t length = frame.length() > 0xFFFF ? 0xFFFF : (uint16_t) frame.length();
+	uint64_t size = sizeof(RecordHeader) + Padded(length);
+	if (used_ + size > mappedSize_)
+	{
+		// rare: remap one chunk larger and carry on
+		uint64_t newSize = mappedSize_ + g_MapChunk;
+		((RecordingHeader*) base_)->dataBytes = used_ - sizeof(RecordingHeader);
+		Unmap();
+		if (!Map(newSize))
+		{
+			Close();
+			return;
+		}
+	}
+
+	RecordHeader* record = (RecordHeader*) (base_ + used_);
+	record->timeNs = now - startNs_;
+	record->exchange = exchange;
+	record->length = length;
+	record->direction = (uint8_t) direction;
+	record->status = (int32_t) status;
+	memset(record->reserved, 0, sizeof(record->reserved));
+	memcpy(base_ + used_ + sizeof(RecordHeader), frame.data(), length);
+	used_ += size;
+}
+
+bool ReadRecording(const std::string& path, std::vector<RecordedExchange>& exchanges)
+{
+	ifstream in(path.c_str(), ios::binary);
+	if (!in)
+		return false;
+
+	RecordingHeader header;
+	if (!in.read((char*) &header, sizeof(header)) || memcmp(header.magic, g_RecordingMagic, sizeof(header.magic)) != 0)
+		return false;
+
+	// exchange number -> index in exchanges
+	map<uint32_t, size_t> open;
+	uint64_t remaining = header.dataBytes != 0 ? header.dataBytes : ~(uint64_t) 0;
+	RecordHeader record;
+	while (remaining >= sizeof(record) && in.read((char*) &record, sizeof(record)))
+	{
+		if (record.exchange == 0 && record.timeNs == 0 && record.length == 0)
+			break;
+
+		uint64_t padded = Padded(record.length);
+		string frame((size_t) padded, '\0');
+		if (padded > 0 && !in.read(&frame[0], (streamsize) padded))
+			break;
+		frame.resize(record.length);
+		remaining -= sizeof(record) + padded;
+
+		if (record.direction == RecordSent)
+		{
+			RecordedExchange e;
+			e.exchange = record.exchange;
+			e.request = frame;
+			e.sentNs = record.timeNs;
+			e.receivedNs = record.timeNs;
+			e.status = 0;
+			e.answered = false;
+			open[record.exchange] = exchanges.size();
+			exchanges.push_back(e);
+		}
+		else
+		{
+			map<uint32_t, size_t>::iterator it = open.find(record.exchange);
+			if (it == open.end())
+				continue;
+			RecordedExchange& e = exchanges[it->second];
+			e.answer = frame;
+			e.receivedNs = record.timeNs;
+			e.status = record.status;
+			e.answered = true;
+			open.erase(it);
+		}
+	}
+	return true;
+}
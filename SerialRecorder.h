@@ -0,0 +1,110 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SerialRecorder.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Binary recorder of the serial traffic between the hub and
+//                the controller, and a reader for replaying recordings.
+//
+// LICENSE:       This library is free software; you can redistribute it and/or
+//                modify it under the terms of the GNU Lesser General Public
+//                License as published by the Free Software Foundation.
+//                
+//                You should have received a copy of the GNU Lesser General Public
+//                License along with the source distribution; if not, write to
+//                the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+//                Boston, MA  02111-1307  USA
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES. 
+//
+#ifndef _SERIALRECORDER_H_
+#define _SERIALRECORDER_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// File layout, all little endian:
+//   RecordingHeader
+//   records, each a RecordHeader followed by length bytes of frame,
+//   padded to a multiple of 8 bytes
+// A sent frame and the answer to it share the same exchange number. The
+// header's dataBytes is written on Close(); a recording cut short by a crash
+// is still readable up to the first all-zero record.
+struct RecordingHeader
+{
+	char magic[8];          // "CWREC01\0"
+	uint64_t dataBytes;     // bytes of records following the header
+	uint64_t startTimeNs;   // host monotonic clock at Open()
+	uint64_t reserved;
+};
+
+struct RecordHeader
+{
+	uint64_t timeNs;        // since startTimeNs
+	uint32_t exchange;
+	int32_t status;         // DEVICE_OK, or the error the exchange failed with
+	uint16_t length;
+	uint8_t direction;      // RecordSent or RecordReceived
+	uint8_t reserved[5];
+};
+
+enum { RecordSent = 0, RecordReceived = 1 };
+
+// Appends records to a memory mapped file that grows in large steps, so the
+// cost on the serial path is a clock read and a memcpy. Not thread safe; the
+// hub calls it under its exchange lock.
+class SerialRecorder
+{
+public:
+	SerialRecorder();
+	~SerialRecorder();
+
+	bool Open(const std::string& path);
+	void Close();
+	bool IsOpen() const {return base_ != 0;}
+
+	uint32_t NextExchange() {return ++exchange_;}
+	void Record(uint32_t exchange, int direction, const std::string& frame, int status);
+
+	static uint64_t NowNs();
+
+private:
+	bool Map(uint64_t size);
+	void Unmap();
+
+	std::string path_;
+	unsigned char* base_;
+	uint64_t mappedSize_;
+	uint64_t used_;
+	uint64_t startNs_;
+	uint32_t exchange_;
+#ifdef WIN32
+	void* file_;
+	void* mapping_;
+#else
+	int fd_;
+#endif
+};
+
+// One request/answer pair read back from a recording
+struct RecordedExchange
+{
+	uint32_t exchange;
+	std::string request;
+	std::string answer;
+	uint64_t sentNs;
+	uint64_t receivedNs;
+	int status;
+	bool answered;
+};
+
+bool ReadRecording(const std::string& path, std::vector<RecordedExchange>& exchanges);
+
+#endif //_SERIALRECORDER_H_
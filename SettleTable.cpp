@@ -0,0 +1,186 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SettleTable.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Learned time-to-ready and settle times per axis and move
+//                distance, used for adaptive post-move delays.
+//
+// LICENSE:       This library is free software; you can redistribute it and/or
+//                modify it under the terms of the GNU Lesser General Public
+//                License as published by the Free Software Foundation.
+//                
+//                You should have received a copy of the GNU Lesser General Public
+//                License along with the source distribution; if not, write to
+//                the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+//                Boston, MA  02111-1307  USA
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES. 
+//
+#include "SettleTable.h"
+
+#include <cstdlib>
+#include <math.h>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+// File format: a header line, then one line per non-empty bucket:
+//   axis bucket readyCount readyMs settleCount settleMs settleVar
+const char* g_SettleTableHeader = "CytoTableSettle 1";
+
+// Running averages become exponential once a bucket has this many samples,
+// so the table follows slow mechanical drift
+const double g_MinWeight = 0.05;
+
+SettleTable::SettleTable()
+{
+	Clear();
+}
+
+int SettleTable::Bucket(long distanceSteps)
+{
+	unsigned long d = labs(distanceSteps);
+	int bucket = 0;
+	while (d > 1 && bucket < NumBuckets - 1)
+	{
+		d >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+SettleTable::Entry* SettleTable::Find(int axis, long distanceSteps)
+{
+	if (axis < 1 || axis > MaxAxes)
+		return 0;
+	return &entries_[axis - 1][Bucket(distanceSteps)];
+}
+
+const SettleTable::Entry* SettleTable::Find(int axis, long distanceSteps) const
+{
+	if (axis < 1 || axis > MaxAxes)
+		return 0;
+	return &entries_[axis - 1][Bucket(distanceSteps)];
+}
+
+void SettleTable::RecordReady(int axis, long distanceSteps, double readyMs)
+{
+	MMThreadGuard guard(lock_);
+	Entry* e = Find(axis, distanceSteps);
+	if (!e)
+		return;
+
+	e->readyCount++;
+	double w = 1.0 / e->readyCount;
+	if (w < g_MinWeight)
+		w = g_MinWeight;
+	e->readyMs += w * (readyMs - e->readyMs);
+}
+
+void SettleTable::RecordSettle(int axis, long distanceSteps, double settleMs)
+{
+	MMThreadGuard guard(lock_);
+	Entry* e = Find(axis, distanceSteps);
+	if (!e)
+		return;
+
+	e->settleCount++;
+	double w = 1.0 / e->settleCount;
+	if (w < g_MinWeight)
+		w = g_MinWeight;
+	double diff = settleMs - e->settleMs;
+	e->settleMs += w * diff;
+	e->settleVar = (1.0 - w) * (e->settleVar + w * diff * diff);
+}
+
+double SettleTable::GetRecommendedDelayMs(int axis, long distanceSteps, double fallbackMs) const
+{
+	MMThreadGuard guard(lock_);
+	const Entry* e = Find(axis, distanceSteps);
+	if (!e || e->settleCount < MinSamples)
+		return fallbackMs;
+	return e->settleMs + 2.0 * sqrt(e->settleVar);
+}
+
+double SettleTable::GetReadyTimeMs(int axis, long distanceSteps) const
+{
+	MMThreadGuard guard(lock_);
+	const Entry* e = Find(axis, distanceSteps);
+	if (!e)
+		return 0.0;
+	return e->readyMs;
+}
+
+void SettleTable::Clear()
+{
+	MMThreadGuard guard(lock_);
+	for (int a = 0; a < MaxAxes; a++)
+	{
+		for (int b = 0; b < NumBuckets; b++)
+		{
+			Entry& e = entries_[a][b];
+			e.readyCount = 0;
+			e.readyMs = 0.0;
+			e.settleCount = 0;
+			e.settleMs = 0.0;
+			e.settleVar = 0.0;
+		}
+	}
+}
+
+bool SettleTable::Load(const std::string& path)
+{
+	ifstream in(path.c_str());
+	if (!in)
+		return false;
+
+	string line;
+	getline(in, line);
+	if (line.compare(0, string(g_SettleTableHeader).length(), g_SettleTableHeader) != 0)
+		return false;
+
+	Clear();
+	MMThreadGuard guard(lock_);
+	while (getline(in, line))
+	{
+		istringstream is(line);
+		int axis, bucket;
+		Entry e;
+		if (!(is >> axis >> bucket >> e.readyCount >> e.readyMs >> e.settleCount >> e.settleMs >> e.settleVar))
+			continue;
+		if (axis < 1 || axis > MaxAxes || bucket < 0 || bucket >= NumBuckets)
+			continue;
+		entries_[axis - 1][bucket] = e;
+	}
+	return true;
+}
+
+bool SettleTable::Save(const std::string& path) const
+{
+	ofstream out(path.c_str());
+	if (!out)
+		return false;
+
+	MMThreadGuard guard(lock_);
+	out << g_SettleTableHeader << "\n";
+	for (int a = 0; a < MaxAxes; a++)
+	{
+		for (int b = 0; b < NumBuckets; b++)
+		{
+			const Entry& e = entries_[a][b];
+			if (e.readyCount == 0 && e.settleCount == 0)
+				continue;
+			out << (a + 1) << " " << b << " " << e.readyCount << " " << e.readyMs << " "
+				<< e.settleCount << " " << e.settleMs << " " << e.settleVar << "\n";
+		}
+	}
+	return out.good();
+}
@@ -0,0 +1,74 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SettleTable.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Learned time-to-ready and settle times per axis and move
+//                distance, used for adaptive post-move delays.
+//
+// LICENSE:       This library is free software; you can redistribute it and/or
+//                modify it under the terms of the GNU Lesser General Public
+//                License as published by the Free Software Foundation.
+//                
+//                You should have received a copy of the GNU Lesser General Public
+//                License along with the source distribution; if not, write to
+//                the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+//                Boston, MA  02111-1307  USA
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES. 
+//
+#ifndef _SETTLETABLE_H_
+#define _SETTLETABLE_H_
+
+#include "../../../MMDevice/DeviceThreads.h"
+
+#include <string>
+
+// Moves are bucketed by log2 of their length in steps, so bucket 0 holds
+// 0-1 step nudges and bucket 31 the longest possible traverse.
+class SettleTable
+{
+public:
+	enum { MaxAxes = 3, NumBuckets = 32, MinSamples = 3 };
+
+	SettleTable();
+
+	static int Bucket(long distanceSteps);
+
+	// axis is the controller address (1 = X, 2 = Y, 3 = Z)
+	void RecordReady(int axis, long distanceSteps, double readyMs);
+	void RecordSettle(int axis, long distanceSteps, double settleMs);
+
+	// Settle estimate plus two standard deviations, or fallbackMs while the
+	// bucket has fewer than MinSamples measurements
+	double GetRecommendedDelayMs(int axis, long distanceSteps, double fallbackMs) const;
+	double GetReadyTimeMs(int axis, long distanceSteps) const;
+
+	void Clear();
+	bool Load(const std::string& path);
+	bool Save(const std::string& path) const;
+
+private:
+	struct Entry
+	{
+		unsigned long readyCount;
+		double readyMs;
+		unsigned long settleCount;
+		double settleMs;
+		double settleVar;
+	};
+
+	Entry* Find(int axis, long distanceSteps);
+	const Entry* Find(int axis, long distanceSteps) const;
+
+	Entry entries_[MaxAxes][NumBuckets];
+	mutable MMThreadLock lock_;
+};
+
+#endif //_SETTLETABLE_H_
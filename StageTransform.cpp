@@ -0,0 +1,234 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          StageTransform.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Affine um <-> steps calibration of the XY stage, with batch
+//                conversion of position lists.
+//
+// LICENSE:       This library is free software; you can redistribute it and/or
+//                modify it under the terms of the GNU Lesser General Public
+//                License as published by the Free Software Foundation.
+//                
+//                You should have received a copy of the GNU Lesser General Public
+//                License along with the source distribution; if not, write to
+//                the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+//                Boston, MA  02111-1307  USA
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES. 
+//
+#include "StageTransform.h"
+
+#include <math.h>
+#include <sstream>
+
+using namespace std;
+
+const double g_SingularLimit = 1e-12;
+// Calibration points must be spread at least 1% as wide across as they
+// are long: smallest over largest eigenvalue of their scatter matrix
+const double g_MinSpreadRatio = 1e-4;
+
+StageTransform::StageTransform()
+{
+	SetScale(1.0, 1.0);
+}
+
+void StageTransform::SetScale(double stepSizeXUm, double stepSizeYUm)
+{
+	double coeffs[6] = {1.0 / stepSizeXUm, 0.0, 0.0, 1.0 / stepSizeYUm, 0.0, 0.0};
+	Set(coeffs);
+}
+
+bool StageTransform::Set(const double coeffs[6])
+{
+	double det = coeffs[0] * coeffs[3] - coeffs[1] * coeffs[2];
+	if (fabs(det) < g_SingularLimit)
+		return false;
+
+	a11_ = coeffs[0];
+	a12_ = coeffs[1];
+	a21_ = coeffs[2];
+	a22_ = coeffs[3];
+	tx_ = coeffs[4];
+	ty_ = coeffs[5];
+	return UpdateInverse();
+}
+
+void StageTransform::Get(double coeffs[6]) const
+{
+	coeffs[0] = a11_;
+	coeffs[1] = a12_;
+	coeffs[2] = a21_;
+	coeffs[3] = a22_;
+	coeffs[4] = tx_;
+	coeffs[5] = ty_;
+}
+
+bool StageTransform::UpdateInverse()
+{
+	double det = a11_ * a22_ - a12_ * a21_;
+	if (fabs(det) < g_SingularLimit)
+		return false;
+	i11_ = a22_ / det;
+	i12_ = -a12_ / det;
+	i21_ = -a21_ / det;
+	i22_ = a11_ / det;
+	return true;
+}
+
+string StageTransform::ToString() const
+{
+	ostringstream os;
+	os.precision(12);
+	os << a11_ << " " << a12_ << " " << a21_ << " " << a22_ << " " << tx_ << " " << ty_;
+	return os.str();
+}
+
+bool StageTransform::FromString(const std::string& text)
+{
+	istringstream is(text);
+	double coeffs[6];
+	for (int i = 0; i < 6; i++)
+	{
+		if (!(is >> coeffs[i]))
+			return false;
+	}
+	return Set(coeffs);
+}
+
+// Both rows of [A t] share the design matrix [u v 1], so one 3x3 normal
+// matrix is built and solved twice with Cramer's rule.
+bool StageTransform::Estimate(const std::vector<double>& xUm, const std::vector<double>& yUm,
+	const std::vector<double>& xSteps, const std::vector<double>& ySteps, double& rmsSteps)
+{
+	size_t n = xUm.size();
+	if (n < 3 || yUm.size() != n || xSteps.size() != n || ySteps.size() != n)
+		return false;
+
+	// center the data for numerical stability
+	double mu = 0.0, mv = 0.0;
+	for (size_t i = 0; i < n; i++)
+	{
+		mu += xUm[i];
+		mv += yUm[i];
+	}
+	mu /= n;
+	mv /= n;
+
+	double suu = 0.0, suv = 0.0, svv = 0.0, su = 0.0, sv = 0.0;
+	double sxu = 0.0, sxv = 0.0, sx = 0.0, syu = 0.0, syv = 0.0, sy = 0.0;
+	for (size_t i = 0; i < n; i++)
+	{
+		double u = xUm[i] - mu;
+		double v = yUm[i] - mv;
+		suu += u * u;
+		suv += u * v;
+		svv += v * v;
+		su += u;
+		sv += v;
+		sxu += xSteps[i] * u;
+		sxv += xSteps[i] * v;
+		sx += xSteps[i];
+		syu += ySteps[i] * u;
+		syv += ySteps[i] * v;
+		sy += ySteps[i];
+	}
+	double sn = (double) n;
+
+	// Nearly collinear points fit any skew or rotation across the line. The
+	// test is relative to the spread, so it holds for any um scale: det /
+	// trace^2 of the centered 2x2 scatter matrix is about lambda_min / lambda_max.
+	double spread = suu + svv;
+	if (spread <= 0.0 || suu * svv - suv * suv < g_MinSpreadRatio * spread * spread)
+		return false;
+
+	double det = suu * (svv * sn - sv * sv) - suv * (suv * sn - sv * su) + su * (suv * sv - svv * su);
+	if (fabs(det) < g_SingularLimit)
+		return false;
+
+	double coeffs[6];
+	for (int row = 0; row < 2; row++)
+	{
+		double bu = row == 0 ? sxu : syu;
+		double bv = row == 0 ? sxv : syv;
+		double b1 = row == 0 ? sx : sy;
+		double a = (bu * (svv * sn - sv * sv) - suv * (bv * sn - sv * b1) + su * (bv * sv - svv * b1)) / det;
+		double b = (suu * (bv * sn - sv * b1) - bu * (suv * sn - sv * su) + su * (suv * b1 - bv * su)) / det;
+		double c = (suu * (svv * b1 - bv * sv) - suv * (suv * b1 - bv * su) + bu * (suv * sv - svv * su)) / det;
+		coeffs[row * 2] = a;
+		coeffs[row * 2 + 1] = b;
+		// undo the centering
+		coeffs[4 + row] = c - a * mu - b * mv;
+	}
+	if (!Set(coeffs))
+		return false;
+
+	double sum = 0.0;
+	for (size_t i = 0; i < n; i++)
+	{
+		double dx = a11_ * xUm[i] + a12_ * yUm[i] + tx_ - xSteps[i];
+		double dy = a21_ * xUm[i] + a22_ * yUm[i] + ty_ - ySteps[i];
+		sum += dx * dx + dy * dy;
+	}
+	rmsSteps = sqrt(sum / n);
+	return true;
+}
+
+void StageTransform::UmToSteps(double xUm, double yUm, long& xSteps, long& ySteps) const
+{
+	UmToSteps(&xUm, &yUm, &xSteps, &ySteps, 1);
+}
+
+void StageTransform::StepsToUm(long xSteps, long ySteps, double& xUm, double& yUm) const
+{
+	StepsToUm(&xSteps, &ySteps, &xUm, &yUm, 1);
+}
+
+void StageTransform::DeltaUmToSteps(double dxUm, double dyUm, long& dxSteps, long& dySteps) const
+{
+	dxSteps = (long) floor(a11_ * dxUm + a12_ * dyUm + 0.5);
+	dySteps = (long) floor(a21_ * dxUm + a22_ * dyUm + 0.5);
+}
+
+void StageTransform::UmToSteps(const double* xUm, const double* yUm, long* xSteps, long* ySteps, size_t n) const
+{
+	const double a11 = a11_, a12 = a12_, a21 = a21_, a22 = a22_, tx = tx_ + 0.5, ty = ty_ + 0.5;
+	for (size_t i = 0; i < n; i++)
+	{
+		xSteps[i] = (long) floor(a11 * xUm[i] + a12 * yUm[i] + tx);
+		ySteps[i] = (long) floor(a21 * xUm[i] + a22 * yUm[i] + ty);
+	}
+}
+
+void StageTransform::StepsToUm(const long* xSteps, const long* ySteps, double* xUm, double* yUm, size_t n) const
+{
+	const double i11 = i11_, i12 = i12_, i21 = i21_, i22 = i22_, tx = tx_, ty = ty_;
+	for (size_t i = 0; i < n; i++)
+	{
+		double x = xSteps[i] - tx;
+		double y = ySteps[i] - ty;
+		xUm[i] = i11 * x + i12 * y;
+		yUm[i] = i21 * x + i22 * y;
+	}
+}
+
+double StageTransform::GetRotationDeg() const
+{
+	// angle of the stage x axis as seen in um space
+	return atan2(i21_, i11_) * 180.0 / 3.14159265358979323846;
+}
+
+double StageTransform::GetSkew() const
+{
+	// cosine of the angle between the stage axes; 0 means orthogonal
+	double lx = sqrt(i11_ * i11_ + i21_ * i21_);
+	double ly = sqrt(i12_ * i12_ + i22_ * i22_);
+	return (i11_ * i12_ + i21_ * i22_) / (lx * ly);
+}
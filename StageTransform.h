@@ -0,0 +1,77 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          StageTransform.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Affine um <-> steps calibration of the XY stage, with batch
+//                conversion of position lists.
+//
+// LICENSE:       This library is free software; you can redistribute it and/or
+//                modify it under the terms of the GNU Lesser General Public
+//                License as published by the Free Software Foundation.
+//                
+//                You should have received a copy of the GNU Lesser General Public
+//                License along with the source distribution; if not, write to
+//                the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+//                Boston, MA  02111-1307  USA
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES. 
+//
+#ifndef _STAGETRANSFORM_H_
+#define _STAGETRANSFORM_H_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// steps = A * um + t, where A holds scale, skew and rotation against the
+// camera and t the offset. The inverse is kept alongside so both directions
+// cost the same. Batch conversions take separate x and y arrays (structure
+// of arrays) and have branch-free loop bodies so the compiler can vectorize
+// them.
+class StageTransform
+{
+public:
+	StageTransform();
+
+	// plain per-axis scaling, no skew, rotation or offset
+	void SetScale(double stepSizeXUm, double stepSizeYUm);
+	// a11 a12 a21 a22 tx ty; false if A is singular
+	bool Set(const double coeffs[6]);
+	void Get(double coeffs[6]) const;
+
+	std::string ToString() const;
+	bool FromString(const std::string& text);
+
+	// Least squares fit from at least three non-collinear correspondences.
+	// Returns false if the points do not determine the transform, also when
+	// they lie too close to one line for a stable fit.
+	bool Estimate(const std::vector<double>& xUm, const std::vector<double>& yUm,
+		const std::vector<double>& xSteps, const std::vector<double>& ySteps, double& rmsSteps);
+
+	void UmToSteps(double xUm, double yUm, long& xSteps, long& ySteps) const;
+	void StepsToUm(long xSteps, long ySteps, double& xUm, double& yUm) const;
+	// displacement only, the offset does not apply
+	void DeltaUmToSteps(double dxUm, double dyUm, long& dxSteps, long& dySteps) const;
+
+	void UmToSteps(const double* xUm, const double* yUm, long* xSteps, long* ySteps, size_t n) const;
+	void StepsToUm(const long* xSteps, const long* ySteps, double* xUm, double* yUm, size_t n) const;
+
+	// decomposition of A for display
+	double GetRotationDeg() const;
+	double GetSkew() const;
+
+private:
+	bool UpdateInverse();
+
+	double a11_, a12_, a21_, a22_, tx_, ty_;
+	double i11_, i12_, i21_, i22_;
+};
+
+#endif //_STAGETRANSFORM_H_
@@ -0,0 +1,225 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          CytoTableReplay.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Replays a serial recording made with the hub's RecordFile
+//                property through the adapter against the controller
+//                simulator, and compares per-command latency with the
+//                recording.
+//
+//                CytoTableReplay <recording> [--baud 9600] [--fast]
+//                                [--out replay.rec] [--tolerance 1.25]
+//
+//                Exits with 1 when the p95 latency of any command kind is
+//                more than tolerance times the recorded p95.
+//
+// LICENSE:       This library is free software; you can redistribute it and/or
+//                modify it under the terms of the GNU Lesser General Public
+//                License as published by the Free Software Foundation.
+//                
+//                You should have received a copy of the GNU Lesser General Public
+//                License along with the source distribution; if not, write to
+//                the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+//                Boston, MA  02111-1307  USA
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES. 
+//
+#include "../CytoWorksTable.h"
+#include "../../../../MMDevice/ModuleInterface.h"
+#include "../SerialRecorder.h"
+#include "CytoTableSim.h"
+#include "MockCore.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+const char* g_SimPort = "SimPort";
+
+struct Latencies
+{
+	vector<double> recorded;  // ms
+	vector<double> replayed;  // ms
+	int failures;             // answered in the recording, failed in the replay
+
+	Latencies() : failures(0) {}
+};
+
+// "/1j16V100A2000R" -> "1 j", "/3?0R" -> "3 ?0"
+string CommandKind(const string& frame)
+{
+	if (frame.length() < 3 || frame[0] != '/')
+		return frame;
+	string kind = frame.substr(1, 1) + " ";
+	if (frame[2] == '?')
+		return kind + frame.substr(2, 2);
+	size_t i = 2;
+	while (i < frame.length() && isalpha((unsigned char) frame[i]) && frame[i] != 'R')
+		kind += frame[i++];
+	if (i == 2)
+		kind += frame.substr(2, 1);
+	return kind;
+}
+
+double Percentile(vector<double> values, double p)
+{
+	if (values.empty())
+		return 0.0;
+	sort(values.begin(), values.end());
+	size_t index = (size_t) (p * (values.size() - 1) + 0.5);
+	return values[index];
+}
+
+double Mean(const vector<double>& values)
+{
+	if (values.empty())
+		return 0.0;
+	double sum = 0.0;
+	for (size_t i = 0; i < values.size(); i++)
+		sum += values[i];
+	return sum / values.size();
+}
+
+void Usage()
+{
+	fprintf(stderr, "usage: CytoTableReplay <recording> [--baud 9600] [--fast] [--out replay.rec] [--tolerance 1.25] [--verbose]\n");
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	string recording;
+	string out;
+	long baud = 9600;
+	bool paced = true;
+	bool verbose = false;
+	double tolerance = 1.25;
+
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "--baud" && i + 1 < argc)
+			baud = atol(argv[++i]);
+		else if (arg == "--fast")
+			paced = false;
+		else if (arg == "--out" && i + 1 < argc)
+			out = argv[++i];
+		else if (arg == "--tolerance" && i + 1 < argc)
+			tolerance = atof(argv[++i]);
+		else if (arg == "--verbose")
+			verbose = true;
+		else if (recording.empty() && arg[0] != '-')
+			recording = arg;
+		else
+		{
+			Usage();
+			return 2;
+		}
+	}
+	if (recording.empty())
+	{
+		Usage();
+		return 2;
+	}
+
+	vector<RecordedExchange> exchanges;
+	if (!ReadRecording(recording, exchanges))
+	{
+		fprintf(stderr, "cannot read recording %s\n", recording.c_str());
+		return 2;
+	}
+
+	CytoTableSim sim;
+	sim.SetBaudRate(baud);
+	SimLink link(sim);
+	MockCore core;
+	core.SetVerbose(verbose);
+	core.AddPort(g_SimPort, &link);
+
+	MM::Device* device = ::CreateDevice("CytoTableHub");
+	core.AddDevice("CytoTableHub", device);
+	device->SetProperty(MM::g_Keyword_Port, g_SimPort);
+	int ret = device->Initialize();
+	if (ret == DEVICE_OK && !out.empty())
+		ret = device->SetProperty("RecordFile", out.c_str());
+	if (ret != DEVICE_OK)
+	{
+		fprintf(stderr, "hub initialization failed with %d\n", ret);
+		::DeleteDevice(device);
+		return 2;
+	}
+	Hub* hub = static_cast<Hub*>(device);
+
+	map<string, Latencies> kinds;
+	int skipped = 0;
+	typedef chrono::steady_clock Clock;
+	Clock::time_point replayStart = Clock::now();
+	uint64_t recordStartNs = exchanges.empty() ? 0 : exchanges.front().sentNs;
+
+	for (size_t i = 0; i < exchanges.size(); i++)
+	{
+		const RecordedExchange& e = exchanges[i];
+		// exchanges that timed out in the recording would only replay the timeout
+		if (!e.answered || e.request.empty())
+		{
+			skipped++;
+			continue;
+		}
+
+		if (paced)
+			this_thread::sleep_until(replayStart + chrono::nanoseconds(e.sentNs - recordStartNs));
+
+		string data;
+		Clock::time_point sent = Clock::now();
+		ret = hub->ExecuteCommand(e.request, data);
+		double ms = chrono::duration<double, milli>(Clock::now() - sent).count();
+
+		Latencies& l = kinds[CommandKind(e.request)];
+		l.recorded.push_back((e.receivedNs - e.sentNs) / 1e6);
+		l.replayed.push_back(ms);
+		if (ret != DEVICE_OK && e.status == DEVICE_OK)
+			l.failures++;
+	}
+
+	device->Shutdown();
+	::DeleteDevice(device);
+
+	printf("%-8s %7s | %9s %9s %9s %9s | %9s %9s %9s %9s | %s\n", "command", "count",
+		"rec mean", "rec p50", "rec p95", "rec max", "rep mean", "rep p50", "rep p95", "rep max", "failed");
+	bool regressed = false;
+	for (map<string, Latencies>::iterator it = kinds.begin(); it != kinds.end(); ++it)
+	{
+		const Latencies& l = it->second;
+		double recordedP95 = Percentile(l.recorded, 0.95);
+		double replayedP95 = Percentile(l.replayed, 0.95);
+		bool slow = recordedP95 > 0.5 && replayedP95 > tolerance * recordedP95;
+		regressed = regressed || slow;
+		printf("%-8s %7u | %9.2f %9.2f %9.2f %9.2f | %9.2f %9.2f %9.2f %9.2f | %d%s\n", it->first.c_str(),
+			(unsigned) l.recorded.size(),
+			Mean(l.recorded), Percentile(l.recorded, 0.5), recordedP95, Percentile(l.recorded, 1.0),
+			Mean(l.replayed), Percentile(l.replayed, 0.5), replayedP95, Percentile(l.replayed, 1.0),
+			l.failures, slow ? "  SLOWER" : "");
+	}
+	if (skipped > 0)
+		printf("%d unanswered exchanges in the recording were skipped\n", skipped);
+
+	return regressed ? 1 : 0;
+}
@@ -0,0 +1,651 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          CytoTableRunner.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Headless scan runner. Loads the adapter module through its
+//                exported functions, connects it to a real serial port or to
+//                the controller simulator and times a scripted scan.
+//
+//                CytoTableRunner --module <adapter library> <script>
+//                                [--port /dev/ttyUSB0] [--baud 9600]
+//                                [--repeat 1] [--verbose]
+//
+//                CytoTableRunner --module <adapter library> --soak <seconds>
+//                                [--pollers 2] [--drop-rate 0] [--max-delay-ms 0]
+//                                [--report-sec 60] [--baud 9600]
+//
+//                The soak runs GUI pollers, an acquisition and a script
+//                thread against the simulator at the same time, optionally
+//                dropping bytes and delaying answers, and reports latency,
+//                throughput, errors and memory per window. Exit code 1 means
+//                corrupt data or a move that ended off target, 3 a deadlock.
+//
+//                Script lines, '#' starts a comment:
+//                   xy <x-um> <y-um>       move the XY stage and wait
+//                   z <offset-um>          move Z relative to its start position
+//                   dwell <ms>             wait, e.g. for an exposure
+//                   queue <x-um> <y-um> [dwell-ms]
+//                                          add a move to the XY move queue
+//                   wait                   wait until the XY queue is done
+//                   unplug <ms>            USB dropout of the simulator link,
+//                                          then time until positions read again
+//                   sweep <from-um> <to-um> <um/s>
+//                                          Z sweep relative to the start position,
+//                                          reading its samples through SweepData
+//                   set <XY|Z|Hub> <property> <value>
+//
+// LICENSE:       This library is free software; you can redistribute it and/or
+//                modify it under the terms of the GNU Lesser General Public
+//                License as published by the Free Software Foundation.
+//
+//                You should have received a copy of the GNU Lesser General Public
+//                License along with the source distribution; if not, write to
+//                the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+//                Boston, MA  02111-1307  USA
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+#ifdef WIN32
+   #include <windows.h>
+#else
+   #include <dlfcn.h>
+#endif
+
+#include "../../../../MMDevice/MMDevice.h"
+#include "CytoTableSim.h"
+#include "CytoTableSoak.h"
+#include "MockCore.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+const char* g_HubLabel = "CytoTableHub";
+const char* g_XYLabel = "XY";
+const char* g_ZLabel = "Z";
+const char* g_SimPort = "SimPort";
+// longest wait for the adapter to reconnect after an unplug step
+const double g_RecoverTimeoutMs = 5000.0;
+// pause between SweepData reads that came back empty
+const long g_SweepPollMs = 10;
+
+typedef chrono::steady_clock Clock;
+
+///////////////////////////////////////////////////////////////////////////////
+// Adapter module, used only through its exports like MMCore does
+///////////////////////////////////////////////////////////////////////////////
+class AdapterModule
+{
+public:
+	typedef void (*InitializeModuleDataFn)();
+	typedef MM::Device* (*CreateDeviceFn)(const char*);
+	typedef void (*DeleteDeviceFn)(MM::Device*);
+
+	AdapterModule() : handle_(0), initialize_(0), create_(0), delete_(0) {}
+	~AdapterModule() {Unload();}
+
+	bool Load(const string& path)
+	{
+#ifdef WIN32
+		handle_ = LoadLibraryA(path.c_str());
+#else
+		handle_ = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+#endif
+		if (!handle_)
+			return false;
+		initialize_ = (InitializeModuleDataFn) Symbol("InitializeModuleData");
+		create_ = (CreateDeviceFn) Symbol("CreateDevice");
+		delete_ = (DeleteDeviceFn) Symbol("DeleteDevice");
+		if (!initialize_ || !create_ || !delete_)
+		{
+			Unload();
+			return false;
+		}
+		initialize_();
+		return true;
+	}
+
+	void Unload()
+	{
+		if (!handle_)
+			return;
+#ifdef WIN32
+		FreeLibrary((HMODULE) handle_);
+#else
+		dlclose(handle_);
+#endif
+		handle_ = 0;
+	}
+
+	MM::Device* CreateDevice(const char* name) {return create_(name);}
+	void DeleteDevice(MM::Device* device) {delete_(device);}
+
+private:
+	void* Symbol(const char* name)
+	{
+#ifdef WIN32
+		return (void*) GetProcAddress((HMODULE) handle_, name);
+#else
+		return dlsym(handle_, name);
+#endif
+	}
+
+	void* handle_;
+	InitializeModuleDataFn initialize_;
+	CreateDeviceFn create_;
+	DeleteDeviceFn delete_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Scan script
+///////////////////////////////////////////////////////////////////////////////
+struct ScanStep
+{
+	enum Type {MoveXY, MoveZ, Dwell, Set, QueueXY, WaitXY, Unplug, SweepZ} type;
+	double a;
+	double b;
+	double c;
+	string device;
+	string property;
+	string value;
+	int line;
+};
+
+bool ParseScript(const string& path, vector<ScanStep>& steps)
+{
+	ifstream is(path.c_str());
+	if (!is)
+	{
+		fprintf(stderr, "cannot open script %s\n", path.c_str());
+		return false;
+	}
+
+	string text;
+	int line = 0;
+	while (getline(is, text))
+	{
+		line++;
+		string::size_type comment = text.find('#');
+		if (comment != string::npos)
+			text.resize(comment);
+		istringstream ls(text);
+		string keyword;
+		if (!(ls >> keyword))
+			continue;
+
+		ScanStep step;
+		step.line = line;
+		step.a = step.b = step.c = 0.0;
+		bool ok;
+		if (keyword == "xy")
+		{
+			step.type = ScanStep::MoveXY;
+			ok = (bool) (ls >> step.a >> step.b);
+		}
+		else if (keyword == "z")
+		{
+			step.type = ScanStep::MoveZ;
+			ok = (bool) (ls >> step.a);
+		}
+		else if (keyword == "dwell")
+		{
+			step.type = ScanStep::Dwell;
+			ok = (bool) (ls >> step.a) && step.a >= 0.0;
+		}
+		else if (keyword == "queue")
+		{
+			step.type = ScanStep::QueueXY;
+			ok = (bool) (ls >> step.a >> step.b);
+			if (ok && !(ls >> step.c))
+				step.c = 0.0;
+			ok = ok && step.c >= 0.0;
+		}
+		else if (keyword == "wait")
+		{
+			step.type = ScanStep::WaitXY;
+			ok = true;
+		}
+		else if (keyword == "unplug")
+		{
+			step.type = ScanStep::Unplug;
+			ok = (bool) (ls >> step.a) && step.a >= 0.0;
+		}
+		else if (keyword == "sweep")
+		{
+			step.type = ScanStep::SweepZ;
+			ok = (bool) (ls >> step.a >> step.b >> step.c) && step.c > 0.0;
+		}
+		else if (keyword == "set")
+		{
+			step.type = ScanStep::Set;
+			ok = (bool) (ls >> step.device >> step.property);
+			getline(ls >> ws, step.value);
+		}
+		else
+			ok = false;
+
+		if (!ok)
+		{
+			fprintf(stderr, "%s:%d: cannot parse '%s'\n", path.c_str(), line, text.c_str());
+			return false;
+		}
+		steps.push_back(step);
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Timing
+///////////////////////////////////////////////////////////////////////////////
+class PhaseTimes
+{
+public:
+	void Add(const string& phase, double ms)
+	{
+		if (times_.find(phase) == times_.end())
+			order_.push_back(phase);
+		times_[phase].push_back(ms);
+	}
+
+	void Print(double totalMs) const
+	{
+		printf("%-10s %7s %11s %9s %9s %9s %9s %7s\n", "phase", "count", "total ms", "mean", "p50", "p95", "max", "share");
+		for (size_t i = 0; i < order_.size(); i++)
+		{
+			vector<double> v = times_.find(order_[i])->second;
+			sort(v.begin(), v.end());
+			double sum = 0.0;
+			for (size_t j = 0; j < v.size(); j++)
+				sum += v[j];
+			printf("%-10s %7u %11.1f %9.2f %9.2f %9.2f %9.2f %6.1f%%\n", order_[i].c_str(), (unsigned) v.size(),
+				sum, sum / v.size(), Percentile(v, 0.5), Percentile(v, 0.95), v.back(),
+				totalMs > 0.0 ? 100.0 * sum / totalMs : 0.0);
+		}
+	}
+
+private:
+	static double Percentile(const vector<double>& sorted, double p)
+	{
+		return sorted[(size_t) (p * (sorted.size() - 1) + 0.5)];
+	}
+
+	vector<string> order_;
+	map<string, vector<double> > times_;
+};
+
+double MsSince(Clock::time_point start)
+{
+	return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+// Same as MMCore's waitForDevice: poll Busy(), then the device delay
+void WaitForDevice(MM::Device* device)
+{
+	while (device->Busy())
+		;
+	if (device->UsesDelay() && device->GetDelayMs() > 0.0)
+		this_thread::sleep_for(chrono::microseconds((long long) (device->GetDelayMs() * 1000.0)));
+}
+
+// Runs a sweep and reads its samples the way an autofocus routine would:
+// take a chunk with SweepData=Next while it runs, then what is left. Time
+// must increase from sample to sample and the position must not move
+// against the sweep direction.
+int SweepZ(MM::Device* z, double fromUm, double toUm, double speedUmPerSec,
+	unsigned long& samples, unsigned long& outOfOrder)
+{
+	ostringstream from, to, speed;
+	from << fromUm;
+	to << toUm;
+	speed << speedUmPerSec;
+	int ret = z->SetProperty("SweepStart-um", from.str().c_str());
+	if (ret == DEVICE_OK)
+		ret = z->SetProperty("SweepEnd-um", to.str().c_str());
+	if (ret == DEVICE_OK)
+		ret = z->SetProperty("SweepSpeed-um/s", speed.str().c_str());
+	if (ret == DEVICE_OK)
+		ret = z->SetProperty("Sweep", "Run");
+
+	double direction = toUm < fromUm ? -1.0 : 1.0;
+	double lastTimeUs = 0.0;
+	double lastUm = 0.0;
+	bool first = true;
+	bool running = true;
+	while (ret == DEVICE_OK)
+	{
+		// checked before the read, so the samples of its last moments are
+		// still collected
+		char state[MM::MaxStrLength] = "";
+		if (running)
+		{
+			ret = z->GetProperty("Sweep", state);
+			running = strcmp(state, "Run") == 0;
+		}
+
+		char data[MM::MaxStrLength] = "";
+		if (ret == DEVICE_OK)
+			ret = z->SetProperty("SweepData", "Next");
+		if (ret == DEVICE_OK)
+			ret = z->GetProperty("SweepData", data);
+		if (ret != DEVICE_OK || (!running && data[0] == 0))
+			break;
+		if (data[0] == 0)
+		{
+			this_thread::sleep_for(chrono::milliseconds(g_SweepPollMs));
+			continue;
+		}
+
+		istringstream list(data);
+		string entry;
+		while (getline(list, entry, ';'))
+		{
+			double timeUs, um;
+			istringstream is(entry);
+			if (!(is >> timeUs >> um))
+				continue;
+			if (!first && (timeUs <= lastTimeUs || (um - lastUm) * direction < -1e-6))
+				outOfOrder++;
+			first = false;
+			lastTimeUs = timeUs;
+			lastUm = um;
+			samples++;
+		}
+	}
+	return ret;
+}
+
+void Usage()
+{
+	fprintf(stderr, "usage: CytoTableRunner --module <adapter library> <script> [--port <tty>] [--baud 9600] [--repeat 1] [--verbose]\n");
+	fprintf(stderr, "       CytoTableRunner --module <adapter library> --soak <seconds> [--pollers 2] [--drop-rate 0]\n"
+		"                       [--max-delay-ms 0] [--report-sec 60] [--baud 9600] [--verbose]\n");
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	string modulePath;
+	string script;
+	string tty;
+	long baud = 9600;
+	int repeat = 1;
+	bool verbose = false;
+	bool soak = false;
+	SoakOptions soakOptions;
+	double dropRate = 0.0;
+	double maxDelayMs = 0.0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "--module" && i + 1 < argc)
+			modulePath = argv[++i];
+		else if (arg == "--port" && i + 1 < argc)
+			tty = argv[++i];
+		else if (arg == "--baud" && i + 1 < argc)
+			baud = atol(argv[++i]);
+		else if (arg == "--repeat" && i + 1 < argc)
+			repeat = atoi(argv[++i]);
+		else if (arg == "--verbose")
+			verbose = true;
+		else if (arg == "--soak" && i + 1 < argc)
+		{
+			soak = true;
+			soakOptions.durationSec = atof(argv[++i]);
+		}
+		else if (arg == "--pollers" && i + 1 < argc)
+			soakOptions.pollers = atoi(argv[++i]);
+		else if (arg == "--report-sec" && i + 1 < argc)
+			soakOptions.reportSec = atof(argv[++i]);
+		else if (arg == "--drop-rate" && i + 1 < argc)
+			dropRate = atof(argv[++i]);
+		else if (arg == "--max-delay-ms" && i + 1 < argc)
+			maxDelayMs = atof(argv[++i]);
+		else if (script.empty() && arg[0] != '-')
+			script = arg;
+		else
+		{
+			Usage();
+			return 2;
+		}
+	}
+	bool usage = modulePath.empty() || script.empty() != soak || repeat < 1;
+	// the soak checks every answer against the simulator
+	if (soak)
+		usage = usage || !tty.empty() || soakOptions.durationSec <= 0.0 || soakOptions.reportSec <= 0.0 ||
+			soakOptions.pollers < 0 || dropRate < 0.0 || dropRate >= 1.0 || maxDelayMs < 0.0;
+	if (usage)
+	{
+		Usage();
+		return 2;
+	}
+
+	vector<ScanStep> steps;
+	if (!soak && !ParseScript(script, steps))
+		return 2;
+
+	AdapterModule module;
+	if (!module.Load(modulePath))
+	{
+		fprintf(stderr, "cannot load adapter module %s\n", modulePath.c_str());
+		return 2;
+	}
+
+	CytoTableSim sim;
+	sim.SetBaudRate(baud);
+	SimLink simLink(sim);
+	TtyLink ttyLink;
+	MockCore core;
+	core.SetVerbose(verbose);
+	string port = g_SimPort;
+	if (tty.empty())
+		core.AddPort(port, &simLink);
+	else
+	{
+		if (!ttyLink.Open(tty, baud))
+		{
+			fprintf(stderr, "cannot open serial port %s\n", tty.c_str());
+			return 2;
+		}
+		port = tty;
+		core.AddPort(port, &ttyLink);
+	}
+
+	// Same order as MMCore: hub first, then its peripherals
+	MM::Device* hub = module.CreateDevice("CytoTableHub");
+	MM::Device* xy = module.CreateDevice("CytoTableXYStage");
+	MM::Device* z = module.CreateDevice("ZStage");
+	if (!hub || !xy || !z)
+	{
+		fprintf(stderr, "module does not provide the CytoTable devices\n");
+		return 2;
+	}
+	core.AddDevice(g_HubLabel, hub);
+	core.AddDevice(g_XYLabel, xy);
+	core.AddDevice(g_ZLabel, z);
+
+	map<string, MM::Device*> devices;
+	devices["Hub"] = hub;
+	devices["XY"] = xy;
+	devices["Z"] = z;
+
+	int ret = hub->SetProperty(MM::g_Keyword_Port, port.c_str());
+	Clock::time_point start = Clock::now();
+	if (ret == DEVICE_OK)
+		ret = hub->Initialize();
+	if (ret == DEVICE_OK)
+		ret = xy->Initialize();
+	if (ret == DEVICE_OK)
+		ret = z->Initialize();
+	double initMs = MsSince(start);
+
+	MM::XYStage* xyStage = static_cast<MM::XYStage*>(xy);
+	MM::Stage* zStage = static_cast<MM::Stage*>(z);
+	double zStart = 0.0;
+	if (ret == DEVICE_OK)
+		ret = zStage->GetPositionUm(zStart);
+
+	int soakResult = SoakPassed;
+	if (soak && ret == DEVICE_OK)
+	{
+		printf("soak on simulator: %.0f s, %d pollers, drop rate %g, answer delay up to %g ms\n\n",
+			soakOptions.durationSec, soakOptions.pollers, dropRate, maxDelayMs);
+		// faults start after a clean initialization
+		sim.SetFaults(dropRate, (long) (maxDelayMs * 1000.0));
+		soakResult = RunSoak(hub, xy, z, sim, soakOptions);
+	}
+
+	PhaseTimes phases;
+	vector<double> passMs;
+	unsigned long sweepSamples = 0;
+	unsigned long sweepOutOfOrder = 0;
+	int failedLine = 0;
+	for (int pass = 0; pass < repeat && ret == DEVICE_OK && !soak; pass++)
+	{
+		Clock::time_point passStart = Clock::now();
+		for (size_t i = 0; i < steps.size() && ret == DEVICE_OK; i++)
+		{
+			const ScanStep& step = steps[i];
+			Clock::time_point t = Clock::now();
+			switch (step.type)
+			{
+				case ScanStep::MoveXY:
+					ret = xyStage->SetPositionUm(step.a, step.b);
+					phases.Add("xy-send", MsSince(t));
+					t = Clock::now();
+					WaitForDevice(xy);
+					phases.Add("xy-wait", MsSince(t));
+					break;
+				case ScanStep::MoveZ:
+					ret = zStage->SetPositionUm(zStart + step.a);
+					phases.Add("z-send", MsSince(t));
+					t = Clock::now();
+					WaitForDevice(z);
+					phases.Add("z-wait", MsSince(t));
+					break;
+				case ScanStep::Dwell:
+					this_thread::sleep_for(chrono::microseconds((long long) (step.a * 1000.0)));
+					phases.Add("dwell", MsSince(t));
+					break;
+				case ScanStep::QueueXY:
+				{
+					ostringstream value;
+					value << step.a << " " << step.b << " " << step.c;
+					ret = xy->SetProperty("MoveQueue", value.str().c_str());
+					phases.Add("queue", MsSince(t));
+					break;
+				}
+				case ScanStep::WaitXY:
+					WaitForDevice(xy);
+					phases.Add("xy-wait", MsSince(t));
+					break;
+				case ScanStep::Unplug:
+				{
+					if (!tty.empty())
+					{
+						fprintf(stderr, "unplug needs the simulator\n");
+						ret = DEVICE_NOT_SUPPORTED;
+						break;
+					}
+					simLink.Unplug();
+					this_thread::sleep_for(chrono::microseconds((long long) (step.a * 1000.0)));
+					simLink.Replug();
+					phases.Add("unplug", MsSince(t));
+					// recovered once a position read goes through again
+					t = Clock::now();
+					double x, y;
+					do
+						ret = xyStage->GetPositionUm(x, y);
+					while (ret != DEVICE_OK && MsSince(t) < g_RecoverTimeoutMs);
+					phases.Add("recover", MsSince(t));
+					break;
+				}
+				case ScanStep::SweepZ:
+					ret = SweepZ(z, zStart + step.a, zStart + step.b, step.c, sweepSamples, sweepOutOfOrder);
+					phases.Add("sweep", MsSince(t));
+					break;
+				case ScanStep::Set:
+					if (devices.find(step.device) == devices.end())
+						ret = DEVICE_ERR;
+					else
+						ret = devices[step.device]->SetProperty(step.property.c_str(), step.value.c_str());
+					phases.Add("set", MsSince(t));
+					break;
+			}
+			if (ret != DEVICE_OK)
+				failedLine = step.line;
+		}
+		passMs.push_back(MsSince(passStart));
+	}
+
+	char reconnects[MM::MaxStrLength] = "";
+	char recoveryMs[MM::MaxStrLength] = "";
+	bool linkInfo = hub->GetProperty("LinkReconnects", reconnects) == DEVICE_OK &&
+		hub->GetProperty("LinkRecovery-ms", recoveryMs) == DEVICE_OK;
+
+	if (ret != DEVICE_OK)
+	{
+		char text[MM::MaxStrLength] = "";
+		MM::Device* reporter = hub;
+		if (xy->GetErrorText(ret, text))
+			reporter = xy;
+		else if (z->GetErrorText(ret, text))
+			reporter = z;
+		else
+			reporter->GetErrorText(ret, text);
+		if (failedLine > 0)
+			fprintf(stderr, "%s:%d: error %d: %s\n", script.c_str(), failedLine, ret, text);
+		else
+			fprintf(stderr, "initialization failed with error %d: %s\n", ret, text);
+	}
+
+	z->Shutdown();
+	xy->Shutdown();
+	hub->Shutdown();
+	module.DeleteDevice(z);
+	module.DeleteDevice(xy);
+	module.DeleteDevice(hub);
+	if (soak)
+		return ret == DEVICE_OK ? soakResult : 1;
+
+	double scanMs = 0.0;
+	for (size_t i = 0; i < passMs.size(); i++)
+		scanMs += passMs[i];
+	printf("%s on %s, %u steps x %u passes\n", script.c_str(), tty.empty() ? "simulator" : tty.c_str(),
+		(unsigned) steps.size(), (unsigned) passMs.size());
+	printf("initialize %.1f ms, scan %.1f ms", initMs, scanMs);
+	if (!passMs.empty())
+		printf(" (%.1f ms per pass, %.2f ms per step)", scanMs / passMs.size(),
+			steps.empty() ? 0.0 : scanMs / passMs.size() / steps.size());
+	printf("\n");
+	printf("notifications: %lu position, %lu property\n", core.GetPositionNotifications(),
+		core.GetPropertyNotifications());
+	if (linkInfo)
+		printf("link: %s reconnects, last recovery %s ms\n", reconnects, recoveryMs);
+	if (sweepSamples > 0)
+		printf("sweep: %lu samples read, %lu out of order\n", sweepSamples, sweepOutOfOrder);
+	printf("\n");
+	phases.Print(scanMs);
+
+	return ret == DEVICE_OK && sweepOutOfOrder == 0 ? 0 : 1;
+}
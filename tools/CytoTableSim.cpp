@@ -0,0 +1,561 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          CytoTableSim.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   In-process model of the CytoWorks table controller for the
+//                offline tools.
+//
+// LICENSE:       This library is free software; you can redistribute it and/or
+//                modify it under the terms of the GNU Lesser General Public
+//                License as published by the Free Software Foundation.
+//                
+//                You should have received a copy of the GNU Lesser General Public
+//                License along with the source distribution; if not, write to
+//                the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+//                Boston, MA  02111-1307  USA
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES. 
+//
+#include "CytoTableSim.h"
+
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+
+using namespace std;
+
+// controller error codes (low nibble of the status byte)
+enum { SimOk = 0, SimInvalidCommand = 2, SimInvalidOperand = 3, SimNotAllowed = 11 };
+
+const long g_SimFullResolution = 256;
+const size_t g_SimProgramSlots = 16;
+
+static double Seconds(CytoTableSim::Clock::duration d)
+{
+	return chrono::duration_cast<chrono::duration<double> >(d).count();
+}
+
+CytoTableSim::Axis::Axis() :
+	position(0.0),
+	segmentStart(Clock::now()),
+	resolution(g_SimFullResolution),
+	speed(20320),
+	accel(333),
+	programs(g_SimProgramSlots),
+	outputs(0),
+	inputs(0)
+{
+}
+
+CytoTableSim::CytoTableSim(int numAxes) :
+	axes_(numAxes),
+	baud_(9600),
+	turnaroundUs_(500),
+	dropRate_(0.0),
+	maxDelayUs_(0),
+	droppedBytes_(0),
+	random_(1)
+{
+}
+
+void CytoTableSim::SetBaudRate(long baud)
+{
+	lock_guard<mutex> guard(mutex_);
+	baud_ = baud;
+}
+
+void CytoTableSim::SetTurnaroundUs(long us)
+{
+	lock_guard<mutex> guard(mutex_);
+	turnaroundUs_ = us;
+}
+
+void CytoTableSim::SetFaults(double dropRate, long maxDelayUs)
+{
+	lock_guard<mutex> guard(mutex_);
+	dropRate_ = dropRate;
+	maxDelayUs_ = maxDelayUs;
+}
+
+unsigned long CytoTableSim::GetDroppedBytes()
+{
+	lock_guard<mutex> guard(mutex_);
+	return droppedBytes_;
+}
+
+bool CytoTableSim::DropByte()
+{
+	if (dropRate_ <= 0.0 || uniform_real_distribution<double>(0.0, 1.0)(random_) >= dropRate_)
+		return false;
+	droppedBytes_++;
+	return true;
+}
+
+double CytoTableSim::ByteSec() const
+{
+	return baud_ > 0 ? 10.0 / baud_ : 0.0;
+}
+
+void CytoTableSim::Write(const unsigned char* buf, unsigned long length)
+{
+	lock_guard<mutex> guard(mutex_);
+	Clock::time_point now = Clock::now();
+	for (unsigned long i = 0; i < length; i++)
+	{
+		if (DropByte())
+			continue;
+		if (buf[i] != '\r')
+		{
+			rxFrame_ += (char) buf[i];
+			continue;
+		}
+
+		// the '\r' reaches the controller once all bytes so far are on the line
+		Clock::time_point arrival = now + chrono::duration_cast<Clock::duration>(
+			chrono::duration<double>((i + 1) * ByteSec()));
+		string answer = Execute(rxFrame_, arrival);
+		rxFrame_.clear();
+		if (answer.empty())
+			continue;
+
+		Clock::time_point t = arrival + chrono::microseconds(turnaroundUs_);
+		if (maxDelayUs_ > 0)
+			t += chrono::microseconds(uniform_int_distribution<long>(0, maxDelayUs_)(random_));
+		if (!tx_.empty() && tx_.back().first > t)
+			t = tx_.back().first;
+		for (size_t j = 0; j < answer.length(); j++)
+		{
+			t += chrono::duration_cast<Clock::duration>(chrono::duration<double>(ByteSec()));
+			if (!DropByte())
+				tx_.push_back(make_pair(t, (unsigned char) answer[j]));
+		}
+	}
+}
+
+unsigned long CytoTableSim::Read(unsigned char* buf, unsigned long length)
+{
+	lock_guard<mutex> guard(mutex_);
+	Clock::time_point now = Clock::now();
+	unsigned long read = 0;
+	while (read < length && !tx_.empty() && tx_.front().first <= now)
+	{
+		buf[read++] = tx_.front().second;
+		tx_.pop_front();
+	}
+	return read;
+}
+
+void CytoTableSim::Purge()
+{
+	lock_guard<mutex> guard(mutex_);
+	Clock::time_point now = Clock::now();
+	while (!tx_.empty() && tx_.front().first <= now)
+		tx_.pop_front();
+}
+
+double CytoTableSim::GetPosition(int axis)
+{
+	lock_guard<mutex> guard(mutex_);
+	if (axis < 1 || axis > (int) axes_.size())
+		return 0.0;
+	Axis& a = axes_[axis - 1];
+	Advance(a, Clock::now());
+	return a.position;
+}
+
+bool CytoTableSim::IsMoving(int axis)
+{
+	lock_guard<mutex> guard(mutex_);
+	if (axis < 1 || axis > (int) axes_.size())
+		return false;
+	Axis& a = axes_[axis - 1];
+	Advance(a, Clock::now());
+	return !a.queue.empty();
+}
+
+int CytoTableSim::GetOutputs(int axis)
+{
+	lock_guard<mutex> guard(mutex_);
+	if (axis < 1 || axis > (int) axes_.size())
+		return 0;
+	Axis& a = axes_[axis - 1];
+	Advance(a, Clock::now());
+	return a.outputs;
+}
+
+// The program runs up to now with the old level first
+void CytoTableSim::SetInput(int axis, int input, bool high)
+{
+	lock_guard<mutex> guard(mutex_);
+	if (axis < 1 || axis > (int) axes_.size() || input < 1 || input > 4)
+		return;
+	Axis& a = axes_[axis - 1];
+	Advance(a, Clock::now());
+	if (high)
+		a.inputs |= 1 << (input - 1);
+	else
+		a.inputs &= ~(1 << (input - 1));
+	Advance(a, Clock::now());
+}
+
+// Brings position up to now. Finished segments are dropped; a running one
+// is rebased so that position is exact at segmentStart == now. An endless
+// loop is parsed again each time its body has run.
+void CytoTableSim::Advance(Axis& axis, Clock::time_point now)
+{
+	int passes = 0;
+	for (;;)
+	{
+		if (axis.queue.empty())
+		{
+			// a body that never waits would spin forever
+			if (axis.loop.empty() || ++passes > 1000)
+				break;
+			string data;
+			ExecuteAxis(axis, axis.loop, axis.segmentStart, data);
+			if (axis.queue.empty())
+				break;
+		}
+
+		Segment& s = axis.queue.front();
+		double elapsed = Seconds(now - axis.segmentStart);
+		if (elapsed < 0.0)
+			return;
+
+		if (s.outputs >= 0)
+		{
+			axis.outputs = s.outputs;
+			axis.queue.pop_front();
+			continue;
+		}
+
+		if (s.waitInput > 0)
+		{
+			bool high = ((axis.inputs >> (s.waitInput - 1)) & 1) != 0;
+			if (high != s.waitHigh)
+			{
+				axis.segmentStart = now;
+				return;
+			}
+			axis.queue.pop_front();
+			continue;
+		}
+
+		if (s.dwellSec > 0.0)
+		{
+			if (elapsed < s.dwellSec)
+				return;
+			axis.segmentStart += chrono::duration_cast<Clock::duration>(chrono::duration<double>(s.dwellSec));
+			axis.queue.pop_front();
+			continue;
+		}
+
+		if (s.direction != 0)
+		{
+			axis.position += s.direction * s.speed * elapsed;
+			axis.segmentStart = now;
+			return;
+		}
+
+		double distance = fabs(s.target - axis.position);
+		double duration = distance / s.speed;
+		if (elapsed < duration)
+		{
+			axis.position += (s.target > axis.position ? 1 : -1) * s.speed * elapsed;
+			axis.segmentStart = now;
+			return;
+		}
+		axis.position = s.target;
+		axis.segmentStart += chrono::duration_cast<Clock::duration>(chrono::duration<double>(duration));
+		axis.queue.pop_front();
+	}
+	axis.segmentStart = now;
+}
+
+double CytoTableSim::QueueEnd(const Axis& axis)
+{
+	for (deque<Segment>::const_reverse_iterator it = axis.queue.rbegin(); it != axis.queue.rend(); ++it)
+	{
+		if (it->dwellSec <= 0.0 && it->direction == 0 && it->outputs < 0 && it->waitInput == 0)
+			return it->target;
+	}
+	return axis.position;
+}
+
+double CytoTableSim::FullSteps(const Axis& axis, long value)
+{
+	return (double) value * g_SimFullResolution / axis.resolution;
+}
+
+long CytoTableSim::ToAxisUnits(const Axis& axis, double fullSteps)
+{
+	return (long) floor(fullSteps * axis.resolution / g_SimFullResolution + 0.5);
+}
+
+// Frames are "/<address><commands>". A trailing R executes, "R" alone runs
+// what was loaded before, anything else is loaded for later. Queries run
+// right away. Broadcast addresses (A = axes 1-2, _ = all) get no answer,
+// as on the real controller.
+string CytoTableSim::Execute(const string& frame, Clock::time_point now)
+{
+	if (frame.length() < 2 || frame[0] != '/')
+		return "";
+
+	char address = frame[1];
+	vector<Axis*> targets;
+	bool broadcast = false;
+	if (address >= '1' && address <= '9')
+	{
+		size_t index = address - '1';
+		if (index >= axes_.size())
+			return "";
+		targets.push_back(&axes_[index]);
+	}
+	else if (address == 'A' || address == '_')
+	{
+		broadcast = true;
+		size_t count = address == 'A' ? 2 : axes_.size();
+		for (size_t i = 0; i < count && i < axes_.size(); i++)
+			targets.push_back(&axes_[i]);
+	}
+	else
+	{
+		return "";
+	}
+
+	string commands = frame.substr(2);
+	int error = SimOk;
+	string data;
+	for (size_t i = 0; i < targets.size(); i++)
+	{
+		Axis& axis = *targets[i];
+		Advance(axis, now);
+
+		string run;
+		if (commands == "R")
+		{
+			run = axis.pending;
+			axis.pending.clear();
+		}
+		else if (!commands.empty() && commands[commands.length() - 1] == 'R')
+		{
+			run = commands.substr(0, commands.length() - 1);
+		}
+		else if (!commands.empty() && (commands[0] == '?' || commands[0] == 'Q' || commands[0] == '&'))
+		{
+			run = commands;
+		}
+		else
+		{
+			axis.pending = commands;
+			continue;
+		}
+
+		int e = ExecuteAxis(axis, run, now, data);
+		if (e != SimOk)
+			error = e;
+	}
+
+	if (broadcast)
+		return "";
+
+	Axis& axis = *targets[0];
+	unsigned char status = (unsigned char) ((axis.queue.empty() ? 0x60 : 0x40) | error);
+	string answer = "/0";
+	answer += (char) status;
+	answer += data;
+	answer += "\x03\r\n";
+	return answer;
+}
+
+int CytoTableSim::ExecuteAxis(Axis& axis, const string& commands, Clock::time_point now, string& data)
+{
+	size_t i = 0;
+	size_t loopStart = string::npos;
+	while (i < commands.length())
+	{
+		char c = commands[i++];
+
+		if (c == '?')
+		{
+			if (i >= commands.length())
+				return SimInvalidCommand;
+			char what = commands[i++];
+			ostringstream os;
+			if (what == '0' || what == '8')
+				os << ToAxisUnits(axis, axis.position);
+			else if (what == '2')
+				os << axis.speed;
+			else if (what == 's')
+			{
+				// ?s<n> reads a stored program back
+				size_t start = i;
+				while (i < commands.length() && isdigit((unsigned char) commands[i]))
+					i++;
+				size_t slot = (size_t) atol(commands.substr(start, i - start).c_str());
+				if (start == i || slot >= axis.programs.size())
+					return SimInvalidOperand;
+				os << axis.programs[slot];
+			}
+			else
+				return SimInvalidOperand;
+			data = os.str();
+			continue;
+		}
+		if (c == 'Q')
+			continue;
+		if (c == '&')
+		{
+			data = "CytoTableSim 1.0";
+			continue;
+		}
+		if (c == 'T')
+		{
+			axis.queue.clear();
+			axis.loop.clear();
+			axis.segmentStart = now;
+			continue;
+		}
+		if (c == 's')
+		{
+			// s<n> stores the rest of the string instead of running it
+			size_t start = i;
+			while (i < commands.length() && isdigit((unsigned char) commands[i]))
+				i++;
+			size_t slot = (size_t) atol(commands.substr(start, i - start).c_str());
+			if (start == i || slot >= axis.programs.size())
+				return SimInvalidOperand;
+			axis.programs[slot] = commands.substr(i);
+			return SimOk;
+		}
+		if (c == 'g')
+		{
+			// no nested loops
+			if (loopStart != string::npos)
+				return SimNotAllowed;
+			loopStart = i;
+			continue;
+		}
+
+		// everything else takes a numeric operand
+		size_t start = i;
+		while (i < commands.length() && (isdigit((unsigned char) commands[i]) || commands[i] == '-'))
+			i++;
+		if (start == i)
+			return SimInvalidOperand;
+		long value = atol(commands.substr(start, i - start).c_str());
+
+		if (axis.queue.empty())
+			axis.segmentStart = now;
+
+		Segment s;
+		s.target = 0.0;
+		s.speed = FullSteps(axis, axis.speed);
+		s.direction = 0;
+		s.dwellSec = 0.0;
+		s.outputs = -1;
+		s.waitInput = 0;
+		s.waitHigh = false;
+		switch (c)
+		{
+		case 'A':
+			s.target = FullSteps(axis, value);
+			axis.queue.push_back(s);
+			break;
+		case 'P':
+		case 'D':
+			if (value == 0)
+				s.direction = c == 'P' ? 1 : -1;
+			else
+				s.target = QueueEnd(axis) + (c == 'P' ? 1 : -1) * FullSteps(axis, value);
+			axis.queue.push_back(s);
+			break;
+		case 'M':
+			s.dwellSec = value / 1000.0;
+			axis.queue.push_back(s);
+			break;
+		case 'V':
+			if (value <= 0)
+				return SimInvalidOperand;
+			axis.speed = value;
+			// on the fly speed change of a running velocity move
+			if (axis.queue.size() == 1 && axis.queue.front().direction != 0)
+				axis.queue.front().speed = FullSteps(axis, value);
+			break;
+		case 'L':
+			axis.accel = value;
+			break;
+		case 'j':
+			if (value < 1 || value > g_SimFullResolution)
+				return SimInvalidOperand;
+			axis.resolution = value;
+			break;
+		case 'z':
+			if (!axis.queue.empty())
+				return SimNotAllowed;
+			axis.position = FullSteps(axis, value);
+			break;
+		case 'e':
+		{
+			if (value < 0 || value >= (long) axis.programs.size())
+				return SimInvalidOperand;
+			// a copy, the program may store over itself
+			string program = axis.programs[value];
+			int e = ExecuteAxis(axis, program, now, data);
+			if (e != SimOk)
+				return e;
+			break;
+		}
+		case 'J':
+			if (value < 0 || value > 3)
+				return SimInvalidOperand;
+			s.outputs = (int) value;
+			axis.queue.push_back(s);
+			break;
+		case 'H':
+			// H<level><input>, e.g. H11 waits for input 1 to go high
+			if (value % 10 < 1 || value % 10 > 4 || value / 10 > 1)
+				return SimInvalidOperand;
+			s.waitInput = (int) (value % 10);
+			s.waitHigh = value / 10 == 1;
+			axis.queue.push_back(s);
+			break;
+		case 'G':
+		{
+			// G<n> repeats the body n times in all, G0 forever
+			if (loopStart == string::npos || value < 0)
+				return SimNotAllowed;
+			string body = commands.substr(loopStart, start - 1 - loopStart);
+			loopStart = string::npos;
+			if (value == 0)
+			{
+				axis.loop = body;
+				return SimOk;
+			}
+			for (long n = 1; n < value; n++)
+			{
+				int e = ExecuteAxis(axis, body, now, data);
+				if (e != SimOk)
+					return e;
+			}
+			break;
+		}
+		case 'm':
+		case 'h':
+		case 'n':
+		case 'F':
+			break;
+		default:
+			return SimInvalidCommand;
+		}
+	}
+	return SimOk;
+}
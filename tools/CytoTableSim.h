@@ -0,0 +1,120 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          CytoTableSim.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   In-process model of the CytoWorks table controller for the
+//                offline tools: the commands the adapter sends, axis motion
+//                in real time and the timing of a 9600 baud line.
+//
+// LICENSE:       This library is free software; you can redistribute it and/or
+//                modify it under the terms of the GNU Lesser General Public
+//                License as published by the Free Software Foundation.
+//                
+//                You should have received a copy of the GNU Lesser General Public
+//                License along with the source distribution; if not, write to
+//                the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+//                Boston, MA  02111-1307  USA
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES. 
+//
+#ifndef _CYTOTABLESIM_H_
+#define _CYTOTABLESIM_H_
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+class CytoTableSim
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	CytoTableSim(int numAxes = 3);
+
+	// Line model: every byte takes 10 bits at the baud rate in each
+	// direction, plus a fixed controller turnaround. Baud 0 means instant.
+	void SetBaudRate(long baud);
+	void SetTurnaroundUs(long us);
+
+	// Fault injection for soak runs: each byte in either direction is lost
+	// with probability dropRate, each answer is held back by a random extra
+	// delay of up to maxDelayUs
+	void SetFaults(double dropRate, long maxDelayUs);
+	unsigned long GetDroppedBytes();
+
+	// host -> controller; a frame is processed when its '\r' arrives
+	void Write(const unsigned char* buf, unsigned long length);
+	// controller -> host; only bytes that have crossed the line by now
+	unsigned long Read(unsigned char* buf, unsigned long length);
+	void Purge();
+
+	// full resolution steps, for checks in the tools
+	double GetPosition(int axis);
+	bool IsMoving(int axis);
+
+	// Digital I/O: the two outputs set by J (bit 0 = output 1) and the
+	// four inputs H waits on, e.g. a camera's exposure signal
+	int GetOutputs(int axis);
+	void SetInput(int axis, int input, bool high);
+
+private:
+	struct Segment
+	{
+		double target;      // full resolution steps; ignored for velocity moves
+		double speed;       // full resolution steps/sec
+		int direction;      // velocity moves: +1/-1; 0 for moves to target
+		double dwellSec;    // M command
+		int outputs;        // J command, -1 for other segments
+		int waitInput;      // H command: input 1-4, 0 for other segments
+		bool waitHigh;
+	};
+
+	struct Axis
+	{
+		Axis();
+
+		double position;            // at segmentStart
+		Clock::time_point segmentStart;
+		std::deque<Segment> queue;  // front is running
+		long resolution;
+		long speed;                 // V, in microsteps/sec at resolution
+		long accel;
+		std::string pending;        // commands loaded without R
+		std::string loop;           // body of a running endless g...G0 loop
+		std::vector<std::string> programs;  // s<n> program storage
+		int outputs;
+		int inputs;                 // bit 0 = input 1
+	};
+
+	std::string Execute(const std::string& frame, Clock::time_point now);
+	int ExecuteAxis(Axis& axis, const std::string& commands, Clock::time_point now, std::string& data);
+	void Advance(Axis& axis, Clock::time_point now);
+	double QueueEnd(const Axis& axis);
+	double FullSteps(const Axis& axis, long value);
+	long ToAxisUnits(const Axis& axis, double fullSteps);
+	double ByteSec() const;
+	bool DropByte();
+
+	std::mutex mutex_;
+	std::vector<Axis> axes_;
+	std::string rxFrame_;
+	std::deque<std::pair<Clock::time_point, unsigned char> > tx_;
+	long baud_;
+	long turnaroundUs_;
+	double dropRate_;
+	long maxDelayUs_;
+	unsigned long droppedBytes_;
+	std::mt19937 random_;
+};
+
+#endif //_CYTOTABLESIM_H_
@@ -0,0 +1,580 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          CytoTableSoak.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Long running concurrency soak for the offline tools.
+//
+// LICENSE:       This library is free software; you can redistribute it and/or
+//                modify it under the terms of the GNU Lesser General Public
+//                License as published by the Free Software Foundation.
+//
+//                You should have received a copy of the GNU Lesser General Public
+//                License along with the source distribution; if not, write to
+//                the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+//                Boston, MA  02111-1307  USA
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+#include "CytoTableSoak.h"
+
+#ifdef WIN32
+   #include <windows.h>
+   #include <psapi.h>
+#else
+   #include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+const long g_XYRangeSteps = 5000;
+const long g_ZRangeSteps = 200;
+// every this many Z steps is a sweep, which runs on the adapter's own thread
+const unsigned long g_SweepEvery = 5;
+const char* g_SweepFromUm = "-20";
+const char* g_SweepToUm = "20";
+const char* g_SweepSpeedUm = "200";
+const double g_SettleTimeoutSec = 10.0;
+const double g_PositionUpdatesToggleSec = 5.0;
+// longer than one period of the hub's position monitor at its default rate,
+// after which a cached position of a stopped axis must be exact
+const double g_SettledCheckMs = 250.0;
+const double g_WatchdogMs = 100.0;
+
+enum SoakOp {OpBusy, OpPosition, OpMove, OpProperty, NumOps};
+const char* g_OpNames[NumOps] = {"busy", "position", "move", "property"};
+
+double Percentile(vector<double>& v, double p)
+{
+	if (v.empty())
+		return 0.0;
+	sort(v.begin(), v.end());
+	return v[(size_t) (p * (v.size() - 1) + 0.5)];
+}
+
+long ResidentKb()
+{
+#ifdef WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return (long) (counters.WorkingSetSize / 1024);
+#else
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return 0;
+	long size = 0, resident = 0;
+	int n = fscanf(f, "%ld %ld", &size, &resident);
+	fclose(f);
+	if (n != 2)
+		return 0;
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+#endif
+}
+
+// Everything measured during one report window
+struct SoakWindow
+{
+	SoakWindow() : errors(0), corruptReads(0), offTargetMoves(0), earlyIdle(0) {}
+
+	vector<double> ms[NumOps];
+	unsigned long errors;
+	unsigned long corruptReads;
+	unsigned long offTargetMoves;
+	unsigned long earlyIdle;     // Busy() false while the axis still moved
+};
+
+// What one caller thread is doing, for the watchdog
+struct Caller
+{
+	Caller(const string& n) : name(n), op(NumOps), sinceUs(0) {}
+
+	string name;
+	atomic<int> op;              // NumOps while outside the adapter
+	atomic<long long> sinceUs;   // since the start of the soak
+};
+
+// A stage the acquisition thread moves. The pollers only check positions of
+// a stage that has been settled for a while; moves bumps on every command.
+struct SoakStage
+{
+	SoakStage() : moves(0), settled(false), settledUs(0) {}
+
+	atomic<unsigned long> moves;
+	atomic<bool> settled;
+	atomic<long long> settledUs;
+};
+
+class Soak
+{
+public:
+	Soak(MM::Device* hub, MM::Device* xy, MM::Device* z, CytoTableSim& sim, const SoakOptions& options) :
+		hub_(hub), xy_(xy), z_(z),
+		xyStage_(static_cast<MM::XYStage*>(xy)), zStage_(static_cast<MM::Stage*>(z)),
+		sim_(sim), options_(options), stop_(false), start_(Clock::now())
+	{
+	}
+
+	int Run();
+
+private:
+	void Poller(Caller& caller, unsigned seed);
+	void Acquisition(Caller& caller);
+	void Script(Caller& caller);
+
+	template <class Call> int Timed(Caller& caller, SoakOp op, Call call);
+	void PollPosition(Caller& caller, bool isXY);
+	bool Settle(Caller& caller, bool isXY, const long* target);
+	int TouchProperty(Caller& caller, MM::Device* device, const char* name, bool write);
+
+	void Report(int window, double elapsedSec, double windowSec, SoakWindow& w, long residentKb, unsigned long dropped);
+	bool CheckStalls();
+	long long UsSinceStart() const;
+	void Count(unsigned long SoakWindow::*counter);
+
+	MM::Device* hub_;
+	MM::Device* xy_;
+	MM::Device* z_;
+	MM::XYStage* xyStage_;
+	MM::Stage* zStage_;
+	CytoTableSim& sim_;
+	SoakOptions options_;
+
+	atomic<bool> stop_;
+	Clock::time_point start_;
+	vector<unique_ptr<Caller> > callers_;
+	SoakStage xyState_;
+	SoakStage zState_;
+
+	mutex statsMutex_;
+	SoakWindow window_;
+	map<int, unsigned long> errors_;
+};
+
+long long Soak::UsSinceStart() const
+{
+	return chrono::duration_cast<chrono::microseconds>(Clock::now() - start_).count();
+}
+
+template <class Call>
+int Soak::Timed(Caller& caller, SoakOp op, Call call)
+{
+	caller.sinceUs = UsSinceStart();
+	caller.op = op;
+	Clock::time_point t = Clock::now();
+	int ret = call();
+	double ms = chrono::duration<double, milli>(Clock::now() - t).count();
+	caller.op = NumOps;
+
+	lock_guard<mutex> guard(statsMutex_);
+	window_.ms[op].push_back(ms);
+	if (ret != DEVICE_OK)
+	{
+		window_.errors++;
+		errors_[ret]++;
+	}
+	return ret;
+}
+
+void Soak::Count(unsigned long SoakWindow::*counter)
+{
+	lock_guard<mutex> guard(statsMutex_);
+	window_.*counter += 1;
+}
+
+// Like the GUI's status bar and position list: Busy and the positions of both
+// stages, a few times per second from each thread
+void Soak::Poller(Caller& caller, unsigned seed)
+{
+	mt19937 random(seed);
+	uniform_int_distribution<int> pick(0, 3);
+	uniform_int_distribution<int> pause(10, 30);
+	while (!stop_)
+	{
+		bool busy;
+		switch (pick(random))
+		{
+			case 0:
+				Timed(caller, OpBusy, [&]() {busy = xy_->Busy(); return DEVICE_OK;});
+				break;
+			case 1:
+				Timed(caller, OpBusy, [&]() {busy = z_->Busy(); return DEVICE_OK;});
+				break;
+			case 2:
+				PollPosition(caller, true);
+				break;
+			default:
+				PollPosition(caller, false);
+				break;
+		}
+		this_thread::sleep_for(chrono::milliseconds(pause(random)));
+	}
+}
+
+// A position answered with an OK status must match the simulator whenever
+// the stage has stood still for the whole call
+void Soak::PollPosition(Caller& caller, bool isXY)
+{
+	SoakStage& stage = isXY ? xyState_ : zState_;
+	int first = isXY ? 1 : 3;
+	int count = isXY ? 2 : 1;
+
+	unsigned long moves = stage.moves;
+	bool check = stage.settled && (UsSinceStart() - stage.settledUs) / 1000.0 > g_SettledCheckMs;
+	long steps[2] = {0, 0};
+	int ret = Timed(caller, OpPosition, [&]() {
+		return isXY ? xyStage_->GetPositionSteps(steps[0], steps[1]) : zStage_->GetPositionSteps(steps[0]);
+	});
+	if (ret != DEVICE_OK || !check || !stage.settled || stage.moves != moves)
+		return;
+
+	for (int i = 0; i < count; i++)
+	{
+		long truth = lround(sim_.GetPosition(first + i));
+		if (labs(steps[i] - truth) > 1)
+		{
+			fprintf(stderr, "soak: %s read axis %d at %ld, controller is at %ld\n", caller.name.c_str(),
+				first + i, steps[i], truth);
+			Count(&SoakWindow::corruptReads);
+			return;
+		}
+	}
+}
+
+// Like an acquisition: move, wait like MMCore's waitForDevice, check where the
+// stage ended up, and again. Now and then Z sweeps instead, like autofocus,
+// while the script thread keeps writing Z's Speed.
+void Soak::Acquisition(Caller& caller)
+{
+	mt19937 random(1000);
+	uniform_int_distribution<long> xyTarget(-g_XYRangeSteps, g_XYRangeSteps);
+	uniform_int_distribution<long> zTarget(-g_ZRangeSteps, g_ZRangeSteps);
+	z_->SetProperty("SweepStart-um", g_SweepFromUm);
+	z_->SetProperty("SweepEnd-um", g_SweepToUm);
+	z_->SetProperty("SweepSpeed-um/s", g_SweepSpeedUm);
+	for (unsigned long n = 0; !stop_; n++)
+	{
+		bool isXY = n % 3 != 2;
+		bool sweep = n % (3 * g_SweepEvery) == 3 * g_SweepEvery - 1;
+		SoakStage& stage = isXY ? xyState_ : zState_;
+		long target[2];
+		target[0] = isXY ? xyTarget(random) : zTarget(random);
+		target[1] = isXY ? xyTarget(random) : 0;
+
+		stage.settled = false;
+		stage.moves++;
+		int ret = Timed(caller, OpMove, [&]() {
+			if (sweep)
+				return z_->SetProperty("Sweep", "Run");
+			return isXY ? xyStage_->SetPositionSteps(target[0], target[1]) : zStage_->SetPositionSteps(target[0]);
+		});
+		// a failed move may still have reached the controller; a sweep ends
+		// wherever the last sample left it
+		if (!Settle(caller, isXY, ret == DEVICE_OK && !sweep ? target : 0))
+			continue;
+		stage.settledUs = UsSinceStart();
+		stage.settled = true;
+	}
+}
+
+// Waits until the stage reports idle and the simulator agrees, then checks the
+// target and the position the adapter reads. False when stopped or timed out.
+bool Soak::Settle(Caller& caller, bool isXY, const long* target)
+{
+	MM::Device* device = isXY ? xy_ : z_;
+	int first = isXY ? 1 : 3;
+	int count = isXY ? 2 : 1;
+
+	bool busy = true;
+	while (busy && !stop_)
+		Timed(caller, OpBusy, [&]() {busy = device->Busy(); return DEVICE_OK;});
+
+	bool early = false;
+	Clock::time_point deadline = Clock::now() + chrono::microseconds((long long) (g_SettleTimeoutSec * 1e6));
+	while (!stop_)
+	{
+		bool moving = false;
+		for (int i = 0; i < count; i++)
+			moving = moving || sim_.IsMoving(first + i);
+		if (!moving)
+			break;
+		early = true;
+		if (Clock::now() > deadline)
+		{
+			fprintf(stderr, "soak: axis %d still moving %.0f s after the move\n", first, g_SettleTimeoutSec);
+			Count(&SoakWindow::offTargetMoves);
+			return false;
+		}
+		this_thread::sleep_for(chrono::milliseconds(1));
+	}
+	if (stop_)
+		return false;
+	if (early)
+		Count(&SoakWindow::earlyIdle);
+
+	if (target)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			long truth = lround(sim_.GetPosition(first + i));
+			if (labs(truth - target[i]) > 1)
+			{
+				fprintf(stderr, "soak: axis %d stopped at %ld instead of %ld\n", first + i, truth, target[i]);
+				Count(&SoakWindow::offTargetMoves);
+				break;
+			}
+		}
+	}
+
+	// a Busy() that gave up early can leave a position cached while moving
+	if (early)
+		return true;
+	long steps[2] = {0, 0};
+	int ret = Timed(caller, OpPosition, [&]() {
+		return isXY ? xyStage_->GetPositionSteps(steps[0], steps[1]) : zStage_->GetPositionSteps(steps[0]);
+	});
+	for (int i = 0; i < count && ret == DEVICE_OK; i++)
+	{
+		long truth = lround(sim_.GetPosition(first + i));
+		if (labs(steps[i] - truth) > 1)
+		{
+			fprintf(stderr, "soak: %s read axis %d at %ld after the move, controller is at %ld\n",
+				caller.name.c_str(), first + i, steps[i], truth);
+			Count(&SoakWindow::corruptReads);
+			break;
+		}
+	}
+	return true;
+}
+
+// Like a script or the property browser: properties are read and written back
+// unchanged, which still sends their commands to the controller
+void Soak::Script(Caller& caller)
+{
+	mt19937 random(2000);
+	uniform_int_distribution<int> pick(0, 3);
+	uniform_int_distribution<int> pause(200, 500);
+	Clock::time_point toggle = Clock::now();
+	bool positionUpdates = false;
+	while (!stop_)
+	{
+		if (chrono::duration<double>(Clock::now() - toggle).count() > g_PositionUpdatesToggleSec)
+		{
+			positionUpdates = !positionUpdates;
+			Timed(caller, OpProperty, [&]() {
+				return hub_->SetProperty("PositionUpdates", positionUpdates ? "On" : "Off");
+			});
+			toggle = Clock::now();
+		}
+
+		switch (pick(random))
+		{
+			case 0:
+				TouchProperty(caller, xy_, "Speed", true);
+				break;
+			case 1:
+				TouchProperty(caller, xy_, "StepSize-X", true);
+				break;
+			case 2:
+				TouchProperty(caller, z_, "Speed", true);
+				break;
+			default:
+				TouchProperty(caller, xy_, "MotionState", false);
+				TouchProperty(caller, z_, "MotionState", false);
+				break;
+		}
+		this_thread::sleep_for(chrono::milliseconds(pause(random)));
+	}
+}
+
+int Soak::TouchProperty(Caller& caller, MM::Device* device, const char* name, bool write)
+{
+	char value[MM::MaxStrLength] = "";
+	int ret = Timed(caller, OpProperty, [&]() {return device->GetProperty(name, value);});
+	if (ret != DEVICE_OK || !write)
+		return ret;
+	return Timed(caller, OpProperty, [&]() {return device->SetProperty(name, value);});
+}
+
+bool Soak::CheckStalls()
+{
+	long long now = UsSinceStart();
+	for (size_t i = 0; i < callers_.size(); i++)
+	{
+		int op = callers_[i]->op;
+		double stuckSec = (now - callers_[i]->sinceUs) / 1e6;
+		if (op == NumOps || stuckSec < options_.stallSec)
+			continue;
+
+		printf("\ndeadlock: %s stuck in %s for %.1f s\n", callers_[i]->name.c_str(), g_OpNames[op], stuckSec);
+		for (size_t j = 0; j < callers_.size(); j++)
+		{
+			int other = callers_[j]->op;
+			if (j == i)
+				continue;
+			if (other == NumOps)
+				printf("  %s outside the adapter\n", callers_[j]->name.c_str());
+			else
+				printf("  %s in %s for %.1f s\n", callers_[j]->name.c_str(), g_OpNames[other],
+					(now - callers_[j]->sinceUs) / 1e6);
+		}
+		return true;
+	}
+	return false;
+}
+
+void Soak::Report(int window, double elapsedSec, double windowSec, SoakWindow& w, long residentKb, unsigned long dropped)
+{
+	if (window == 1)
+		printf("%6s %8s %8s %15s %15s %15s %15s %7s %7s %7s %8s %9s\n", "window", "time s", "calls/s",
+			"busy p50/p95", "pos p50/p95", "move p50/p95", "prop p50/p95", "errors", "corrupt", "off", "dropped", "rss kB");
+
+	size_t calls = 0;
+	for (int op = 0; op < NumOps; op++)
+		calls += w.ms[op].size();
+	printf("%6d %8.0f %8.1f", window, elapsedSec, calls / windowSec);
+	for (int op = 0; op < NumOps; op++)
+	{
+		char latency[32];
+		double p50 = Percentile(w.ms[op], 0.5);
+		snprintf(latency, sizeof(latency), "%.1f/%.1f", p50, Percentile(w.ms[op], 0.95));
+		printf(" %15s", latency);
+	}
+	printf(" %7lu %7lu %7lu %8lu %9ld\n", w.errors, w.corruptReads, w.offTargetMoves, dropped, residentKb);
+	fflush(stdout);
+}
+
+int Soak::Run()
+{
+	for (int i = 0; i < options_.pollers; i++)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "poller %d", i + 1);
+		callers_.push_back(unique_ptr<Caller>(new Caller(name)));
+	}
+	callers_.push_back(unique_ptr<Caller>(new Caller("acquisition")));
+	callers_.push_back(unique_ptr<Caller>(new Caller("script")));
+
+	vector<thread> threads;
+	for (int i = 0; i < options_.pollers; i++)
+		threads.push_back(thread(&Soak::Poller, this, ref(*callers_[i]), (unsigned) (i + 1)));
+	threads.push_back(thread(&Soak::Acquisition, this, ref(*callers_[options_.pollers])));
+	threads.push_back(thread(&Soak::Script, this, ref(*callers_[options_.pollers + 1])));
+
+	struct Summary {double sec; double callsPerSec; double p95[NumOps]; long residentKb;};
+	vector<Summary> summaries;
+	unsigned long corruptReads = 0, offTargetMoves = 0, earlyIdle = 0;
+	unsigned long droppedBefore = sim_.GetDroppedBytes();
+	Clock::time_point windowStart = start_;
+	bool deadlock = false;
+	while (!deadlock)
+	{
+		this_thread::sleep_for(chrono::microseconds((long long) (g_WatchdogMs * 1000.0)));
+		deadlock = CheckStalls();
+		Clock::time_point now = Clock::now();
+		double elapsedSec = chrono::duration<double>(now - start_).count();
+		double windowSec = chrono::duration<double>(now - windowStart).count();
+		bool done = elapsedSec >= options_.durationSec;
+		if (windowSec < options_.reportSec && !done && !deadlock)
+			continue;
+
+		SoakWindow w;
+		{
+			lock_guard<mutex> guard(statsMutex_);
+			swap(w, window_);
+		}
+		windowStart = now;
+		unsigned long dropped = sim_.GetDroppedBytes();
+		Summary summary;
+		summary.sec = elapsedSec;
+		summary.callsPerSec = 0.0;
+		for (int op = 0; op < NumOps; op++)
+		{
+			summary.callsPerSec += w.ms[op].size() / windowSec;
+			summary.p95[op] = Percentile(w.ms[op], 0.95);
+		}
+		summary.residentKb = ResidentKb();
+		summaries.push_back(summary);
+		corruptReads += w.corruptReads;
+		offTargetMoves += w.offTargetMoves;
+		earlyIdle += w.earlyIdle;
+		Report((int) summaries.size(), elapsedSec, windowSec, w, summary.residentKb, dropped - droppedBefore);
+		droppedBefore = dropped;
+		if (done)
+			break;
+	}
+
+	if (deadlock)
+	{
+		// the stuck threads hold the adapter's locks, so neither they nor the
+		// devices can be shut down
+		fflush(stdout);
+		_Exit(SoakDeadlock);
+	}
+	stop_ = true;
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+
+	printf("\nerrors:");
+	if (errors_.empty())
+		printf(" none");
+	printf("\n");
+	for (map<int, unsigned long>::const_iterator it = errors_.begin(); it != errors_.end(); ++it)
+	{
+		char text[MM::MaxStrLength] = "";
+		if (!xy_->GetErrorText(it->first, text) && !z_->GetErrorText(it->first, text))
+			hub_->GetErrorText(it->first, text);
+		printf("  %8lu x %d: %s\n", it->second, it->first, text);
+	}
+	printf("corrupt reads %lu, off-target moves %lu, idle reported while moving %lu\n",
+		corruptReads, offTargetMoves, earlyIdle);
+
+	// first against last window; the first includes warm-up, so a soak wants
+	// at least three windows to tell drift from noise
+	if (summaries.size() >= 2)
+	{
+		const Summary& a = summaries.front();
+		const Summary& b = summaries.back();
+		printf("drift first -> last window:");
+		for (int op = 0; op < NumOps; op++)
+			printf(" %s p95 %.1f -> %.1f ms,", g_OpNames[op], a.p95[op], b.p95[op]);
+		printf(" %.1f -> %.1f calls/s\n", a.callsPerSec, b.callsPerSec);
+		double hours = (b.sec - a.sec) / 3600.0;
+		printf("memory %ld -> %ld kB (%+.0f kB/h)\n", a.residentKb, b.residentKb,
+			hours > 0.0 ? (b.residentKb - a.residentKb) / hours : 0.0);
+	}
+
+	return corruptReads > 0 || offTargetMoves > 0 ? SoakCorruption : SoakPassed;
+}
+
+} // namespace
+
+int RunSoak(MM::Device* hub, MM::Device* xy, MM::Device* z, CytoTableSim& sim, const SoakOptions& options)
+{
+	Soak soak(hub, xy, z, sim, options);
+	return soak.Run();
+}
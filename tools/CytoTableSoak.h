@@ -0,0 +1,55 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          CytoTableSoak.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Long running concurrency soak for the offline tools: GUI
+//                pollers, an acquisition thread and a script thread call the
+//                adapter at the same time while the simulator drops and
+//                delays bytes.
+//
+// LICENSE:       This library is free software; you can redistribute it and/or
+//                modify it under the terms of the GNU Lesser General Public
+//                License as published by the Free Software Foundation.
+//
+//                You should have received a copy of the GNU Lesser General Public
+//                License along with the source distribution; if not, write to
+//                the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+//                Boston, MA  02111-1307  USA
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+#ifndef _CYTOTABLESOAK_H_
+#define _CYTOTABLESOAK_H_
+
+#include "../../../../MMDevice/MMDevice.h"
+#include "CytoTableSim.h"
+
+struct SoakOptions
+{
+	SoakOptions() : durationSec(3600.0), reportSec(60.0), pollers(2), stallSec(30.0) {}
+
+	double durationSec;
+	double reportSec;   // one line of statistics per window
+	int pollers;        // GUI threads polling Busy and the positions
+	double stallSec;    // a call that takes longer counts as a deadlock
+};
+
+// Exit codes of RunSoak
+const int SoakPassed = 0;
+const int SoakCorruption = 1;   // wrong data with an OK status, or a move that ended off target
+const int SoakDeadlock = 3;
+
+// Runs the soak on initialized devices. X, Y and Z must be simulator axes
+// 1, 2 and 3, whose true positions every answer is checked against. Faults
+// are configured on the simulator by the caller. A deadlock ends the process
+// because the stuck threads can not be joined.
+int RunSoak(MM::Device* hub, MM::Device* xy, MM::Device* z, CytoTableSim& sim, const SoakOptions& options);
+
+#endif //_CYTOTABLESOAK_H_
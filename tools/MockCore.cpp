@@ -0,0 +1,549 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          MockCore.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Minimal MM::Core for running the adapter outside of
+//                Micro-Manager.
+//
+// LICENSE:       This library is free software; you can redistribute it and/or
+//                modify it under the terms of the GNU Lesser General Public
+//                License as published by the Free Software Foundation.
+//                
+//                You should have received a copy of the GNU Lesser General Public
+//                License along with the source distribution; if not, write to
+//                the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+//                Boston, MA  02111-1307  USA
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES. 
+//
+#include "MockCore.h"
+
+#ifdef WIN32
+   #include <windows.h>
+#else
+   #include <fcntl.h>
+   #include <termios.h>
+   #include <unistd.h>
+#endif
+
+#include <chrono>
+#include <cstdio>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <thread>
+
+using namespace std;
+
+int SimLink::Write(const unsigned char* buf, unsigned long length)
+{
+	if (!open_)
+		return DEVICE_SERIAL_COMMAND_FAILED;
+	sim_.Write(buf, length);
+	return DEVICE_OK;
+}
+
+int SimLink::Read(unsigned char* buf, unsigned long length, unsigned long& read)
+{
+	read = 0;
+	if (!open_)
+		return DEVICE_SERIAL_COMMAND_FAILED;
+	read = sim_.Read(buf, length);
+	return DEVICE_OK;
+}
+
+int SimLink::Purge()
+{
+	sim_.Purge();
+	return DEVICE_OK;
+}
+
+void SimLink::Disconnect()
+{
+	open_ = false;
+}
+
+int SimLink::Reconnect()
+{
+	if (!plugged_)
+		return DEVICE_NOT_CONNECTED;
+	// whatever the controller sent to the old handle is gone
+	sim_.Purge();
+	open_ = true;
+	return DEVICE_OK;
+}
+
+void SimLink::Unplug()
+{
+	plugged_ = false;
+	open_ = false;
+}
+
+void SimLink::Replug()
+{
+	plugged_ = true;
+}
+
+#ifdef WIN32
+TtyLink::TtyLink() :
+	baud_(9600),
+	handle_(INVALID_HANDLE_VALUE)
+{
+}
+#else
+TtyLink::TtyLink() :
+	baud_(9600),
+	fd_(-1)
+{
+}
+#endif
+
+TtyLink::~TtyLink()
+{
+	Close();
+}
+
+void TtyLink::Disconnect()
+{
+	Close();
+}
+
+int TtyLink::Reconnect()
+{
+	return Open(device_, baud_) ? DEVICE_OK : DEVICE_NOT_CONNECTED;
+}
+
+#ifdef WIN32
+bool TtyLink::Open(const std::string& device, long baud)
+{
+	Close();
+	device_ = device;
+	baud_ = baud;
+	string path = device.compare(0, 4, "\\\\.\\") == 0 ? device : "\\\\.\\" + device;
+	handle_ = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, 0, 0);
+	if (handle_ == INVALID_HANDLE_VALUE)
+		return false;
+
+	DCB dcb;
+	memset(&dcb, 0, sizeof(dcb));
+	dcb.DCBlength = sizeof(dcb);
+	GetCommState(handle_, &dcb);
+	dcb.BaudRate = (DWORD) baud;
+	dcb.ByteSize = 8;
+	dcb.Parity = NOPARITY;
+	dcb.StopBits = ONESTOPBIT;
+	dcb.fOutxCtsFlow = FALSE;
+	dcb.fRtsControl = RTS_CONTROL_ENABLE;
+	dcb.fOutX = FALSE;
+	dcb.fInX = FALSE;
+	// return immediately with whatever has arrived
+	COMMTIMEOUTS timeouts;
+	memset(&timeouts, 0, sizeof(timeouts));
+	timeouts.ReadIntervalTimeout = MAXDWORD;
+	if (!SetCommState(handle_, &dcb) || !SetCommTimeouts(handle_, &timeouts))
+	{
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void TtyLink::Close()
+{
+	if (handle_ != INVALID_HANDLE_VALUE)
+		CloseHandle(handle_);
+	handle_ = INVALID_HANDLE_VALUE;
+}
+
+bool TtyLink::IsOpen() const
+{
+	return handle_ != INVALID_HANDLE_VALUE;
+}
+
+int TtyLink::Write(const unsigned char* buf, unsigned long length)
+{
+	DWORD written = 0;
+	if (!WriteFile(handle_, buf, length, &written, 0) || written != length)
+		return DEVICE_SERIAL_COMMAND_FAILED;
+	return DEVICE_OK;
+}
+
+int TtyLink::Read(unsigned char* buf, unsigned long length, unsigned long& read)
+{
+	DWORD got = 0;
+	if (!ReadFile(handle_, buf, length, &got, 0))
+		return DEVICE_SERIAL_COMMAND_FAILED;
+	read = got;
+	return DEVICE_OK;
+}
+
+int TtyLink::Purge()
+{
+	PurgeComm(handle_, PURGE_RXCLEAR | PURGE_TXCLEAR);
+	return DEVICE_OK;
+}
+#else
+namespace {
+
+speed_t BaudConstant(long baud)
+{
+	switch (baud)
+	{
+		case 1200: return B1200;
+		case 2400: return B2400;
+		case 4800: return B4800;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+		default: return B9600;
+	}
+}
+
+} // namespace
+
+bool TtyLink::Open(const std::string& device, long baud)
+{
+	Close();
+	device_ = device;
+	baud_ = baud;
+	fd_ = open(device.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd_ < 0)
+		return false;
+
+	struct termios tio;
+	if (tcgetattr(fd_, &tio) != 0)
+	{
+		Close();
+		return false;
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag &= ~(CSTOPB | CRTSCTS | PARENB);
+	tio.c_cflag |= CLOCAL | CREAD | CS8;
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, BaudConstant(baud));
+	cfsetospeed(&tio, BaudConstant(baud));
+	if (tcsetattr(fd_, TCSANOW, &tio) != 0)
+	{
+		Close();
+		return false;
+	}
+	tcflush(fd_, TCIOFLUSH);
+	return true;
+}
+
+void TtyLink::Close()
+{
+	if (fd_ >= 0)
+		close(fd_);
+	fd_ = -1;
+}
+
+bool TtyLink::IsOpen() const
+{
+	return fd_ >= 0;
+}
+
+int TtyLink::Write(const unsigned char* buf, unsigned long length)
+{
+	unsigned long written = 0;
+	while (written < length)
+	{
+		ssize_t n = write(fd_, buf + written, length - written);
+		if (n < 0 && errno != EAGAIN && errno != EINTR)
+			return DEVICE_SERIAL_COMMAND_FAILED;
+		if (n > 0)
+			written += n;
+		else
+			this_thread::sleep_for(chrono::microseconds(100));
+	}
+	return DEVICE_OK;
+}
+
+int TtyLink::Read(unsigned char* buf, unsigned long length, unsigned long& read)
+{
+	read = 0;
+	ssize_t n = ::read(fd_, buf, length);
+	if (n < 0)
+		return errno == EAGAIN || errno == EINTR ? DEVICE_OK : DEVICE_SERIAL_COMMAND_FAILED;
+	read = (unsigned long) n;
+	return DEVICE_OK;
+}
+
+int TtyLink::Purge()
+{
+	tcflush(fd_, TCIOFLUSH);
+	return DEVICE_OK;
+}
+#endif
+
+MockCore::MockCore() :
+	hub_(0),
+	answerTimeoutMs_(500.0),
+	verbose_(false),
+	positionNotifications_(0),
+	propertyNotifications_(0)
+{
+}
+
+MockCore::~MockCore()
+{
+	for (map<string, MockPort*>::iterator it = portDevices_.begin(); it != portDevices_.end(); ++it)
+		delete it->second;
+}
+
+void MockCore::AddPort(const std::string& name, SerialLink* link)
+{
+	ports_[name] = link;
+	delete portDevices_[name];
+	portDevices_[name] = new MockPort(name, link);
+	portDevices_[name]->SetCallback(this);
+}
+
+void MockCore::AddDevice(const std::string& label, MM::Device* device)
+{
+	devices_[label] = device;
+	device->SetLabel(label.c_str());
+	device->SetCallback(this);
+	if (!hub_ && device->GetType() == MM::HubDevice)
+		hub_ = static_cast<MM::Hub*>(device);
+}
+
+SerialLink* MockCore::FindPort(const char* name) const
+{
+	map<string, SerialLink*>::const_iterator it = ports_.find(name);
+	return it == ports_.end() ? 0 : it->second;
+}
+
+int MockCore::LogMessage(const MM::Device* caller, const char* msg, bool debugOnly) const
+{
+	if (!verbose_ && debugOnly)
+		return DEVICE_OK;
+
+	char label[MM::MaxStrLength] = "";
+	if (caller)
+		caller->GetName(label);
+	lock_guard<mutex> guard(logMutex_);
+	fprintf(stderr, "[%s] %s\n", label, msg);
+	return DEVICE_OK;
+}
+
+MM::Device* MockCore::GetDevice(const MM::Device* /*caller*/, const char* label)
+{
+	map<string, MM::Device*>::iterator it = devices_.find(label);
+	if (it != devices_.end())
+		return it->second;
+	map<string, MockPort*>::iterator port = portDevices_.find(label);
+	return port == portDevices_.end() ? 0 : port->second;
+}
+
+int MockCore::GetDeviceProperty(const char* deviceName, const char* propName, char* value)
+{
+	MM::Device* device = GetDevice(0, deviceName);
+	if (!device)
+		return DEVICE_ERR;
+	return device->GetProperty(propName, value);
+}
+
+int MockCore::SetDeviceProperty(const char* deviceName, const char* propName, const char* value)
+{
+	// serial port settings are meaningless for the simulator
+	if (FindPort(deviceName))
+		return DEVICE_OK;
+	MM::Device* device = GetDevice(0, deviceName);
+	if (!device)
+		return DEVICE_ERR;
+	return device->SetProperty(propName, value);
+}
+
+void MockCore::GetLoadedDeviceOfType(const MM::Device* /*caller*/, MM::DeviceType devType, char* pDeviceName, const unsigned int deviceIterator)
+{
+	unsigned int n = 0;
+	pDeviceName[0] = 0;
+	for (map<string, MM::Device*>::iterator it = devices_.begin(); it != devices_.end(); ++it)
+	{
+		if (it->second->GetType() != devType)
+			continue;
+		if (n++ == deviceIterator)
+		{
+			strncpy(pDeviceName, it->first.c_str(), MM::MaxStrLength - 1);
+			pDeviceName[MM::MaxStrLength - 1] = 0;
+			return;
+		}
+	}
+}
+
+int MockCore::SetSerialProperties(const char* /*portName*/, const char* answerTimeout, const char* /*baudRate*/, const char* /*delayBetweenCharsMs*/, const char* /*handshaking*/, const char* /*parity*/, const char* /*stopBits*/)
+{
+	if (answerTimeout)
+		answerTimeoutMs_ = atof(answerTimeout);
+	return DEVICE_OK;
+}
+
+int MockCore::SetSerialCommand(const MM::Device* caller, const char* portName, const char* command, const char* term)
+{
+	string frame = string(command) + term;
+	return WriteToSerial(caller, portName, (const unsigned char*) frame.data(), (unsigned long) frame.length());
+}
+
+// Reads until term like the core's serial manager, which strips the
+// terminator from the answer
+int MockCore::GetSerialAnswer(const MM::Device* /*caller*/, const char* portName, unsigned long ansLength, char* answer, const char* term)
+{
+	SerialLink* link = FindPort(portName);
+	if (!link)
+		return DEVICE_NOT_CONNECTED;
+
+	string received;
+	size_t termLength = strlen(term);
+	chrono::steady_clock::time_point deadline = chrono::steady_clock::now() +
+		chrono::microseconds((long long) (answerTimeoutMs_ * 1000.0));
+	while (true)
+	{
+		unsigned char c;
+		unsigned long read = 0;
+		int ret = link->Read(&c, 1, read);
+		if (ret != DEVICE_OK)
+			return ret;
+		if (read == 1)
+		{
+			received += (char) c;
+			if (received.length() >= termLength &&
+				received.compare(received.length() - termLength, termLength, term) == 0)
+			{
+				received.resize(received.length() - termLength);
+				break;
+			}
+			continue;
+		}
+		if (chrono::steady_clock::now() > deadline)
+			return DEVICE_SERIAL_TIMEOUT;
+		this_thread::sleep_for(chrono::microseconds(100));
+	}
+
+	if (received.length() >= ansLength)
+		return DEVICE_BUFFER_OVERFLOW;
+	memcpy(answer, received.c_str(), received.length() + 1);
+	return DEVICE_OK;
+}
+
+int MockCore::WriteToSerial(const MM::Device* /*caller*/, const char* port, const unsigned char* buf, unsigned long length)
+{
+	SerialLink* link = FindPort(port);
+	if (!link)
+		return DEVICE_NOT_CONNECTED;
+	return link->Write(buf, length);
+}
+
+int MockCore::ReadFromSerial(const MM::Device* /*caller*/, const char* port, unsigned char* buf, unsigned long length, unsigned long& read)
+{
+	SerialLink* link = FindPort(port);
+	if (!link)
+		return DEVICE_NOT_CONNECTED;
+	return link->Read(buf, length, read);
+}
+
+int MockCore::PurgeSerial(const MM::Device* /*caller*/, const char* portName)
+{
+	SerialLink* link = FindPort(portName);
+	if (!link)
+		return DEVICE_NOT_CONNECTED;
+	return link->Purge();
+}
+
+MM::PortType MockCore::GetSerialPortType(const char* /*portName*/) const
+{
+	return MM::SerialPort;
+}
+
+int MockCore::OnPropertiesChanged(const MM::Device* /*caller*/) {return DEVICE_OK;}
+
+int MockCore::OnPropertyChanged(const MM::Device* caller, const char* propName, const char* propValue)
+{
+	propertyNotifications_++;
+	if (verbose_)
+	{
+		ostringstream os;
+		os << propName << " = " << propValue;
+		LogMessage(caller, os.str().c_str(), true);
+	}
+	return DEVICE_OK;
+}
+
+int MockCore::OnStagePositionChanged(const MM::Device* caller, double pos)
+{
+	positionNotifications_++;
+	if (verbose_)
+	{
+		ostringstream os;
+		os << "position " << pos;
+		LogMessage(caller, os.str().c_str(), true);
+	}
+	return DEVICE_OK;
+}
+
+int MockCore::OnXYStagePositionChanged(const MM::Device* caller, double xPos, double yPos)
+{
+	positionNotifications_++;
+	if (verbose_)
+	{
+		ostringstream os;
+		os << "position " << xPos << " " << yPos;
+		LogMessage(caller, os.str().c_str(), true);
+	}
+	return DEVICE_OK;
+}
+
+int MockCore::OnExposureChanged(const MM::Device* /*caller*/, double /*newExposure*/) {return DEVICE_OK;}
+int MockCore::OnSLMExposureChanged(const MM::Device* /*caller*/, double /*newExposure*/) {return DEVICE_OK;}
+int MockCore::OnMagnifierChanged(const MM::Device* /*caller*/) {return DEVICE_OK;}
+
+unsigned long MockCore::GetClockTicksUs(const MM::Device* /*caller*/)
+{
+	return (unsigned long) GetCurrentMMTime().getUsec();
+}
+
+MM::MMTime MockCore::GetCurrentMMTime()
+{
+	long long us = chrono::duration_cast<chrono::microseconds>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+	return MM::MMTime((long) (us / 1000000), (long) (us % 1000000));
+}
+
+int MockCore::AcqFinished(const MM::Device* /*caller*/, int /*statusCode*/) {return DEVICE_OK;}
+int MockCore::PrepareForAcq(const MM::Device* /*caller*/) {return DEVICE_OK;}
+int MockCore::InsertImage(const MM::Device* /*caller*/, const ImgBuffer& /*buf*/) {return DEVICE_UNSUPPORTED_COMMAND;}
+int MockCore::InsertImage(const MM::Device* /*caller*/, const unsigned char* /*buf*/, unsigned /*width*/, unsigned /*height*/, unsigned /*byteDepth*/, unsigned /*nComponents*/, const char* /*serializedMetadata*/, const bool /*doProcess*/) {return DEVICE_UNSUPPORTED_COMMAND;}
+int MockCore::InsertImage(const MM::Device* /*caller*/, const unsigned char* /*buf*/, unsigned /*width*/, unsigned /*height*/, unsigned /*byteDepth*/, const char* /*serializedMetadata*/, const bool /*doProcess*/) {return DEVICE_UNSUPPORTED_COMMAND;}
+void MockCore::ClearImageBuffer(const MM::Device* /*caller*/) {}
+bool MockCore::InitializeImageBuffer(unsigned /*channels*/, unsigned /*slices*/, unsigned int /*w*/, unsigned int /*h*/, unsigned int /*pixDepth*/) {return false;}
+const char* MockCore::GetImage() {return 0;}
+int MockCore::GetImageDimensions(int& width, int& height, int& depth) {width = height = depth = 0; return DEVICE_UNSUPPORTED_COMMAND;}
+int MockCore::GetFocusPosition(double& /*pos*/) {return DEVICE_UNSUPPORTED_COMMAND;}
+int MockCore::SetFocusPosition(double /*pos*/) {return DEVICE_UNSUPPORTED_COMMAND;}
+int MockCore::MoveFocus(double /*velocity*/) {return DEVICE_UNSUPPORTED_COMMAND;}
+int MockCore::SetXYPosition(double /*x*/, double /*y*/) {return DEVICE_UNSUPPORTED_COMMAND;}
+int MockCore::GetXYPosition(double& /*x*/, double& /*y*/) {return DEVICE_UNSUPPORTED_COMMAND;}
+int MockCore::MoveXYStage(double /*vX*/, double /*vY*/) {return DEVICE_UNSUPPORTED_COMMAND;}
+int MockCore::SetExposure(double /*expMs*/) {return DEVICE_UNSUPPORTED_COMMAND;}
+int MockCore::GetExposure(double& /*expMs*/) {return DEVICE_UNSUPPORTED_COMMAND;}
+int MockCore::SetConfig(const char* /*group*/, const char* /*name*/) {return DEVICE_UNSUPPORTED_COMMAND;}
+int MockCore::GetCurrentConfig(const char* /*group*/, int /*bufLen*/, char* /*name*/) {return DEVICE_UNSUPPORTED_COMMAND;}
+int MockCore::GetChannelConfig(char* /*channelConfigName*/, const unsigned int /*channelConfigIterator*/) {return DEVICE_UNSUPPORTED_COMMAND;}
+MM::ImageProcessor* MockCore::GetImageProcessor(const MM::Device* /*caller*/) {return 0;}
+MM::AutoFocus* MockCore::GetAutoFocus(const MM::Device* /*caller*/) {return 0;}
+MM::Hub* MockCore::GetParentHub(const MM::Device* caller) const {return caller == hub_ ? 0 : hub_;}
+MM::State* MockCore::GetStateDevice(const MM::Device* /*caller*/, const char* /*deviceName*/) {return 0;}
+MM::SignalIO* MockCore::GetSignalIODevice(const MM::Device* /*caller*/, const char* /*deviceName*/) {return 0;}
+void MockCore::ClearPostedErrors() {}
+void MockCore::PostError(const int /*errorCode*/, const char* message) {LogMessage(0, message, false);}
+void MockCore::GetNextPostedError(int& errorCode, char* pMessage, int /*maxlen*/, int& messageLength) {errorCode = 0; pMessage[0] = 0; messageLength = 0;}
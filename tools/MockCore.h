@@ -0,0 +1,204 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          MockCore.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Minimal MM::Core for running the adapter outside of
+//                Micro-Manager: the serial side is backed by the simulator
+//                (or a real port), everything else is a stub.
+//
+// LICENSE:       This library is free software; you can redistribute it and/or
+//                modify it under the terms of the GNU Lesser General Public
+//                License as published by the Free Software Foundation.
+//                
+//                You should have received a copy of the GNU Lesser General Public
+//                License along with the source distribution; if not, write to
+//                the Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+//                Boston, MA  02111-1307  USA
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES. 
+//
+#ifndef _MOCKCORE_H_
+#define _MOCKCORE_H_
+
+#include "../../../../MMDevice/MMDevice.h"
+#include "../../../../MMDevice/DeviceBase.h"
+#include "CytoTableSim.h"
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Byte transport behind a port name
+class SerialLink
+{
+public:
+	virtual ~SerialLink() {}
+	virtual int Write(const unsigned char* buf, unsigned long length) = 0;
+	virtual int Read(unsigned char* buf, unsigned long length, unsigned long& read) = 0;
+	virtual int Purge() = 0;
+	// Shutdown and Initialize of the port device: close the handle, open it
+	// again with the same settings
+	virtual void Disconnect() = 0;
+	virtual int Reconnect() = 0;
+};
+
+class SimLink : public SerialLink
+{
+public:
+	SimLink(CytoTableSim& sim) : sim_(sim), plugged_(true), open_(true) {}
+	int Write(const unsigned char* buf, unsigned long length);
+	int Read(unsigned char* buf, unsigned long length, unsigned long& read);
+	int Purge();
+	void Disconnect();
+	int Reconnect();
+
+	// USB dropout: the open handle fails from now on, also after the cable
+	// is back, until the port is reopened. The controller carries on.
+	void Unplug();
+	void Replug();
+
+private:
+	CytoTableSim& sim_;
+	std::atomic<bool> plugged_;
+	std::atomic<bool> open_;
+};
+
+// Real serial port, raw 8N1 without handshaking; Read never blocks
+class TtyLink : public SerialLink
+{
+public:
+	TtyLink();
+	~TtyLink();
+
+	bool Open(const std::string& device, long baud);
+	void Close();
+	bool IsOpen() const;
+
+	int Write(const unsigned char* buf, unsigned long length);
+	int Read(unsigned char* buf, unsigned long length, unsigned long& read);
+	int Purge();
+	void Disconnect();
+	int Reconnect();
+
+private:
+	std::string device_;
+	long baud_;
+#ifdef WIN32
+	void* handle_;
+#else
+	int fd_;
+#endif
+};
+
+// A port as a device, for adapters that reopen it through GetDevice() like
+// MMCore's serial ports: Shutdown closes the link, Initialize opens it again
+class MockPort : public CGenericBase<MockPort>
+{
+public:
+	MockPort(const std::string& name, SerialLink* link) : name_(name), link_(link) {}
+
+	int Initialize() {return link_->Reconnect();}
+	int Shutdown() {link_->Disconnect(); return DEVICE_OK;}
+	void GetName(char* name) const {CDeviceUtils::CopyLimitedString(name, name_.c_str());}
+	bool Busy() {return false;}
+
+private:
+	std::string name_;
+	SerialLink* link_;
+};
+
+class MockCore : public MM::Core
+{
+public:
+	MockCore();
+	~MockCore();
+
+	void AddPort(const std::string& name, SerialLink* link);
+	void SetAnswerTimeoutMs(double ms) {answerTimeoutMs_ = ms;}
+	// devices created from the adapter; the first hub becomes everybody's parent
+	void AddDevice(const std::string& label, MM::Device* device);
+	void SetVerbose(bool verbose) {verbose_ = verbose;}
+
+	// callbacks received from the devices
+	unsigned long GetPositionNotifications() const {return positionNotifications_;}
+	unsigned long GetPropertyNotifications() const {return propertyNotifications_;}
+
+	// the adapter side of MM::Core
+	int LogMessage(const MM::Device* caller, const char* msg, bool debugOnly) const;
+	MM::Device* GetDevice(const MM::Device* caller, const char* label);
+	int GetDeviceProperty(const char* deviceName, const char* propName, char* value);
+	int SetDeviceProperty(const char* deviceName, const char* propName, const char* value);
+	void GetLoadedDeviceOfType(const MM::Device* caller, MM::DeviceType devType, char* pDeviceName, const unsigned int deviceIterator);
+
+	int SetSerialProperties(const char* portName, const char* answerTimeout, const char* baudRate, const char* delayBetweenCharsMs, const char* handshaking, const char* parity, const char* stopBits);
+	int SetSerialCommand(const MM::Device* caller, const char* portName, const char* command, const char* term);
+	int GetSerialAnswer(const MM::Device* caller, const char* portName, unsigned long ansLength, char* answer, const char* term);
+	int WriteToSerial(const MM::Device* caller, const char* port, const unsigned char* buf, unsigned long length);
+	int ReadFromSerial(const MM::Device* caller, const char* port, unsigned char* buf, unsigned long length, unsigned long& read);
+	int PurgeSerial(const MM::Device* caller, const char* portName);
+	MM::PortType GetSerialPortType(const char* portName) const;
+
+	int OnPropertiesChanged(const MM::Device* caller);
+	int OnPropertyChanged(const MM::Device* caller, const char* propName, const char* propValue);
+	int OnStagePositionChanged(const MM::Device* caller, double pos);
+	int OnXYStagePositionChanged(const MM::Device* caller, double xPos, double yPos);
+	int OnExposureChanged(const MM::Device* caller, double newExposure);
+	int OnSLMExposureChanged(const MM::Device* caller, double newExposure);
+	int OnMagnifierChanged(const MM::Device* caller);
+
+	unsigned long GetClockTicksUs(const MM::Device* caller);
+	MM::MMTime GetCurrentMMTime();
+
+	// not used by the adapter
+	int AcqFinished(const MM::Device* caller, int statusCode);
+	int PrepareForAcq(const MM::Device* caller);
+	int InsertImage(const MM::Device* caller, const ImgBuffer& buf);
+	int InsertImage(const MM::Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, unsigned nComponents, const char* serializedMetadata, const bool doProcess = true);
+	int InsertImage(const MM::Device* caller, const unsigned char* buf, unsigned width, unsigned height, unsigned byteDepth, const char* serializedMetadata = 0, const bool doProcess = true);
+	void ClearImageBuffer(const MM::Device* caller);
+	bool InitializeImageBuffer(unsigned channels, unsigned slices, unsigned int w, unsigned int h, unsigned int pixDepth);
+	const char* GetImage();
+	int GetImageDimensions(int& width, int& height, int& depth);
+	int GetFocusPosition(double& pos);
+	int SetFocusPosition(double pos);
+	int MoveFocus(double velocity);
+	int SetXYPosition(double x, double y);
+	int GetXYPosition(double& x, double& y);
+	int MoveXYStage(double vX, double vY);
+	int SetExposure(double expMs);
+	int GetExposure(double& expMs);
+	int SetConfig(const char* group, const char* name);
+	int GetCurrentConfig(const char* group, int bufLen, char* name);
+	int GetChannelConfig(char* channelConfigName, const unsigned int channelConfigIterator);
+	MM::ImageProcessor* GetImageProcessor(const MM::Device* caller);
+	MM::AutoFocus* GetAutoFocus(const MM::Device* caller);
+	MM::Hub* GetParentHub(const MM::Device* caller) const;
+	MM::State* GetStateDevice(const MM::Device* caller, const char* deviceName);
+	MM::SignalIO* GetSignalIODevice(const MM::Device* caller, const char* deviceName);
+	void ClearPostedErrors();
+	void PostError(const int errorCode, const char* message);
+	void GetNextPostedError(int& errorCode, char* pMessage, int maxlen, int& messageLength);
+
+private:
+	SerialLink* FindPort(const char* name) const;
+
+	std::map<std::string, SerialLink*> ports_;
+	std::map<std::string, MockPort*> portDevices_;
+	std::map<std::string, MM::Device*> devices_;
+	MM::Hub* hub_;
+	double answerTimeoutMs_;
+	bool verbose_;
+	mutable std::mutex logMutex_;
+	std::atomic<unsigned long> positionNotifications_;
+	std::atomic<unsigned long> propertyNotifications_;
+};
+
+#endif //_MOCKCORE_H_